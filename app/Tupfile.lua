@@ -13,6 +13,15 @@ CoreObjects = Define.Objects
 {
 	Sources = Item()
 		+ 'core.cxx'
+		+ 'storagecopy.cxx'
+		+ 'storagereader.cxx'
+		+ 'storageview.cxx'
+		+ 'writeplan.cxx'
+		+ 'stagedchange.cxx'
+		+ 'chunkstore.cxx'
+		+ 'overlaystore.cxx'
+		+ 'packstore.cxx'
+		+ 'garbagecollector.cxx'
 		+ 'log.cxx'
 		+ 'md5/hash.cxx'
 		+ 'md5/md5.c'
@@ -23,7 +32,7 @@ CoreObjects = Define.Objects
 Define.Executable
 {
 	Name = 'goldensync',
-	LinkFlags = '-lsqlite3',
+	LinkFlags = '-lsqlite3 -pthread',
 	Sources = Item()
 		+ 'main.cxx'
 		,
@@ -0,0 +1,324 @@
+#include "chunkstore.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <random>
+
+#include "md5/hash.h"
+
+constexpr size_t SplitWindowSize = 1 << 20;
+
+static std::array<uint64_t, 256> const &GetGear(void)
+{
+	static std::array<uint64_t, 256> const Gear = [](void)
+	{
+		// The mt19937_64 sequence is fixed by the standard, so boundaries don't depend on the platform
+		std::mt19937_64 Generator(0x676f6c64656e);
+		std::array<uint64_t, 256> Out;
+		for (auto &Value : Out) Value = Generator();
+		return Out;
+	}();
+	return Gear;
+}
+
+ChunkerT::ChunkerT(ChunkSettingsT const &Settings) :
+	MinSize(Settings.MinSize),
+	MaxSize(Settings.MaxSize),
+	Mask(0)
+{
+	AssertGT(Settings.MinSize, 0u);
+	AssertLT(Settings.MinSize, Settings.AverageSize);
+	AssertLTE(Settings.AverageSize, Settings.MaxSize);
+
+	// Boundaries are only tested after MinSize bytes, so the mask only needs to cover the rest of the average.
+	// Test the high bits, which depend on the last 64 bytes rather than just the last few.
+	size_t Bits = 0;
+	while ((size_t(2) << Bits) <= Settings.AverageSize - Settings.MinSize) ++Bits;
+	if (Bits > 0) Mask = ~uint64_t(0) << (64 - Bits);
+}
+
+size_t ChunkerT::Next(uint8_t const *Data, size_t Length, bool Final) const
+{
+	auto const &Gear = GetGear();
+	if (Length <= MinSize) return Final ? Length : 0;
+	auto const Limit = std::min(Length, MaxSize);
+	uint64_t Hash = 0;
+	for (size_t Index = MinSize; Index < Limit; ++Index)
+	{
+		Hash = (Hash << 1) + Gear[Data[Index]];
+		if (!(Hash & Mask)) return Index + 1;
+	}
+	if (Limit == MaxSize) return MaxSize;
+	return Final ? Length : 0;
+}
+
+ChunkStoreT::ChunkStoreT(
+	Filesystem::PathT const &Root, 
+	CoreDatabaseT &Database, 
+	GarbageCollectorT &Garbage, 
+	UnsyncedFilesT &Unsynced, 
+	ChunkSettingsT const &Settings) :
+	Log("chunks"),
+	Root(Root),
+	Database(Database),
+	Garbage(Garbage),
+	Unsynced(Unsynced),
+	Chunker(Settings),
+	MaxSize(Settings.MaxSize)
+{
+	Root.CreateDirectory();
+	CreatedPrefixes.fill(false);
+}
+
+void ChunkStoreT::Import(StorageIDT const &ID, StorageReaderT &Source)
+{
+	auto const Size = Source.Size();
+	LOG(Log, Spam, StringT() << "Importing " << Size << " bytes as " << ID);
+	Reference(ID, Split(0, Size, [&](uint64_t Offset, uint8_t *Out, size_t Length)
+	{
+		if (Source.Read(Offset, Out, Length) < Length)
+			throw SYSTEM_ERROR << "Storage was truncated while importing it as " << ID;
+	}));
+}
+
+void ChunkStoreT::Clone(StorageIDT const &From, StorageIDT const &To)
+{
+	LOG(Log, Spam, StringT() << "Cloning chunks of " << From << " to " << To);
+	Reference(To, List(From));
+}
+
+void ChunkStoreT::Write(StorageIDT const &ID, std::vector<BytesChangeT> const &Changes)
+{
+	WritePlanT const Plan(Changes);
+	std::vector<RangeT> Ranges;
+	for (auto const &Run : Plan.GetRuns()) Ranges.push_back(RangeT{Run.Offset, Run.Offset + Run.Length});
+	Rewrite(
+		ID, 
+		Ranges, 
+		[&Plan](uint64_t OldSize) { return std::max(OldSize, Plan.GetEnd()); },
+		[&Plan](uint64_t Offset, uint8_t *Out, size_t Length) { Plan.Apply(Offset, Out, Length); });
+}
+
+void ChunkStoreT::Resize(StorageIDT const &ID, uint64_t Length)
+{
+	LOG(Log, Spam, StringT() << "Resizing chunked storage " << ID << " to " << Length);
+	Rewrite(
+		ID, 
+		{}, 
+		[Length](uint64_t) { return Length; },
+		[](uint64_t, uint8_t *, size_t) {});
+}
+
+void ChunkStoreT::Zero(StorageIDT const &ID, uint64_t Offset, uint64_t Length)
+{
+	auto const End = Offset + Length;
+	Rewrite(
+		ID, 
+		{RangeT{Offset, End}}, 
+		[](uint64_t OldSize) { return OldSize; },
+		[Offset, End](uint64_t FillOffset, uint8_t *Out, size_t FillLength)
+		{
+			auto const Start = std::max(Offset, FillOffset);
+			auto const Stop = std::min(End, FillOffset + FillLength);
+			if (Start < Stop) std::fill(Out + (Start - FillOffset), Out + (Stop - FillOffset), 0);
+		});
+}
+
+void ChunkStoreT::Release(StorageIDT const &ID)
+{
+	LOG(Log, Spam, StringT() << "Releasing chunks of " << ID);
+	auto const Chunks = List(ID);
+	Database.DeleteStorageChunks(ID, 0, std::numeric_limits<int64_t>::max());
+	for (auto const &Chunk : Chunks) Unreference(Chunk.Hash());
+}
+
+void ChunkStoreT::Rewrite(
+	StorageIDT const &ID, 
+	std::vector<RangeT> const &Ranges, 
+	function<uint64_t(uint64_t OldSize)> const &GetNewSize, 
+	FillT const &Apply)
+{
+	auto const Chunks = List(ID);
+	uint64_t const OldSize = Chunks.empty() ? 0 : Chunks.back().Offset() + Chunks.back().Size();
+	uint64_t const NewSize = GetNewSize(OldSize);
+
+	auto Containing = [&Chunks](uint64_t Offset) -> StorageChunkT const &
+	{
+		auto Found = std::upper_bound(
+			Chunks.begin(),
+			Chunks.end(),
+			Offset,
+			[](uint64_t Offset, StorageChunkT const &Chunk) { return Offset < Chunk.Offset(); });
+		Assert(Found != Chunks.begin());
+		return *(Found - 1);
+	};
+
+	// Widen each range to the chunks it touches, then merge overlapping ranges
+	std::vector<RangeT> Regions;
+	auto Widen = [&](uint64_t Start, uint64_t End)
+	{
+		End = std::min(End, NewSize);
+		if (Start >= End) return;
+		if (Chunks.empty()) Start = 0;
+		// Writing at or past the end re-splits the last chunk, which is usually short
+		else if (Start >= OldSize) Start = Chunks.back().Offset();
+		else Start = Containing(Start).Offset();
+		if (End < OldSize)
+		{
+			auto const &Last = Containing(End - 1);
+			End = std::min(Last.Offset() + Last.Size(), NewSize);
+		}
+		Regions.push_back(RangeT{Start, End});
+	};
+	for (auto const &Range : Ranges) Widen(Range.Start, Range.End);
+	// Growing re-splits from the old last chunk, shrinking re-splits the chunk at the new end
+	if (NewSize > OldSize) Widen(OldSize, NewSize);
+	else if ((NewSize < OldSize) && (NewSize > 0)) Widen(NewSize - 1, NewSize);
+
+	std::vector<std::string> Replaced;
+	if (NewSize < OldSize)
+	{
+		for (auto const &Chunk : Chunks)
+			if (Chunk.Offset() >= NewSize) Replaced.push_back(Chunk.Hash());
+		Database.DeleteStorageChunks(ID, NewSize, std::numeric_limits<int64_t>::max());
+	}
+	if (!Regions.empty())
+	{
+		std::sort(
+			Regions.begin(),
+			Regions.end(),
+			[](RangeT const &First, RangeT const &Second) { return First.Start < Second.Start; });
+		std::vector<RangeT> Merged{Regions.front()};
+		for (auto const &Region : Regions)
+		{
+			if (Region.Start <= Merged.back().End) Merged.back().End = std::max(Merged.back().End, Region.End);
+			else Merged.push_back(Region);
+		}
+
+		// Re-split each region from the old contents with the changes applied on top.  Old chunks are only
+		// unreferenced at the end, since they may still be read for a later region.
+		auto Old = Open(ID);
+		for (auto const &Region : Merged)
+		{
+			LOG(Log, Spam, StringT() << "Rewriting " << ID << " bytes " << Region.Start << " to " << Region.End);
+			auto NewChunks = Split(Region.Start, Region.End, [&](uint64_t Offset, uint8_t *Out, size_t Length)
+			{
+				size_t Filled = 0;
+				if (Offset < OldSize)
+					Filled = Old.Read(Offset, Out, static_cast<size_t>(std::min<uint64_t>(Length, OldSize - Offset)));
+				std::fill(Out + Filled, Out + Length, 0);
+				Apply(Offset, Out, Length);
+			});
+			for (auto const &Chunk : Chunks)
+				if ((Chunk.Offset() >= Region.Start) && (Chunk.Offset() < Region.End))
+					Replaced.push_back(Chunk.Hash());
+			Database.DeleteStorageChunks(ID, Region.Start, Region.End);
+			Reference(ID, NewChunks);
+		}
+	}
+	for (auto const &Hash : Replaced) Unreference(Hash);
+}
+
+StorageReaderT ChunkStoreT::Open(StorageIDT const &ID)
+{
+	StorageReaderT Out;
+	for (auto const &Chunk : List(ID))
+		Out.Append(GetChunkPath(Chunk.Hash()), 0, Chunk.Size());
+	return Out;
+}
+
+std::vector<StorageChunkT> ChunkStoreT::List(StorageIDT const &ID)
+{
+	std::vector<StorageChunkT> Out;
+	Database.ListStorageChunks.Execute(
+		ID,
+		[&Out](StorageChunkT &&Chunk) { Out.push_back(std::move(Chunk)); });
+	return Out;
+}
+
+std::vector<StorageChunkT> ChunkStoreT::Split(uint64_t Start, uint64_t End, FillT const &Fill)
+{
+	std::vector<StorageChunkT> Out;
+	std::vector<uint8_t> Pending;
+	size_t Cursor = 0;
+	uint64_t Filled = Start;
+	uint64_t Offset = Start;
+	while (true)
+	{
+		if ((Pending.size() - Cursor < MaxSize) && (Filled < End))
+		{
+			Pending.erase(Pending.begin(), Pending.begin() + Cursor);
+			Cursor = 0;
+			auto const More = static_cast<size_t>(std::min<uint64_t>(std::max(SplitWindowSize, MaxSize), End - Filled));
+			auto const OldPending = Pending.size();
+			Pending.resize(OldPending + More);
+			Fill(Filled, &Pending[OldPending], More);
+			Filled += More;
+		}
+		if (Cursor == Pending.size()) break;
+		auto const Size = Chunker.Next(&Pending[Cursor], Pending.size() - Cursor, Filled == End);
+		AssertGT(Size, 0u);
+		Out.emplace_back(Offset, Size, Store(&Pending[Cursor], Size));
+		Offset += Size;
+		Cursor += Size;
+	}
+	return Out;
+}
+
+std::string ChunkStoreT::Store(uint8_t const *Data, size_t Length)
+{
+	auto Hash = FormatHash(HashBytes(Data, Length));
+	if (Database.GetChunkRefCount(Hash)) return Hash;
+
+	auto const Prefix = Hash.substr(0, 2);
+	auto const Directory = Root.Enter(Prefix);
+	auto const PrefixIndex = std::stoul(Prefix, nullptr, 16);
+	if (!CreatedPrefixes[PrefixIndex])
+	{
+		Directory.CreateDirectory();
+		Unsynced.NoteDirectory(Root);
+		CreatedPrefixes[PrefixIndex] = true;
+	}
+
+	// Write to a temporary name first so a crash can't leave a partial chunk under a valid hash
+	auto const TempPath = Directory.Enter(Hash + ".new");
+	auto const Path = Directory.Enter(Hash);
+	Garbage.Keep(TempPath);
+	Garbage.Keep(Path);
+	{
+		FileDescriptorT Out(TempPath, O_WRONLY | O_CREAT | O_TRUNC);
+		Out.Write(0, Data, Length);
+	}
+	if (rename(TempPath.Render().c_str(), Path.Render().c_str()) != 0)
+		throw SYSTEM_ERROR << "Could not move chunk into place at " << Path.Render() << ": " << strerror(errno);
+	Unsynced.Note(Path);
+	Unsynced.NoteDirectory(Directory);
+	Database.InsertChunk(Hash, Length);
+	return Hash;
+}
+
+void ChunkStoreT::Reference(StorageIDT const &ID, std::vector<StorageChunkT> const &Chunks)
+{
+	for (auto const &Chunk : Chunks)
+	{
+		Database.InsertStorageChunk(ID, Chunk);
+		Database.AdjustChunkRefCount(Chunk.Hash(), 1);
+	}
+}
+
+void ChunkStoreT::Unreference(std::string const &Hash)
+{
+	Database.AdjustChunkRefCount(Hash, -1);
+	auto const Count = Database.GetChunkRefCount(Hash);
+	if (!Count || (*Count > 0)) return;
+	LOG(Log, Spam, StringT() << "Discarding unreferenced chunk " << Hash);
+	Database.DeleteChunk(Hash);
+	Garbage.Discard(GetChunkPath(Hash));
+}
+
+Filesystem::PathT ChunkStoreT::GetChunkPath(std::string const &Hash)
+{
+	return Root.Enter(Hash.substr(0, 2)).Enter(Hash);
+}
+
@@ -0,0 +1,107 @@
+#ifndef chunkstore_h
+#define chunkstore_h
+
+#include <array>
+
+#include "../ren-cxx-basics/function.h"
+#include "../ren-cxx-filesystem/path.h"
+
+#include "types.h"
+#include "structtypes.h"
+#include "coredatabase.h"
+#include "storagereader.h"
+#include "garbagecollector.h"
+#include "unsyncedfiles.h"
+#include "writeplan.h"
+#include "log.h"
+
+struct ChunkSettingsT
+{
+	size_t MinSize = 2 * 1024;
+	size_t AverageSize = 8 * 1024; // Approximate, the boundary mask is a power of 2
+	size_t MaxSize = 64 * 1024;
+};
+
+// Finds content defined chunk boundaries with a gear rolling hash (as in FastCDC), so
+// an insertion or overwrite only changes the chunks around it.
+struct ChunkerT
+{
+	ChunkerT(ChunkSettingsT const &Settings);
+
+	// Returns the size of the chunk at the start of Data.  Returns 0 if there isn't enough data to decide and
+	// more is coming; never returns 0 if Final is set.
+	size_t Next(uint8_t const *Data, size_t Length, bool Final) const;
+
+	private:
+		size_t const MinSize;
+		size_t const MaxSize;
+		uint64_t Mask;
+};
+
+// Storage split into chunks addressed by their hash.  Chunks are shared between all storage with the same
+// content and are discarded when no storage references them.
+struct ChunkStoreT
+{
+	ChunkStoreT(
+		Filesystem::PathT const &Root, 
+		CoreDatabaseT &Database, 
+		GarbageCollectorT &Garbage, 
+		UnsyncedFilesT &Unsynced, 
+		ChunkSettingsT const &Settings);
+
+	// Chunk the contents of Source into ID
+	void Import(StorageIDT const &ID, StorageReaderT &Source);
+
+	// Make To reference the same chunks as From
+	void Clone(StorageIDT const &From, StorageIDT const &To);
+
+	// Only rewrites the chunks touched by Changes
+	void Write(StorageIDT const &ID, std::vector<BytesChangeT> const &Changes);
+
+	// Truncate or zero extend ID, re-splitting only the chunks at the old and new ends
+	void Resize(StorageIDT const &ID, uint64_t Length);
+
+	// Zero the bytes of ID in the range, without changing its size
+	void Zero(StorageIDT const &ID, uint64_t Offset, uint64_t Length);
+
+	// Drop all chunks from ID
+	void Release(StorageIDT const &ID);
+
+	StorageReaderT Open(StorageIDT const &ID);
+
+	private:
+		typedef function<void(uint64_t Offset, uint8_t *Out, size_t Length)> FillT;
+
+		struct RangeT
+		{
+			uint64_t Start;
+			uint64_t End;
+		};
+
+		// Re-split the chunks touched by Ranges, and those at the end if the size changes.  Apply changes
+		// the old contents (zero past the old end) of each window as it's split.
+		void Rewrite(
+			StorageIDT const &ID, 
+			std::vector<RangeT> const &Ranges, 
+			function<uint64_t(uint64_t OldSize)> const &GetNewSize, 
+			FillT const &Apply);
+
+		std::vector<StorageChunkT> List(StorageIDT const &ID);
+		std::vector<StorageChunkT> Split(uint64_t Start, uint64_t End, FillT const &Fill);
+		std::string Store(uint8_t const *Data, size_t Length);
+		void Reference(StorageIDT const &ID, std::vector<StorageChunkT> const &Chunks);
+		void Unreference(std::string const &Hash);
+		Filesystem::PathT GetChunkPath(std::string const &Hash);
+
+		BasicLogT Log;
+		Filesystem::PathT const Root;
+		CoreDatabaseT &Database;
+		GarbageCollectorT &Garbage;
+		UnsyncedFilesT &Unsynced;
+		ChunkerT const Chunker;
+		size_t const MaxSize;
+		std::array<bool, 256> CreatedPrefixes;
+};
+
+#endif
+
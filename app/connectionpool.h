@@ -0,0 +1,105 @@
+#ifndef connectionpool_h
+#define connectionpool_h
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../ren-cxx-basics/error.h"
+
+// Lends up to Capacity connections, each to one thread at a time, opening them as needed.  A thread that already
+// holds a connection gets the same one again, so a read nested in another read's callback can't wait on itself.
+// Leases must be released on the thread that acquired them.
+template <typename ConnectionT> struct ConnectionPoolT
+{
+	typedef std::function<std::unique_ptr<ConnectionT>(void)> OpenT;
+
+	inline ConnectionPoolT(size_t Capacity, OpenT &&Open) : Capacity(Capacity), Open(std::move(Open))
+		{ AssertGT(Capacity, 0u); }
+
+	struct LeaseT
+	{
+		inline LeaseT(ConnectionPoolT &Pool, ConnectionT &Connection) : Pool(&Pool), Connection(&Connection) {}
+
+		inline LeaseT(LeaseT &&Other) : Pool(Other.Pool), Connection(Other.Connection)
+			{ Other.Pool = nullptr; }
+
+		LeaseT(LeaseT const &) = delete;
+
+		inline ~LeaseT(void)
+			{ if (Pool) Pool->Release(); }
+
+		inline ConnectionT &operator *(void) const { return *Connection; }
+		inline ConnectionT *operator ->(void) const { return Connection; }
+
+		private:
+			ConnectionPoolT *Pool;
+			ConnectionT *Connection;
+	};
+
+	// Blocks while every connection is lent to other threads
+	inline LeaseT Acquire(void)
+	{
+		std::unique_lock<std::mutex> Lock(Mutex);
+		auto Held = Holders.find(std::this_thread::get_id());
+		if (Held != Holders.end())
+		{
+			++Held->second.Depth;
+			return LeaseT(*this, *Held->second.Connection);
+		}
+		Available.wait(Lock, [this](void) { return !Idle.empty() || (Connections.size() < Capacity); });
+		ConnectionT *Connection;
+		if (!Idle.empty())
+		{
+			Connection = Idle.back();
+			Idle.pop_back();
+		}
+		else
+		{
+			Connections.push_back(Open());
+			Connection = Connections.back().get();
+		}
+		Holders.emplace(std::this_thread::get_id(), HolderT{Connection, 1});
+		return LeaseT(*this, *Connection);
+	}
+
+	inline size_t GetOpenCount(void)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Connections.size();
+	}
+
+	private:
+		inline void Release(void)
+		{
+			{
+				std::lock_guard<std::mutex> Lock(Mutex);
+				auto Held = Holders.find(std::this_thread::get_id());
+				Assert(Held != Holders.end());
+				if (--Held->second.Depth > 0) return;
+				Idle.push_back(Held->second.Connection);
+				Holders.erase(Held);
+			}
+			Available.notify_one();
+		}
+
+		struct HolderT
+		{
+			ConnectionT *Connection;
+			size_t Depth;
+		};
+
+		size_t const Capacity;
+		OpenT const Open;
+		std::mutex Mutex;
+		std::condition_variable Available;
+		std::vector<std::unique_ptr<ConnectionT>> Connections;
+		std::vector<ConnectionT *> Idle;
+		std::unordered_map<std::thread::id, HolderT> Holders;
+};
+
+#endif
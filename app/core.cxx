@@ -64,10 +64,25 @@ unsigned short getCpuHash()
 // ---------------------------------------------
 // ---------------------------------------------
 
-CoreT::CoreT(OptionalT<std::string> const &InstanceName, Filesystem::PathT const &Root) : 
+constexpr size_t StagedPieceSize = 1 << 20;
+
+CoreT::CoreT(
+	OptionalT<std::string> const &InstanceName, 
+	Filesystem::PathT const &Root, 
+	CoreSettingsT const &Settings) : 
 	Root(Root), 
 	StorageRoot(Root.Enter("storage")),
-	Log("core")
+	StagingRoot(Root.Enter("staging")),
+	Settings(Settings),
+	Log("core"),
+	CreatedShards(256 * 256, false),
+	Descriptors(Settings.OpenDescriptors),
+	Unsynced(Settings.DatabaseJournal),
+	NodeCache(Settings.NodeCacheSize),
+	DirCache(Settings.DirCacheBytes),
+	Dentries(Settings.DentryCacheSize),
+	DirHeadAdded(HeadAddListeners.Add([this](GlobalChangeIDT const &HeadID) { NoteHeadName(HeadID); })),
+	DirHeadRemoved(HeadRemoveListeners.Add([this](GlobalChangeIDT const &HeadID) { NoteHeadName(HeadID); }))
 {
 	bool Create = !Root.Exists();
 	if (Create)
@@ -80,7 +95,34 @@ CoreT::CoreT(OptionalT<std::string> const &InstanceName, Filesystem::PathT const
 	}
 
 	// Start DB
-	Database = std::make_unique<CoreDatabaseT>(Root.Enter("coredb.sqlite3"));
+	Database = std::make_unique<CoreDatabaseT>(Root.Enter("coredb.sqlite3"), Settings.Database);
+	Readers = std::make_unique<ConnectionPoolT<CoreReaderDatabaseT>>(Settings.ReadConnections, [this](void)
+	{
+		auto ReaderSettings = this->Settings.Database;
+		ReaderSettings.ReadOnly = true;
+		return std::make_unique<CoreReaderDatabaseT>(this->Root.Enter("coredb.sqlite3"), ReaderSettings);
+	});
+	if (Create) Database->SetStorageLayout((unsigned int)StorageLayoutT::Sharded);
+	StorageLayout = (StorageLayoutT)*Database->GetStorageLayout();
+	if (StorageLayout == StorageLayoutT::Flat) 
+	{
+		LOG(Log, Info, StringT() << "Storage is in the flat layout; it will be moved into shards as it's used");
+		StorageRoot.List([this](Filesystem::PathT &&Path, bool IsFile, bool IsDir)
+		{
+			if (!IsFile) return true;
+			auto const Rendered = Path.Render();
+			auto const Name = Rendered.substr(Rendered.rfind('/') + 1);
+			char *End = nullptr;
+			strtoull(Name.c_str(), &End, 10);
+			// Unfinished flattens (<id>.flat) move with their storage
+			if (End != Name.c_str()) FlatNames.insert(Name);
+			return true;
+		});
+	}
+	Garbage = std::make_unique<GarbageCollectorT>(Settings.Garbage);
+	Chunks = std::make_unique<ChunkStoreT>(Root.Enter("chunks"), *Database, *Garbage, Unsynced, Settings.Chunks);
+	Overlays = std::make_unique<OverlayStoreT>(*Database);
+	Packs = std::make_unique<PackStoreT>(Root.Enter("packs"), *Database, *Garbage, Descriptors, Unsynced, Settings.Packs);
 
 	// Make sure we (probably) weren't copied
 	auto EnvHash = FormatHash(HashString(StringT()
@@ -102,13 +144,25 @@ CoreT::CoreT(OptionalT<std::string> const &InstanceName, Filesystem::PathT const
 	}
 	else ThisInstance = *Database->GetPrimaryInstance();
 
-	// Clean up stray holds
-	// TODO
-
 	// Set up transactions, replay failed transactions
+	Replaying = true;
 	Transact = std::make_unique<CoreTransactorT>(
 		Root.Enter("coretransactions"),
-		*this);
+		*this,
+		Settings.Journal);
+	ReplayIntents();
+	Replaying = false;
+
+	// Stages that weren't committed are abandoned; replaying only needs the committed ones
+	StagingRoot.CreateDirectory();
+	StagingRoot.List([](Filesystem::PathT &&Path, bool IsFile, bool IsDir)
+	{
+		Path.Delete();
+		return true;
+	});
+
+	// Clean up stray holds
+	CollectGarbage();
 }
 
 /*void CoreT::AddInstance(std::string const &Name)
@@ -119,18 +173,201 @@ InstanceIDT CoreT::AddInstance(std::string const &Name)
 {
 }*/
 
+CoreT::TransactionT::TransactionT(CoreT &Core) : 
+	Core(Core), 
+	Garbage(*Core.Garbage), 
+	Outermost(!Core.Database->InTransaction()), 
+	Transaction(Core.Database->Begin()), 
+	Committed(false)
+{ 
+	Garbage.Hold(); 
+	if (Outermost) Core.Writer = std::this_thread::get_id();
+}
+
+CoreT::TransactionT::~TransactionT(void)
+{
+	if (!Committed) 
+	{
+		Garbage.Drop();
+		// Rows written through the cache may have been rolled back
+		Core.NodeCache.Clear();
+	}
+	if (Outermost) 
+	{
+		Core.ChangedNames.clear();
+		Core.Writer = std::thread::id();
+	}
+}
+
+void CoreT::TransactionT::Commit(void)
+{
+	Transaction.Commit();
+	Committed = true;
+	Garbage.Release();
+	// Readers may have cached listings and names from before the commit until now
+	if (Outermost) 
+		for (auto const &Name : Core.ChangedNames) 
+		{
+			Core.DirCache.Invalidate(Name.Dir);
+			Core.Dentries.Invalidate(Name);
+		}
+}
+
+template <typename MessageT, typename ...ArgumentsT> 
+	void CoreT::Act(MessageT, ArgumentsT const &...Arguments)
+{
+	ApplyMark();
+	if (!Settings.DatabaseJournal)
+	{
+		(*Transact)(MessageT(), Arguments...);
+		return;
+	}
+
+	// The intent commits with the metadata it changes, so only storage files need redoing after a crash
+	auto const Message = MessageT::Write(Arguments...);
+	TransactionT Transaction(*this);
+	Database->InsertIntent(Message);
+	Unsynced.Clear();
+	Handle(MessageT(), Arguments...);
+	// Files the intent can't redo have to be on disk before it commits
+	Unsynced.Sync();
+	Transaction.Commit();
+	IntentBytes += Message.size();
+	if (IntentBytes >= Settings.Journal.CheckpointSize) CheckpointIntents();
+}
+
+// Redoes only the storage file effects of committed intents
+struct IntentReplayT
+{
+	CoreT &Core;
+
+	// Intents are only written as version 2 messages
+	template <typename ...ArgumentsT> void Handle(CTV1AddChange, ArgumentsT const &...) {}
+	template <typename ...ArgumentsT> void Handle(CTV1UpdateDeleteHead, ArgumentsT const &...) {}
+
+	void Handle(
+		CTV2AddChange,
+		ChangeT const &,
+		OptionalT<ChangeIDT> const &,
+		OptionalT<StorageIDT> const &, 
+		OptionalT<StorageReferenceCountT> const &,
+		bool const &) 
+		{}
+
+	void Handle(
+		CTV2UpdateDeleteHead,
+		OptionalT<StorageIDT> const &StorageID, 
+		OptionalT<StorageReferenceCountT> const &,
+		GlobalChangeIDT const &,
+		OptionalT<ChangeIDT> const &,
+		OptionalT<HeadT> const &NewHead,
+		StorageChangesT const &StorageChanges)
+	{ 
+		if (NewHead && NewHead->StorageID()) 
+			Core.ReplayStorageChanges(*NewHead->StorageID(), StorageChanges, !StorageID); 
+	}
+
+	// Both finish idempotently once their metadata is committed
+	void Handle(
+		CTV1FlattenStorage,
+		StorageIDT const &StorageID)
+		{ Core.Handle(CTV1FlattenStorage(), StorageID); }
+
+	void Handle(
+		CTV1CompactSegment,
+		SegmentIndexT const &Segment)
+		{ Core.Handle(CTV1CompactSegment(), Segment); }
+};
+
+void CoreT::ReplayIntents(void)
+{
+	std::vector<std::vector<uint8_t>> Intents;
+	Database->ListIntents.Execute([&Intents](std::vector<uint8_t> &&Message) { Intents.push_back(std::move(Message)); });
+	if (Intents.empty()) return;
+	LOG(Log, Info, StringT() << "Replaying storage effects of " << Intents.size() << " intents");
+	IntentReplayT Replay{*this};
+	Protocol::ReaderT<
+		CTV1AddChange, 
+		CTV1UpdateDeleteHead, 
+		CTV1FlattenStorage, 
+		CTV1CompactSegment, 
+		CTV2AddChange, 
+		CTV2UpdateDeleteHead> Reader;
+	for (auto const &Message : Intents)
+	{
+		try
+		{
+			Reader.Read(MessageStreamT(Message), Replay);
+		}
+		catch (SystemErrorT const &Error)
+			{ LOG(Log, Warning, StringT() << "Error replaying intent: " << Error); }
+	}
+	CheckpointIntents();
+}
+
+void CoreT::ReplayStorageChanges(StorageIDT const &StorageID, StorageChangesT const &StorageChanges, bool Created)
+{
+	// Changes to other classes, staged changes, and files copied or unpacked from other storage were synced before 
+	// their intents committed.  Released storage needs nothing.
+	if (!StorageChanges || !Database->GetStorage(StorageID)) return;
+	if (GetStorageClass(StorageID) != StorageClassT::File) return;
+	if (StorageChanges.Is<StagedT>()) return;
+	auto const Path = GetStoragePath(StorageID);
+	LOG(Log, Debug, StringT() << "Redoing changes to " << Path.Render());
+	// Only storage the change created can be missing; anything else has lost contents the change doesn't hold
+	FileDescriptorT Storage(Path, Created ? (O_WRONLY | O_CREAT) : O_WRONLY);
+	if (StorageChanges.Is<TruncateT>()) Storage.Resize(0);
+	else if (StorageChanges.Is<ResizeT>()) Storage.Resize(StorageChanges.Get<ResizeT>().Length());
+	else if (StorageChanges.Is<PunchHoleT>())
+	{
+		auto const &Hole = StorageChanges.Get<PunchHoleT>();
+		Storage.PunchHole(Hole.Offset(), Hole.Length());
+	}
+	else WritePlanT(StorageChanges.Get<std::vector<BytesChangeT>>()).Apply(Storage);
+}
+
+void CoreT::CheckpointIntents(void)
+{
+	// Everything the intents could redo has to be on disk before they're dropped
+	FileDescriptorT RootDirectory(Root, O_RDONLY | O_DIRECTORY);
+#if __linux__
+	if (syncfs(*RootDirectory) != 0)
+		throw SYSTEM_ERROR << "Could not sync " << Root.Render() << ": " << strerror(errno);
+#else
+	sync();
+#endif
+	Database->DeleteIntents();
+	IntentBytes = 0;
+}
+
 NodeIndexT CoreT::ReserveNode(void)
 {
-	auto Out = *Database->GetNodeCounter();
-	Database->IncrementNodeCounter();
-	return Out;
+	return NodeIndexT(NodeBlock.Take(Settings.IDBlockSize, [this](size_t Size)
+	{
+		auto const Start = **Database->GetNodeCounter();
+		Database->AdvanceNodeCounter(Size);
+		return Start;
+	}));
 }
 
 ChangeIndexT CoreT::ReserveChange(void)
 {
-	auto Out = *Database->GetChangeCounter();
-	Database->IncrementChangeCounter();
-	return Out;
+	return ChangeIndexT(ChangeBlock.Take(Settings.IDBlockSize, [this](size_t Size)
+	{
+		auto const Start = **Database->GetChangeCounter();
+		Database->AdvanceChangeCounter(Size);
+		return Start;
+	}));
+}
+
+StorageIDT CoreT::ReserveStorage(void)
+{
+	return StorageIDT(StorageBlock.Take(Settings.IDBlockSize, [this](size_t Size)
+	{
+		auto const Start = **Database->GetStorageCounter();
+		Database->AdvanceStorageCounter(Size);
+		return Start;
+	}));
 }
 
 void CoreT::AddChange(ChangeT const &Change)
@@ -141,7 +378,7 @@ void CoreT::AddChange(ChangeT const &Change)
 	OptionalT<StorageReferenceCountT> StorageRefCount;
 	if (Change.ParentID())
 	{
-		if (auto Missing = Database->GetMissing(GlobalChangeIDT(Change.ChangeID().NodeID(), *Change.ParentID())))
+		if (auto Missing = FindMissing(GlobalChangeIDT(Change.ChangeID().NodeID(), *Change.ParentID())))
 		{
 			StorageID = Missing->StorageID();
 			HeadID = Missing->HeadID();
@@ -149,20 +386,20 @@ void CoreT::AddChange(ChangeT const &Change)
 		}
 		else
 		{
-			auto Head = Database->GetHead(GlobalChangeIDT(Change.ChangeID().NodeID(), *Change.ParentID()));
+			auto Head = FindHead(GlobalChangeIDT(Change.ChangeID().NodeID(), *Change.ParentID()));
 			if (Head)
 			{
 				HeadID = Head->ChangeID().ChangeID();
 				StorageID = Head->StorageID();
 				if (StorageID)
 				{
-					auto Storage = *Database->GetStorage(*StorageID);
+					auto Storage = *FindStorage(*StorageID);
 					StorageRefCount = Storage.ReferenceCount() + StorageReferenceCountT(1);
 				}
 			}
 		}
 	}
-	(*Transact)(CTV1AddChange(),
+	Act(CTV2AddChange(),
 		Change,
 		HeadID,
 		StorageID,
@@ -175,10 +412,20 @@ void CoreT::Handle(
 	ChangeT const &Change,
 	OptionalT<ChangeIDT> const &HeadID,
 	OptionalT<StorageIDT> const &StorageID,
+	OptionalT<StorageReferenceCountV1T> const &StorageRefCount,
+	bool const &DeleteMissing)
+	{ Handle(CTV2AddChange(), Change, HeadID, StorageID, WidenRefCount(StorageRefCount), DeleteMissing); }
+
+void CoreT::Handle(
+	CTV2AddChange,
+	ChangeT const &Change,
+	OptionalT<ChangeIDT> const &HeadID,
+	OptionalT<StorageIDT> const &StorageID,
 	OptionalT<StorageReferenceCountT> const &StorageRefCount,
 	bool const &DeleteMissing)
 {
 	LOG(Log, Spam, (StringT() << "Adding change " << Change.ChangeID() << "---"));
+	TransactionT Transaction(*this);
 	Database->InsertChange(Change);
 	ChangeAddListeners.Notify(Change);
 
@@ -186,25 +433,51 @@ void CoreT::Handle(
 	{
 		MissingRemoveListeners.Notify(Change.ChangeID());
 		Database->DeleteMissing(Change.ChangeID());
+		NodeCache.Missing.Insert(Change.ChangeID(), {});
 	}
 
 	if (StorageRefCount)
 	{
 		Database->SetStorageRefCount(*StorageID, *StorageRefCount);
-		LOG(Log, Spam, StringT() << "New missing: setting storage " << *StorageID << " to " << (int)**StorageRefCount);
+		NodeCache.Storage.Insert(*StorageID, StorageT(*StorageID, *StorageRefCount));
+		LOG(Log, Spam, StringT() << "New missing: setting storage " << *StorageID << " to " << **StorageRefCount);
 	}
 
-	Database->InsertMissing(
-		MissingT(
-			Change.ChangeID(),
-			HeadID, 
-			StorageID));
+	MissingT const Missing(
+		Change.ChangeID(),
+		HeadID, 
+		StorageID);
+	Database->InsertMissing(Missing);
+	NodeCache.Missing.Insert(Change.ChangeID(), Missing);
 	MissingAddListeners.Notify(Change.ChangeID());
+	Transaction.Commit();
 }
 
 void CoreT::DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT, DeleteHeadT> const &Definition)
 {
 	LOG(Log, Spam, (StringT() << "Defining change " << ChangeID << "---"));
+	auto Missing = FindMissing(ChangeID);
+	if (!Missing)
+	{
+		LOG(Log, Warning, (StringT() << "Attempting to define change with no Missing: " << ChangeID));
+		return;
+	}
+	if (Definition.Is<DefineHeadT>() && Definition.Get<DefineHeadT>().StorageChanges.Is<std::vector<BytesChangeT>>())
+	{
+		// Large writes are staged so the journal only records where the bytes are, rather than the bytes.  The
+		// staging file is removed when Staged goes, however this returns.
+		auto const &DefineHead = Definition.Get<DefineHeadT>();
+		auto const &Changes = DefineHead.StorageChanges.Get<std::vector<BytesChangeT>>();
+		size_t Size = 0;
+		for (auto const &Change : Changes) Size += Change.Bytes().size();
+		if (Size > Settings.MaxJournaledBytes)
+		{
+			auto Staged = StageChange(ChangeID, false);
+			for (auto const &Change : Changes) Staged.Write(Change.Offset(), Change.Bytes().data(), Change.Bytes().size());
+			DefineChange(std::move(Staged), DefineHead.MetaChanges);
+			return;
+		}
+	}
 	OptionalT<ChangeIDT> DeleteParent;
 	//auto Now = time(nullptr);
 	HeadT NewHead;
@@ -214,22 +487,16 @@ void CoreT::DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT,
 	OptionalT<StorageReferenceCountT> StorageRefCount;
 	Assert(!StorageRefCount);
 
-	auto Missing = Database->GetMissing(ChangeID);
-	if (!Missing)
-	{
-		LOG(Log, Warning, (StringT() << "Attempting to define change with no Missing: " << ChangeID));
-		return;
-	}
 	StorageID = Missing->StorageID();
 	if (StorageID)
 	{
 		LOG(Log, Spam, (StringT() << "Missing has storage " << *StorageID));
-		auto Storage = *Database->GetStorage(*StorageID);
+		auto Storage = *FindStorage(*StorageID);
 		AssertGT(Storage.ReferenceCount(), StorageReferenceCountT(0));
 		StorageRefCount = Storage.ReferenceCount() - StorageReferenceCountT(1);
 	}
 	if (Missing->HeadID())
-		if (auto Head = Database->GetHead(GlobalChangeIDT(ChangeID.NodeID(), *Missing->HeadID())))
+		if (auto Head = FindHead(GlobalChangeIDT(ChangeID.NodeID(), *Missing->HeadID())))
 		{
 			LOG(Log, Spam, (StringT() << "Missing has valid head " << *Missing->HeadID()));
 			DeleteParent = Missing->HeadID();
@@ -252,7 +519,7 @@ void CoreT::DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT,
 			{
 				NewHead.StorageID() = StorageID;
 				*StorageRefCount += StorageReferenceCountT(1);
-				LOG(Log, Spam, (StringT() << "No storage changes, reusing " << *StorageID << "(" << (int)**StorageRefCount << ")"));
+				LOG(Log, Spam, (StringT() << "No storage changes, reusing " << *StorageID << "(" << **StorageRefCount << ")"));
 			}
 			else
 			{
@@ -260,13 +527,12 @@ void CoreT::DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT,
 				{
 					NewHead.StorageID() = StorageID;
 					*StorageRefCount += StorageReferenceCountT(1);
-					LOG(Log, Spam, (StringT() << "Storage changes but no other storage references, reusing " << *StorageID << "(" << (int)**StorageRefCount << ")"));
+					LOG(Log, Spam, (StringT() << "Storage changes but no other storage references, reusing " << *StorageID << "(" << **StorageRefCount << ")"));
 				}
 				else
 				{
-					NewHead.StorageID() = Database->GetStorageCounter();
-					Database->IncrementStorageCounter();
-					LOG(Log, Spam, (StringT() << "Storage changes but other storage references, creating new " << *NewHead.StorageID() << "(" << (int)**StorageRefCount << ")"));
+					NewHead.StorageID() = ReserveStorage();
+					LOG(Log, Spam, (StringT() << "Storage changes but other storage references, creating new " << *NewHead.StorageID() << "(" << **StorageRefCount << ")"));
 				}
 			}
 		}
@@ -274,14 +540,19 @@ void CoreT::DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT,
 		{
 			if (DefineHead.StorageChanges)
 			{
-				NewHead.StorageID() = Database->GetStorageCounter();
-				Database->IncrementStorageCounter();
+				NewHead.StorageID() = ReserveStorage();
 				LOG(Log, Spam, (StringT() << "No existing storage, creating new " << *NewHead.StorageID()));
 			}
 		}
 		NewHead.Meta() = DefineHead.MetaChanges;
-		(*Transact)(
-			CTV1UpdateDeleteHead(),
+		// Overlays can't represent resizes or holes.  Flattening replaces the overlay's file, so it commits on its 
+		// own first rather than inside a change that might roll back.
+		if (StorageID && (NewHead.StorageID() == StorageID) && 
+			(DefineHead.StorageChanges.Is<ResizeT>() || DefineHead.StorageChanges.Is<PunchHoleT>()) &&
+			(GetStorageClass(*StorageID) == StorageClassT::Overlay))
+			Act(CTV1FlattenStorage(), *StorageID);
+		Act(
+			CTV2UpdateDeleteHead(),
 			StorageID,
 			StorageRefCount,
 			ChangeID,
@@ -290,8 +561,8 @@ void CoreT::DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT,
 			DefineHead.StorageChanges);
 	}
 	else if (Definition.Is<DeleteHeadT>())
-		(*Transact)(
-			CTV1UpdateDeleteHead(),
+		Act(
+			CTV2UpdateDeleteHead(),
 			StorageID,
 			StorageRefCount,
 			ChangeID,
@@ -300,16 +571,50 @@ void CoreT::DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT,
 			StorageChangesT());
 }
 
+StagedChangeT CoreT::StageChange(GlobalChangeIDT const &ChangeID, bool Truncate)
+{
+	auto const Stage = StageCounter++;
+	LOG(Log, Spam, StringT() << "Staging change " << ChangeID << " as " << Stage);
+	return StagedChangeT(ChangeID, Stage, Truncate, GetStagePath(Stage).Render());
+}
+
+void CoreT::DefineChange(StagedChangeT Staged, NodeMetaT const &MetaChanges)
+{
+	// The staged bytes must be durable before the journal refers to them
+	Staged.File.Sync();
+	auto const Changes = StorageChangesT(Staged.Describe());
+	DefineChange(Staged.GetChangeID(), DefineHeadT(Changes, MetaChanges));
+}
+
 void CoreT::Handle(
 	CTV1UpdateDeleteHead,
 	OptionalT<StorageIDT> const &StorageID,
+	OptionalT<StorageReferenceCountV1T> const &StorageRefCount,
+	GlobalChangeIDT const &ChangeID,
+	OptionalT<ChangeIDT> const &DeleteParent,
+	OptionalT<HeadT> const &NewHead,
+	StorageChangesT const &StorageChanges)
+{ 
+	Handle(
+		CTV2UpdateDeleteHead(), 
+		StorageID, 
+		WidenRefCount(StorageRefCount), 
+		ChangeID, 
+		DeleteParent, 
+		NewHead, 
+		StorageChanges); 
+}
+
+void CoreT::Handle(
+	CTV2UpdateDeleteHead,
+	OptionalT<StorageIDT> const &StorageID,
 	OptionalT<StorageReferenceCountT> const &StorageRefCount,
 	GlobalChangeIDT const &ChangeID,
 	OptionalT<ChangeIDT> const &DeleteParent,
 	OptionalT<HeadT> const &NewHead,
 	StorageChangesT const &StorageChanges)
 {
-	std::cout << "Handle(CTV1UpdateDeleteHead,\n"
+	std::cout << "Handle(CTV2UpdateDeleteHead,\n"
 		"\tStorageID = " << StorageID << ",\n"
 		"\tStorageRefCount = " << StorageRefCount << ",\n"
 		"\tChangeID = " << ChangeID << ",\n"
@@ -317,140 +622,650 @@ void CoreT::Handle(
 		"\tNewHead = " << NewHead << ",\n"
 		"\tStorageChanges = " << StorageChanges << ",\n"
 		<< std::endl;
+	if (Replaying && StorageChanges.Is<StagedT>())
+	{
+		// Staged bytes are written at fixed offsets, so reapplying them is safe as long as they're intact
+		auto const &Staged = StorageChanges.Get<StagedT>();
+		FileDescriptorT Source(GetStagePath(Staged.Stage()), O_RDONLY);
+		if (FormatHash(HashStaged(Source, Staged.Ranges())) != Staged.Checksum())
+			throw SYSTEM_ERROR << "Staged change " << Staged.Stage() << " for " << ChangeID << " doesn't match its checksum";
+	}
+	TransactionT Transaction(*this);
 	MissingRemoveListeners.Notify(ChangeID);
 	Database->DeleteMissing(GlobalChangeIDT(ChangeID.NodeID(), ChangeID.ChangeID()));
+	NodeCache.Missing.Insert(ChangeID, {});
 	if (DeleteParent)
 	{
 		auto const HeadID = GlobalChangeIDT(ChangeID.NodeID(), *DeleteParent);
 		HeadRemoveListeners.Notify(HeadID);
 		Database->DeleteHead(HeadID);
+		NodeCache.Heads.Insert(HeadID, {});
 		LOG(Log, Spam, (StringT() << "Deleting head " << HeadID));
 	}
+	bool Overlaid = false;
 	if (NewHead)
 	{
-		if (StorageChanges)
+		auto const NewClass = ChooseStorageClass(StorageID, NewHead->StorageID(), StorageChanges);
+		if (NewHead->StorageID() != StorageID) 
+		{
+			Database->InsertStorage(*NewHead->StorageID(), (unsigned int)NewClass);
+			NodeCache.Storage.Insert(*NewHead->StorageID(), StorageT(*NewHead->StorageID(), StorageReferenceCountT(1)));
+		}
+		if (StorageChanges && (NewClass == StorageClassT::Chunked))
+		{
+			auto const &NewStorageID = *NewHead->StorageID();
+			if (Truncates(StorageChanges))
+			{
+				LOG(Log, Spam, StringT() << "Truncating chunked storage " << NewStorageID);
+				if (StorageID == NewHead->StorageID()) Chunks->Release(NewStorageID);
+			}
+			else if (StorageID && (StorageID != NewHead->StorageID()))
+			{
+				// If modifying old storage
+				if (GetStorageClass(*StorageID) == StorageClassT::Chunked) 
+					Chunks->Clone(*StorageID, NewStorageID);
+				else 
+				{
+					auto Old = Open(*StorageID);
+					Chunks->Import(NewStorageID, Old);
+				}
+			}
+			if (StorageChanges.Is<ResizeT>())
+				Chunks->Resize(NewStorageID, StorageChanges.Get<ResizeT>().Length());
+			else if (StorageChanges.Is<PunchHoleT>())
+			{
+				auto const &Hole = StorageChanges.Get<PunchHoleT>();
+				Chunks->Zero(NewStorageID, Hole.Offset(), Hole.Length());
+			}
+			else ForEachBytes(StorageChanges, [&](std::vector<BytesChangeT> const &Changes) 
+				{ Chunks->Write(NewStorageID, Changes); });
+		}
+		else if (StorageChanges && (NewClass == StorageClassT::Overlay))
+		{
+			auto const &NewStorageID = *NewHead->StorageID();
+			auto const NewStoragePath = GetStoragePath(NewStorageID);
+			if (Truncates(StorageChanges))
+			{
+				// Nothing of the parent is left, so this becomes a plain file
+				LOG(Log, Spam, StringT() << "Truncating overlay " << NewStoragePath.Render());
+				Overlays->Release(NewStorageID);
+				FileDescriptorT NewStorage(NewStoragePath, O_WRONLY | O_CREAT | O_TRUNC);
+				ForEachBytes(StorageChanges, [&](std::vector<BytesChangeT> const &Changes) 
+					{ WritePlanT(Changes).Apply(NewStorage); });
+				NoteUnsynced(NewStorageID);
+				Database->SetStorageClass(NewStorageID, (unsigned int)StorageClassT::File);
+				if (auto Orphan = DetachParent(NewStorageID)) ReleaseStorage(*Orphan);
+			}
+			else
+			{
+				if (StorageID != NewHead->StorageID())
+				{
+					LOG(Log, Spam, StringT() << "Overlaying " << NewStoragePath.Render() << " on " << *StorageID);
+					Overlaid = true;
+				}
+				ForEachBytes(StorageChanges, [&](std::vector<BytesChangeT> const &Changes) 
+					{ Overlays->Write(NewStorageID, NewStoragePath, Changes); });
+				NoteUnsynced(NewStorageID);
+			}
+		}
+		else if (StorageChanges && ((NewClass == StorageClassT::Packed) || (NewClass == StorageClassT::Inline)))
+		{
+			// Packed and inline storage is small, so it's rewritten whole
+			std::vector<uint8_t> Contents;
+			if (StorageID && !Truncates(StorageChanges))
+			{
+				auto Old = Open(*StorageID);
+				Contents.resize(Old.Size());
+				Old.Read(0, Contents.data(), Contents.size());
+			}
+			if (StorageChanges.Is<ResizeT>()) Contents.resize(StorageChanges.Get<ResizeT>().Length());
+			else if (StorageChanges.Is<PunchHoleT>())
+			{
+				auto const &Hole = StorageChanges.Get<PunchHoleT>();
+				auto const Start = std::min<uint64_t>(Hole.Offset(), Contents.size());
+				auto const End = std::min<uint64_t>(Hole.Offset() + Hole.Length(), Contents.size());
+				std::fill(Contents.begin() + Start, Contents.begin() + End, 0);
+			}
+			else ForEachBytes(StorageChanges, [&Contents](std::vector<BytesChangeT> const &Changes)
+			{
+				WritePlanT const Plan(Changes);
+				if (Plan.GetEnd() > Contents.size()) Contents.resize(Plan.GetEnd());
+				Plan.Apply(Contents.data());
+			});
+			if (NewClass == StorageClassT::Packed) Packs->Write(*NewHead->StorageID(), Contents.data(), Contents.size());
+			else Database->SetStorageData(*NewHead->StorageID(), Contents);
+		}
+		else if (StorageChanges)
 		{
 			auto NewStoragePath = GetStoragePath(*NewHead->StorageID());
-			if (StorageChanges.Is<TruncateT>())
+			// New storage that doesn't start from old contents is exactly the staged contents
+			if (StorageChanges.Is<StagedT>() && 
+				(StorageID != NewHead->StorageID()) && 
+				(!StorageID || Truncates(StorageChanges)) &&
+				LinkStaged(StorageChanges.Get<StagedT>(), NewStoragePath))
+			{
+				LOG(Log, Spam, StringT() << "Linked staged contents to " << NewStoragePath.Render());
+				NoteUnsynced(*NewHead->StorageID());
+			}
+			else if (Truncates(StorageChanges))
 			{
 				LOG(Log, Spam, StringT() << "Truncating " << NewStoragePath.Render());
-				Filesystem::FileT::OpenWrite(NewStoragePath.Render());
+				if (StorageID == NewHead->StorageID())
+				{
+					// Staged contents too big to pack or inline
+					auto const OldClass = GetStorageClass(*StorageID);
+					if (OldClass == StorageClassT::Packed) Packs->Release(*StorageID);
+					else if (OldClass == StorageClassT::Inline) Database->ClearStorageData(*StorageID);
+					Database->SetStorageClass(*StorageID, (unsigned int)StorageClassT::File);
+				}
+				// The staging file holds exactly the new contents
+				if (StorageChanges.Is<StagedT>())
+				{
+					CopyStorage(GetStagePath(StorageChanges.Get<StagedT>().Stage()), NewStoragePath);
+					// Intents can't redo staged changes once the staging file is gone
+					NoteUnsynced(*NewHead->StorageID());
+				}
+				else Filesystem::FileT::OpenWrite(NewStoragePath.Render());
 			}
 			else
 			{
-				auto &Changes = StorageChanges.Get<std::vector<BytesChangeT>>();
-
-				Filesystem::FileT NewStorage;
+				FileDescriptorT NewStorage;
 
 				if (!StorageID) 
 				{
 					LOG(Log, Spam, StringT() << "Creating file " << NewStoragePath.Render());
-					NewStorage = Filesystem::FileT::OpenWrite(NewStoragePath);
+					NewStorage = FileDescriptorT(NewStoragePath, O_WRONLY | O_CREAT | O_TRUNC);
+				}
+				else if ((StorageID != NewHead->StorageID()) && (GetStorageClass(*StorageID) != StorageClassT::File))
+				{
+					LOG(Log, Spam, StringT() << "Unpacking " << *StorageID << " to " << NewStoragePath.Render());
+					WriteStorageFile(Open(*StorageID), NewStoragePath);
+					NewStorage = FileDescriptorT(NewStoragePath, O_WRONLY);
+					NoteUnsynced(*NewHead->StorageID());
 				}
 				else if (StorageID != NewHead->StorageID())
 				{
 					// If modifying old storage
-					auto OldStoragePath = GetStoragePath(*StorageID);
-					auto OldStorage = Filesystem::FileT::OpenRead(OldStoragePath);
-					LOG(Log, Spam, StringT() << "Copying to " << NewStoragePath.Render());
-					NewStorage = Filesystem::FileT::OpenWrite(NewStoragePath);
-					std::vector<uint8_t> Buffer;
-					while (OldStorage.Read(Buffer)) NewStorage.Write(Buffer);
+					CopyStorage(GetStoragePath(*StorageID), NewStoragePath);
+					NewStorage = FileDescriptorT(NewStoragePath, O_WRONLY);
+					NoteUnsynced(*NewHead->StorageID());
 				}
 				else 
 				{
+					auto const OldClass = GetStorageClass(*StorageID);
+					// Overlays can't represent resizes or holes, so they're flattened first
+					if (OldClass == StorageClassT::Overlay) Handle(CTV1FlattenStorage(), *StorageID);
+					else if (IsSmallClass(OldClass))
+					{
+						// Grew too big to pack or inline
+						LOG(Log, Spam, StringT() << "Unpacking " << *StorageID << " to " << NewStoragePath.Render());
+						WriteStorageFile(Open(*StorageID), NewStoragePath);
+						NoteUnsynced(*StorageID);
+						if (OldClass == StorageClassT::Packed) Packs->Release(*StorageID);
+						else Database->ClearStorageData(*StorageID);
+						Database->SetStorageClass(*StorageID, (unsigned int)StorageClassT::File);
+					}
 					LOG(Log, Spam, StringT() << "Old storage is " << *StorageID);
 					LOG(Log, Spam, StringT() << "Opening to modify " << NewStoragePath.Render());
-					NewStorage = Filesystem::FileT::OpenModify(NewStoragePath);
+					NewStorage = FileDescriptorT(NewStoragePath, O_WRONLY);
 				}
 
-				for (auto const &Change : Changes)
+				if (StorageChanges.Is<ResizeT>()) NewStorage.Resize(StorageChanges.Get<ResizeT>().Length());
+				else if (StorageChanges.Is<PunchHoleT>())
 				{
-					NewStorage.Seek(Change.Offset());
-					NewStorage.Write(Change.Bytes());
+					auto const &Hole = StorageChanges.Get<PunchHoleT>();
+					NewStorage.PunchHole(Hole.Offset(), Hole.Length());
 				}
+				// Overlapping changes are resolved first so each byte is written once
+				else ForEachBytes(StorageChanges, [&NewStorage](std::vector<BytesChangeT> const &Changes) 
+					{ WritePlanT(Changes).Apply(NewStorage); });
+				if (StorageChanges.Is<StagedT>()) NoteUnsynced(*NewHead->StorageID());
 			}
 		}
 		Database->InsertHead(*NewHead);
-		if (NewHead->StorageID() != StorageID) Database->InsertStorage(*NewHead->StorageID());
+		NodeCache.Heads.Insert(ChangeID, *NewHead);
+		if (Overlaid)
+		{
+			auto const Depth = *Database->GetStorageDepth(*StorageID) + 1;
+			Database->SetStorageParent(*NewHead->StorageID(), *StorageID, Depth);
+			if (Depth > Settings.MaxOverlayDepth)
+				LOG(Log, Debug, StringT() << "Overlay " << *NewHead->StorageID() << " is " << Depth << " deep and will be flattened");
+		}
 		HeadAddListeners.Notify(ChangeID);
 	}
 	if (StorageRefCount)
 	{
-		if (*StorageRefCount == StorageReferenceCountT(0))
+		// A new overlay references its parent
+		auto RefCount = *StorageRefCount;
+		if (Overlaid) RefCount += StorageReferenceCountT(1);
+		if (RefCount == StorageReferenceCountT(0))
 		{
-			GetStoragePath(*StorageID).Delete();
-			Database->DeleteStorage(*StorageID);
+			ReleaseStorage(*StorageID);
 		}
 		else
 		{
-			Database->SetStorageRefCount(*StorageID, *StorageRefCount);
+			Database->SetStorageRefCount(*StorageID, RefCount);
+			NodeCache.Storage.Insert(*StorageID, StorageT(*StorageID, RefCount));
 		}
 	}
+	Transaction.Commit();
+}
+
+void CoreT::Handle(
+	CTV1FlattenStorage,
+	StorageIDT const &StorageID)
+{
+	auto const Path = GetStoragePath(StorageID);
+	auto const FlatPath = GetStoragePath(StorageID, ".flat");
+	TransactionT Transaction(*this);
+	if (GetStorageClass(StorageID) == StorageClassT::Overlay)
+	{
+		LOG(Log, Debug, StringT() << "Flattening overlay " << StorageID);
+		WriteStorageFile(Open(StorageID), FlatPath);
+		auto const Depth = *Database->GetStorageDepth(StorageID);
+		Database->ReduceDescendantDepth(StorageID, Depth);
+		Database->DeleteOverlayExtents(StorageID);
+		Database->SetStorageClass(StorageID, (unsigned int)StorageClassT::File);
+		if (auto Orphan = DetachParent(StorageID)) ReleaseStorage(*Orphan);
+	}
+	Transaction.Commit();
+	// The database is updated before the flat file replaces the overlay data, so replaying only needs to 
+	// finish the move
+	if (FlatPath.Exists())
+	{
+		if (rename(FlatPath.Render().c_str(), Path.Render().c_str()) != 0)
+			throw SYSTEM_ERROR << "Could not replace " << Path.Render() << " with flattened storage: " << strerror(errno);
+		Descriptors.Forget(Path);
+		NoteUnsynced(StorageID);
+	}
+}
+
+void CoreT::Handle(
+	CTV1CompactSegment,
+	SegmentIndexT const &Segment)
+{
+	TransactionT Transaction(*this);
+	Packs->Compact(Segment);
+	Transaction.Commit();
 }
 
 InstanceIndexT CoreT::GetThisInstance(void) const
 	{ return ThisInstance; }
 
-std::vector<ChangeT> CoreT::ListChanges(size_t Start, size_t Count)
+template <typename ReadT> auto CoreT::Read(ReadT const &Function)
+{
+	// A read from inside a handler, by a listener, has to see the handler's uncommitted changes
+	if (Writer.load() == std::this_thread::get_id()) return Function(static_cast<CoreQueriesT &>(*Database));
+	auto Reader = Readers->Acquire();
+	return Function(static_cast<CoreQueriesT &>(*Reader));
+}
+
+std::vector<ChangeT> CoreT::ListChanges(OptionalT<GlobalChangeIDT> const &After, size_t Count)
 {
 	std::vector<ChangeT> Out;
-	Database->ListChanges.Execute(
-		Start, 
-		Count, 
-		[&Out](ChangeT &&Change) { Out.push_back(std::move(Change)); });
+	auto Add = [&Out](ChangeT &&Change) { Out.push_back(std::move(Change)); };
+	Read([&](CoreQueriesT &Queries)
+	{
+		if (After) Queries.ListChangesAfter.Execute(*After, Count, Add);
+		else Queries.ListChanges.Execute(Count, Add);
+	});
 	return Out;
 }
 
-std::vector<MissingT> CoreT::ListMissing(size_t Start, size_t Count)
+std::vector<MissingT> CoreT::ListMissing(OptionalT<GlobalChangeIDT> const &After, size_t Count)
 {
 	std::vector<MissingT> Out;
-	Database->ListMissing.Execute(
-		Start, 
-		Count, 
-		[&Out](MissingT &&Missing) { Out.push_back(std::move(Missing)); });
+	auto Add = [&Out](MissingT &&Missing) { Out.push_back(std::move(Missing)); };
+	Read([&](CoreQueriesT &Queries)
+	{
+		if (After) Queries.ListMissingAfter.Execute(*After, Count, Add);
+		else Queries.ListMissing.Execute(Count, Add);
+	});
 	return Out;
 }
 
-std::vector<HeadT> CoreT::ListHeads(size_t Start, size_t Count)
+std::vector<HeadT> CoreT::ListHeads(OptionalT<GlobalChangeIDT> const &After, size_t Count)
 {
 	std::vector<HeadT> Out;
-	Database->ListHeads.Execute(
-		Start, 
-		Count, 
-		[&Out](HeadT &&Head) { Out.push_back(std::move(Head)); });
+	auto Add = [&Out](HeadT &&Head) { Out.push_back(std::move(Head)); };
+	Read([&](CoreQueriesT &Queries)
+	{
+		if (After) Queries.ListHeadsAfter.Execute(*After, Count, Add);
+		else Queries.ListHeads.Execute(Count, Add);
+	});
 	return Out;
 }
 	
-std::vector<HeadT> CoreT::ListDirHeads(OptionalT<NodeIDT> const &Dir, size_t Start, size_t Count)
+std::vector<HeadT> CoreT::ListDirHeads(OptionalT<NodeIDT> const &Dir, OptionalT<DirHeadKeyT> const &After, size_t Count)
 {
+	// Whole listings are cached and paged from memory.  A handler's own reads have to see its uncommitted heads, 
+	// so they skip the cache.
+	if (Settings.DirCacheBytes && (Writer.load() != std::this_thread::get_id()))
+	{
+		auto Listing = DirCache.Find(Dir);
+		if (!Listing)
+		{
+			auto const Generation = DirCache.GetGeneration();
+			std::vector<HeadT> Heads;
+			size_t Bytes = 0;
+			bool Fits = true;
+			ForEachDirHead(Dir, [&](HeadT &&Head)
+			{
+				Bytes += DirCacheT::Measure(Head);
+				Fits = Bytes <= Settings.DirCacheBytes;
+				if (Fits) Heads.push_back(std::move(Head));
+				return Fits;
+			});
+			if (Fits) Listing = DirCache.Insert(Dir, Generation, std::move(Heads));
+		}
+		if (Listing) return DirCacheT::Page(Listing, After, Count);
+	}
 	std::vector<HeadT> Out;
-	Database->ListDirHeads.Execute(
-		Dir,
-		Start, 
-		Count, 
-		[&Out](HeadT &&Head) { Out.push_back(std::move(Head)); });
+	auto Add = [&Out](HeadT &&Head) { Out.push_back(std::move(Head)); };
+	Read([&](CoreQueriesT &Queries)
+	{
+		if (After) Queries.ListDirHeadsAfter.Execute(Dir, *After, Count, Add);
+		else Queries.ListDirHeads.Execute(Dir, Count, Add);
+	});
 	return Out;
 }
 
-std::vector<StorageT> CoreT::ListStorage(size_t Start, size_t Count)
+std::vector<StorageT> CoreT::ListStorage(OptionalT<StorageIDT> const &After, size_t Count)
 {
 	std::vector<StorageT> Out;
-	Database->ListStorage.Execute(
-		Start, 
-		Count, 
-		[&Out](StorageT &&Storage) { Out.push_back(std::move(Storage)); });
+	auto Add = [&Out](StorageT &&Storage) { Out.push_back(std::move(Storage)); };
+	Read([&](CoreQueriesT &Queries)
+	{
+		if (After) Queries.ListStorageAfter.Execute(*After, Count, Add);
+		else Queries.ListStorage.Execute(Count, Add);
+	});
 	return Out;
 }
+
+void CoreT::ForEachChange(function<bool(ChangeT &&Change)> const &Visitor)
+	{ Read([&](CoreQueriesT &Queries) { Queries.ForEachChange.ForEach(Visitor); }); }
+
+void CoreT::ForEachMissing(function<bool(MissingT &&Missing)> const &Visitor)
+	{ Read([&](CoreQueriesT &Queries) { Queries.ForEachMissing.ForEach(Visitor); }); }
+
+void CoreT::ForEachHead(function<bool(HeadT &&Head)> const &Visitor)
+	{ Read([&](CoreQueriesT &Queries) { Queries.ForEachHead.ForEach(Visitor); }); }
+
+void CoreT::ForEachHeadStorage(function<bool(GlobalChangeIDT &&ChangeID, OptionalT<StorageIDT> &&StorageID)> const &Visitor)
+	{ Read([&](CoreQueriesT &Queries) { Queries.ForEachHeadStorage.ForEach(Visitor); }); }
+
+void CoreT::ForEachDirHead(OptionalT<NodeIDT> const &Dir, function<bool(HeadT &&Head)> const &Visitor)
+	{ Read([&](CoreQueriesT &Queries) { Queries.ForEachDirHead.ForEach(Dir, Visitor); }); }
+
+void CoreT::ForEachDirHeadKey(OptionalT<NodeIDT> const &Dir, function<bool(DirHeadKeyT &&Key)> const &Visitor)
+	{ Read([&](CoreQueriesT &Queries) { Queries.ForEachDirHeadKey.ForEach(Dir, Visitor); }); }
+
+void CoreT::ForEachStorage(function<bool(StorageT &&Storage)> const &Visitor)
+	{ Read([&](CoreQueriesT &Queries) { Queries.ForEachStorage.ForEach(Visitor); }); }
 	
 OptionalT<HeadT> CoreT::GetHead(GlobalChangeIDT const &HeadID)
 {
-	return Database->GetHead(HeadID);
+	return Read([&](CoreQueriesT &Queries) { return Queries.GetHead(HeadID); });
 }
 
-Filesystem::FileT CoreT::Open(StorageIDT const &Storage)
+std::vector<HeadT> CoreT::LookupName(OptionalT<NodeIDT> const &Dir, std::string const &Filename)
 {
-	return Filesystem::FileT::OpenRead(GetStoragePath(Storage));
+	auto Load = [&](void)
+	{
+		std::vector<HeadT> Out;
+		Read([&](CoreQueriesT &Queries) 
+			{ Queries.LookupName.Execute(Dir, Filename, [&Out](HeadT &&Head) { Out.push_back(std::move(Head)); }); });
+		return Out;
+	};
+	// As with listings, a handler's own reads skip the cache
+	if (Writer.load() == std::this_thread::get_id()) return Load();
+	DentryKeyT const Key{Dir, Filename};
+	if (auto Found = Dentries.Find(Key)) return *Found;
+	auto const Generation = Dentries.GetGeneration();
+	return *Dentries.Insert(Key, Generation, Load());
+}
+
+OptionalT<OptionalT<NodeIDT>> CoreT::LookupPath(std::string const &Path)
+{
+	OptionalT<NodeIDT> Dir;
+	size_t Start = 0;
+	while (Start < Path.size())
+	{
+		auto End = Path.find('/', Start);
+		if (End == std::string::npos) End = Path.size();
+		// Leading, trailing and repeated slashes are ignored
+		if (End > Start)
+		{
+			auto const Heads = LookupName(Dir, Path.substr(Start, End - Start));
+			if (Heads.empty()) return {};
+			auto const NodeID = Heads.front().ChangeID().NodeID();
+			for (auto const &Head : Heads) 
+				if (!(Head.ChangeID().NodeID() == NodeID)) return {};
+			Dir = NodeID;
+		}
+		Start = End + 1;
+	}
+	return OptionalT<OptionalT<NodeIDT>>(Dir);
+}
+
+CopyStatsT const &CoreT::GetCopyStats(void) const
+	{ return CopyStats; }
+
+StorageReaderT CoreT::Open(StorageIDT const &Storage)
+{
+	// Files of released storage may linger until they're collected
+	if (!Database->GetStorage(Storage)) throw SYSTEM_ERROR << "Unknown storage " << Storage;
+	switch (GetStorageClass(Storage))
+	{
+		case StorageClassT::Chunked: 
+		{
+			auto Out = Chunks->Open(Storage);
+			Out.UseCache(Descriptors);
+			return Out;
+		}
+		case StorageClassT::Inline: 
+		{
+			StorageReaderT Out;
+			if (auto const Data = Database->GetStorageData(Storage)) Out.AppendBytes(Data->data(), Data->size());
+			return Out;
+		}
+		case StorageClassT::Packed: 
+		{
+			auto Out = Packs->Open(Storage);
+			Out.UseCache(Descriptors);
+			return Out;
+		}
+		case StorageClassT::Overlay: 
+		{
+			auto Out = Overlays->Open(Storage, GetStoragePath(Storage), Open(*Database->GetStorageParent(Storage)));
+			Out.UseCache(Descriptors);
+			return Out;
+		}
+		default: return StorageReaderT::OpenFile(GetStoragePath(Storage), &Descriptors);
+	}
+}
+
+DescriptorCacheT const &CoreT::GetDescriptorCache(void) const
+	{ return Descriptors; }
+
+NodeStateCacheT const &CoreT::GetNodeCache(void) const
+	{ return NodeCache; }
+
+DirCacheT const &CoreT::GetDirCache(void) const
+	{ return DirCache; }
+
+DentryCacheT const &CoreT::GetDentryCache(void) const
+	{ return Dentries; }
+
+StorageViewT CoreT::Map(StorageIDT const &Storage, MapAccessT Access)
+{
+	if (!Database->GetStorage(Storage)) throw SYSTEM_ERROR << "Unknown storage " << Storage;
+	switch (GetStorageClass(Storage))
+	{
+		case StorageClassT::File: 
+		{
+			auto const Descriptor = Descriptors.Open(GetStoragePath(Storage).Render());
+			return StorageViewT::MapFile(*Descriptor, 0, Descriptor->Size(), Access);
+		}
+		case StorageClassT::Packed:
+		{
+			auto const Location = Packs->Locate(Storage);
+			if (!Location) return StorageViewT();
+			auto const Descriptor = Descriptors.Open(Packs->GetSegmentPath(Location->Segment()).Render());
+			return StorageViewT::MapFile(*Descriptor, Location->Offset(), Location->Length(), Access);
+		}
+		default: 
+		{
+			// Chunks and overlay extents aren't contiguous in any one file, and inline storage is already in memory
+			auto Reader = Open(Storage);
+			return StorageViewT::Copy(Reader);
+		}
+	}
+}
+
+HashT CoreT::HashStorage(StorageIDT const &Storage)
+{
+	auto const View = Map(Storage, MapAccessT::Sequential);
+	return HashBytes(View.Data(), View.Size());
+}
+
+size_t CoreT::MigrateStorage(size_t Limit)
+{
+	if ((StorageLayout == StorageLayoutT::Sharded) || (Limit == 0)) return 0;
+	size_t Moved = 0;
+	while ((Moved < Limit) && !FlatNames.empty())
+	{
+		auto const Name = *FlatNames.begin();
+		FlatNames.erase(FlatNames.begin());
+		auto const From = StorageRoot.Enter(Name);
+		// May have been swept as garbage since it was listed
+		if (!From.Exists()) continue;
+		auto const ID = StorageIDT(strtoull(Name.c_str(), nullptr, 10));
+		MoveStorageFile(From, GetStorageShard(ID).Enter(Name));
+		++Moved;
+	}
+	if (FlatNames.empty())
+	{
+		LOG(Log, Info, StringT() << "Finished moving storage into shards");
+		Database->SetStorageLayout((unsigned int)StorageLayoutT::Sharded);
+		StorageLayout = StorageLayoutT::Sharded;
+	}
+	return Moved;
+}
+
+void CoreT::CollectGarbage(void)
+{
+	// Mark: reads through a pooled connection, so a big database doesn't hold up the writer
+	Garbage->Run(Root, [this](void)
+	{
+		auto Found = std::make_unique<MarkT>();
+		{
+			auto Reader = Readers->Acquire();
+			Reader->ListUnreachableStorage.Execute(
+				[&Found](StorageIndexT &&ID) { Found->Unreachable.push_back(ID); });
+			Reader->ListMiscountedStorage.Execute(
+				[&Found](StorageT &&Storage) { Found->Miscounted.push_back(std::move(Storage)); });
+		}
+		std::lock_guard<std::mutex> Lock(MarkMutex);
+		Marked = std::move(Found);
+	});
+
+	// Sweep: files the database doesn't know about, each looked up as it's found
+	// IDs still in the reserved block haven't been handed out yet
+	auto const StorageCounter = StorageBlock.Next != StorageBlock.End ? 
+		StorageBlock.Next : 
+		**Database->GetStorageCounter();
+	Garbage->Sweep(StorageRoot, [this, StorageCounter](std::string const &Name)
+	{
+		char *End = nullptr;
+		auto const ID = strtoull(Name.c_str(), &End, 10);
+		if (End == Name.c_str()) return false;
+		// Storage created after this has a higher ID
+		if (ID >= StorageCounter) return false;
+		return *Readers->Acquire()->HasStorage(StorageIndexT(ID)) == 0;
+	});
+	Garbage->Sweep(Root.Enter("chunks"), [this](std::string const &Name)
+	{
+		// Chunks stored after this are kept by the chunk store
+		constexpr size_t HashLength = 32;
+		if (Name.size() < HashLength) return false;
+		return *Readers->Acquire()->HasChunk(Name.substr(0, HashLength)) == 0;
+	});
+	auto const SegmentCounter = **Database->GetSegmentCounter();
+	Garbage->Sweep(Root.Enter("packs"), [this, SegmentCounter](std::string const &Name)
+	{
+		char *End = nullptr;
+		auto const Segment = strtoull(Name.c_str(), &End, 10);
+		if (End == Name.c_str()) return false;
+		if (Segment >= SegmentCounter) return false;
+		return *Readers->Acquire()->HasSegment(SegmentIndexT(Segment)) == 0;
+	});
+}
+
+void CoreT::ApplyMark(void)
+{
+	std::unique_ptr<MarkT> Found;
+	{
+		std::lock_guard<std::mutex> Lock(MarkMutex);
+		Found = std::move(Marked);
+	}
+	if (!Found) return;
+	TransactionT Transaction(*this);
+	// Nothing can start referencing storage that was unreachable when the mark read it
+	for (auto const &ID : Found->Unreachable)
+	{
+		// May have gone with an unreachable overlay above it, or since the mark
+		if (!FindStorage(ID)) continue;
+		LOG(Log, Warning, StringT() << "Releasing unreachable storage " << ID);
+		ReleaseStorage(ID);
+	}
+	// Counts may have changed since the mark, so each is taken again
+	for (auto const &Miscounted : Found->Miscounted)
+	{
+		auto const ID = Miscounted.StorageID();
+		auto const Storage = Database->GetStorage(ID);
+		if (!Storage) continue;
+		auto const Expected = StorageReferenceCountT(*Database->CountStorageReferences(ID));
+		if (Storage->ReferenceCount() == Expected) continue;
+		LOG(Log, Warning, StringT() << "Correcting reference count of storage " << ID << " to " << *Expected);
+		Database->SetStorageRefCount(ID, Expected);
+		NodeCache.Storage.Insert(ID, StorageT(ID, Expected));
+	}
+	Database->RecountSegments();
+	Transaction.Commit();
+}
+
+void CoreT::WaitForGarbage(void)
+{ 
+	Garbage->Wait(); 
+	ApplyMark();
+	Garbage->Wait(); 
+}
+
+size_t CoreT::FlattenOverlays(size_t Limit)
+{
+	std::vector<StorageIDT> Deep;
+	Database->ListDeepStorage.Execute(
+		(unsigned int)StorageClassT::Overlay,
+		Settings.MaxOverlayDepth,
+		Limit,
+		[&Deep](StorageIndexT &&ID) { Deep.push_back(ID); });
+	size_t Flattened = 0;
+	for (auto const &ID : Deep)
+	{
+		// Flattening a shallower overlay may have already shortened this chain
+		if (*Database->GetStorageDepth(ID) <= Settings.MaxOverlayDepth) continue;
+		Act(CTV1FlattenStorage(), ID);
+		++Flattened;
+	}
+	return Flattened;
+}
+
+size_t CoreT::CompactSegments(size_t Limit)
+{
+	auto const Sparse = Packs->ListSparse(Limit);
+	for (auto const &Segment : Sparse) Act(CTV1CompactSegment(), Segment);
+	return Sparse.size();
 }
 	
 bool CoreT::Validate(void)
@@ -459,96 +1274,121 @@ bool CoreT::Validate(void)
 
 	bool Passed = true;
 
-	constexpr size_t ListSize = 10;
-
 	// Storage exists for relevant heads
 	// Change for each head exists
-	size_t HeadOffset = 0;
-	while (true)
+	ForEachHeadStorage([&](GlobalChangeIDT &&ChangeID, OptionalT<StorageIDT> &&StorageID)
 	{
-		auto Heads = ListHeads(HeadOffset, ListSize);
-		for (auto const &Head : Heads)
+		if (!Database->GetChange(ChangeID))
 		{
-			if (!Database->GetChange(Head.ChangeID()))
-			{
-				LOG(Log, Error, (StringT() <<
-					"Missing change for head. " <<
-					"Head: " << Head.ChangeID() << "," 
-					"Storage ID: " << *Head.StorageID()));
-				Passed = false;
-			}
+			LOG(Log, Error, (StringT() <<
+				"Missing change for head. " <<
+				"Head: " << ChangeID << "," 
+				"Storage ID: " << *StorageID));
+			Passed = false;
+		}
 
-			if (Head.StorageID())
+		if (StorageID)
+		{
+			auto Storage = Database->GetStorage(*StorageID);
+			if (!Storage) 
 			{
-				auto Storage = Database->GetStorage(*Head.StorageID());
-				if (!Storage) 
-				{
-					LOG(Log, Error, (StringT() << 
-						"Missing storage for head. " << 
-						"Head: " << Head.ChangeID() << "," 
-						"Storage ID: " << *Head.StorageID()));
-					Passed = false;
-				}
+				LOG(Log, Error, (StringT() << 
+					"Missing storage for head. " << 
+					"Head: " << ChangeID << "," 
+					"Storage ID: " << *StorageID));
+				Passed = false;
 			}
 		}
-		if (Heads.size() < ListSize) break;
-		HeadOffset += Heads.size();
-	}
+		return true;
+	});
 
 	// Storage exists for relevant missings
 	// Change exists for each missing
 	// No parent of a missing can have a missing
-	size_t MissingOffset = 0;
-	while (true)
+	ForEachMissing([&](MissingT &&Missing)
 	{
-		auto Missings = ListMissing(MissingOffset, ListSize);
-		for (auto const &Missing : Missings)
+		auto PreChange = Database->GetChange(Missing.ChangeID());
+		if (!PreChange)
 		{
-			auto PreChange = Database->GetChange(Missing.ChangeID());
-			if (!PreChange)
+			LOG(Log, Error, (StringT() <<
+				"Missing change for missing. " <<
+				"Missing: " << Missing.ChangeID() << "," 
+				"Storage ID: " << *Missing.StorageID()));
+			Passed = false;
+		}
+		ChangeT Change = *PreChange;
+		while (Change.ParentID())
+		{
+			if (!(PreChange = Database->GetChange(
+				GlobalChangeIDT(
+					Change.ChangeID().NodeID(), 
+					*Change.ParentID())))) break;
+			Change = *PreChange;
+
+			auto ParentMissing = Database->GetMissing(Change.ChangeID());
+			if (ParentMissing)
 			{
 				LOG(Log, Error, (StringT() <<
-					"Missing change for missing. " <<
-					"Missing: " << Missing.ChangeID() << "," 
-					"Storage ID: " << *Missing.StorageID()));
+					"Multiple missings in single chain. " <<
+					"Top missing: " << Missing.ChangeID() << ", " 
+					"Lower missing: " << ParentMissing->ChangeID()));
 				Passed = false;
 			}
-			ChangeT Change = *PreChange;
-			while (Change.ParentID())
-			{
-				if (!(PreChange = Database->GetChange(
-					GlobalChangeIDT(
-						Change.ChangeID().NodeID(), 
-						*Change.ParentID())))) break;
-				Change = *PreChange;
-
-				auto ParentMissing = Database->GetMissing(Change.ChangeID());
-				if (ParentMissing)
-				{
-					LOG(Log, Error, (StringT() <<
-						"Multiple missings in single chain. " <<
-						"Top missing: " << Missing.ChangeID() << ", " 
-						"Lower missing: " << ParentMissing->ChangeID()));
-					Passed = false;
-				}
-			}
+		}
 
-			if (Missing.StorageID())
+		if (Missing.StorageID())
+		{
+			auto Storage = Database->GetStorage(*Missing.StorageID());
+			if (!Storage) 
 			{
-				auto Storage = Database->GetStorage(*Missing.StorageID());
-				if (!Storage) 
-				{
-					LOG(Log, Error, (StringT() << 
-						"Missing storage for missing. " << 
-						"Missing: " << Missing.ChangeID() << "," 
-						"Storage ID: " << *Missing.StorageID()));
-					Passed = false;
-				}
+				LOG(Log, Error, (StringT() << 
+					"Missing storage for missing. " << 
+					"Missing: " << Missing.ChangeID() << "," 
+					"Storage ID: " << *Missing.StorageID()));
+				Passed = false;
 			}
-
 		}
-		if (Missings.size() < ListSize) break;
-		MissingOffset += Missings.size();
+		return true;
+	});
+
+	// Reference counts match the heads, missings and overlays using the storage
+	Database->ListMiscountedStorage.Execute([&](StorageT &&Storage)
+	{
+		LOG(Log, Error, (StringT() << 
+			"Storage reference count is wrong. " << 
+			"Storage ID: " << Storage.StorageID() << ", "
+			"Expected: " << *Storage.ReferenceCount()));
+		Passed = false;
+	});
+
+	// Segment live byte counts match the storage packed in them
+	auto MiscountedSegments = *Database->CountMiscountedSegments();
+	if (MiscountedSegments > 0)
+	{
+		LOG(Log, Error, (StringT() << 
+			"Pack segment live byte count is wrong. " <<
+			"Segments: " << MiscountedSegments));
+		Passed = false;
+	}
+
+	// Every overlay has a parent
+	auto Orphans = *Database->CountOrphanOverlays((unsigned int)StorageClassT::Overlay);
+	if (Orphans > 0)
+	{
+		LOG(Log, Error, (StringT() << 
+			"Overlay storage without parent storage. " <<
+			"Orphans: " << Orphans));
+		Passed = false;
+	}
+
+	// Chunk reference counts match the storage that uses them
+	auto BadChunks = *Database->CountBadChunkRefCounts();
+	if (BadChunks > 0)
+	{
+		LOG(Log, Error, (StringT() << 
+			"Chunk reference counts don't match storage. " <<
+			"Bad chunks: " << BadChunks));
+		Passed = false;
 	}
 
 	// All primary heads in each directory unique
@@ -567,112 +1407,340 @@ void CoreT::DumpGraphviz(std::string const &RawPath)
 {
 	auto Out = Filesystem::FileT::OpenWrite(Filesystem::PathT::Qualify(RawPath));
 	Out.Write(StringT() << "digraph \"" << RawPath << "\"\n{\n\n");
-	constexpr size_t ListSize = 10;
 
+	// Changes come in key order, so each node's changes are together
 	OptionalT<NodeIDT> LastNode;
-	size_t ChangeOffset = 0;
-	while (true)
+	ForEachChange([&](ChangeT &&Change)
 	{
-		auto Changes = ListChanges(ChangeOffset, ListSize);
-		for (auto const &Change : Changes)
+		if (!LastNode || (*LastNode != Change.ChangeID().NodeID()))
 		{
-			if (!LastNode || (*LastNode != Change.ChangeID().NodeID()))
-			{
-				if (LastNode)
-					Out.Write(StringT() << "}\n");
-				Out.Write(StringT() << 
-					"subgraph \"cluster" << Change.ChangeID().NodeID() << "\" {\n" <<
-					"\tlabel = \"" << Change.ChangeID().NodeID() << "\";\n");
-				LastNode = Change.ChangeID().NodeID();
-			}
+			if (LastNode)
+				Out.Write(StringT() << "}\n");
 			Out.Write(StringT() << 
-				"\t { "
-					"\"" << Change.ChangeID() << "\" " <<
-					"[label = \"" << Change.ChangeID().ChangeID() << "\"] "
-				"} ");
-			if (Change.ParentID())
-				Out.Write(StringT() << 
-					" -> \"" << 
-					GlobalChangeIDT(
-						Change.ChangeID().NodeID(), 
-						*Change.ParentID()) <<
-					"\"");
-			else Out.Write("");
-			Out.Write(StringT() << ";\n");
-		}
-		if (Changes.size() < ListSize) break;
-		ChangeOffset += Changes.size();
-	} 
+				"subgraph \"cluster" << Change.ChangeID().NodeID() << "\" {\n" <<
+				"\tlabel = \"" << Change.ChangeID().NodeID() << "\";\n");
+			LastNode = Change.ChangeID().NodeID();
+		}
+		Out.Write(StringT() << 
+			"\t { "
+				"\"" << Change.ChangeID() << "\" " <<
+				"[label = \"" << Change.ChangeID().ChangeID() << "\"] "
+			"} ");
+		if (Change.ParentID())
+			Out.Write(StringT() << 
+				" -> \"" << 
+				GlobalChangeIDT(
+					Change.ChangeID().NodeID(), 
+					*Change.ParentID()) <<
+				"\"");
+		else Out.Write("");
+		Out.Write(StringT() << ";\n");
+		return true;
+	});
 	if (LastNode)
 		Out.Write(StringT() << "}\n");
 
-	size_t MissingOffset = 0;
-	while (true)
+	ForEachMissing([&](MissingT &&Missing)
 	{
-		auto Missings = ListMissing(MissingOffset, ListSize);
-		for (auto const &Missing : Missings)
-		{
+		Out.Write(StringT() << 
+			"{ " <<
+				"\"m" << Missing.ChangeID() << "\" " <<
+				"[label = \"m\", shape = box, color = blue] " <<
+			"} " <<
+			"-> \"" << Missing.ChangeID() << "\";\n");
+		if (Missing.HeadID())
 			Out.Write(StringT() << 
-				"{ " <<
-					"\"m" << Missing.ChangeID() << "\" " <<
-					"[label = \"m\", shape = box, color = blue] " <<
-				"} " <<
-				"-> \"" << Missing.ChangeID() << "\";\n");
-			if (Missing.HeadID())
-				Out.Write(StringT() << 
-					"\"m" << Missing.ChangeID() << "\" " <<
-					"-> \"h" << GlobalChangeIDT(
-						Missing.ChangeID().NodeID(), 
-						*Missing.HeadID()) << "\""
-					";\n");
-		}
-		if (Missings.size() < ListSize) break;
-		MissingOffset += Missings.size();
-	}
+				"\"m" << Missing.ChangeID() << "\" " <<
+				"-> \"h" << GlobalChangeIDT(
+					Missing.ChangeID().NodeID(), 
+					*Missing.HeadID()) << "\""
+				";\n");
+		return true;
+	});
 
-	size_t HeadOffset = 0;
-	while (true)
+	ForEachHeadStorage([&](GlobalChangeIDT &&ChangeID, OptionalT<StorageIDT> &&StorageID)
 	{
-		auto Heads = ListHeads(HeadOffset, ListSize);
-		for (auto const &Head : Heads)
-		{
+		Out.Write(StringT() << 
+			"{ " <<
+				"\"h" << ChangeID << "\" " <<
+				"[label = \"h\", shape = box, color = green] " <<
+			"} " <<
+			"-> \"" << ChangeID << "\""
+			";\n");
+		if (StorageID)
 			Out.Write(StringT() << 
-				"{ " <<
-					"\"h" << Head.ChangeID() << "\" " <<
-					"[label = \"h\", shape = box, color = green] " <<
-				"} " <<
-				"-> \"" << Head.ChangeID() << "\""
+				"\"h" << ChangeID << "\" " <<
+				"-> \"s" << *StorageID << "\""
 				";\n");
-			if (Head.StorageID())
-				Out.Write(StringT() << 
-					"\"h" << Head.ChangeID() << "\" " <<
-					"-> \"s" << *Head.StorageID() << "\""
-					";\n");
+		return true;
+	});
+
+	ForEachStorage([&](StorageT &&Storage)
+	{
+		Out.Write(StringT() << 
+			"{ "
+				"\"s" << Storage.StorageID() << "\" " <<
+				"[label = \"s " << Storage.StorageID() << " (" << *Storage.ReferenceCount() << ")\", shape = box, color = brown] "
+			"};\n");
+		return true;
+	});
+
+	Out.Write(StringT() << "\n}\n");
+}
+
+Filesystem::PathT CoreT::GetStoragePath(StorageIDT const &StorageID, std::string const &Suffix)
+{
+	auto Out = GetStorageShard(StorageID).Enter(StringT() << StorageID << Suffix);
+	if (StorageLayout == StorageLayoutT::Flat)
+	{
+		// Move storage left over from the flat layout the first time it's touched
+		auto const Found = FlatNames.find(StringT() << StorageID << Suffix);
+		if (Found != FlatNames.end())
+		{
+			MoveStorageFile(StorageRoot.Enter(*Found), Out);
+			FlatNames.erase(Found);
 		}
-		if (Heads.size() < ListSize) break;
-		HeadOffset += Heads.size();
 	}
+	return Out;
+}
+
+Filesystem::PathT CoreT::GetStorageShard(StorageIDT const &StorageID)
+{
+	// Spread storage over 65536 directories using the low bytes of the ID, which vary fastest
+	static char const Digits[] = "0123456789abcdef";
+	auto const First = static_cast<unsigned int>(*StorageID & 0xff);
+	auto const Second = static_cast<unsigned int>((*StorageID >> 8) & 0xff);
+	auto const FirstPath = StorageRoot.Enter(std::string{Digits[First >> 4], Digits[First & 0xf]});
+	auto Out = FirstPath.Enter(std::string{Digits[Second >> 4], Digits[Second & 0xf]});
+	auto const Shard = (First << 8) | Second;
+	if (!CreatedShards[Shard])
+	{
+		FirstPath.CreateDirectory();
+		Out.CreateDirectory();
+		CreatedShards[Shard] = true;
+	}
+	return Out;
+}
+
+void CoreT::MoveStorageFile(Filesystem::PathT const &From, Filesystem::PathT const &To)
+{
+	LOG(Log, Spam, StringT() << "Moving " << From.Render() << " to " << To.Render());
+	if (rename(From.Render().c_str(), To.Render().c_str()) != 0)
+		throw SYSTEM_ERROR << "Could not move " << From.Render() << " to " << To.Render() << ": " << strerror(errno);
+	Descriptors.Forget(From);
+}
+
+StorageClassT CoreT::GetStorageClass(StorageIDT const &StorageID)
+{
+	auto Class = Database->GetStorageClass(StorageID);
+	if (!Class) return StorageClassT::File;
+	return (StorageClassT)*Class;
+}
+
+StorageClassT CoreT::ChooseStorageClass(
+	OptionalT<StorageIDT> const &OldStorageID, 
+	OptionalT<StorageIDT> const &NewStorageID, 
+	StorageChangesT const &Changes)
+{
+	if (!NewStorageID) return StorageClassT::File;
+	OptionalT<uint64_t> ChangedSize;
+	auto Fits = [&](size_t Limit) 
+	{ 
+		if (!ChangedSize) ChangedSize = GetChangedSize(OldStorageID, Changes);
+		return *ChangedSize <= Limit; 
+	};
+	auto Packable = [&](void) { return Fits(Settings.Packs.MaxObjectSize); };
+	auto Inlinable = [&](void) { return Fits(Settings.MaxInlineSize); };
+	if (OldStorageID == NewStorageID) 
+	{
+		// Packed or inline storage that grows too big moves to its own file
+		auto const Class = GetStorageClass(*OldStorageID);
+		if ((Class == StorageClassT::Overlay) && (Changes.Is<ResizeT>() || Changes.Is<PunchHoleT>())) 
+			return StorageClassT::File;
+		if ((Class == StorageClassT::Packed) && !Packable()) return StorageClassT::File;
+		if ((Class == StorageClassT::Inline) && !Inlinable()) return StorageClassT::File;
+		return Class;
+	}
+	if (OldStorageID)
+	{
+		// Chunked and overlay storage can only be forked as the same class, and chunked storage forks cheaply
+		auto const OldClass = GetStorageClass(*OldStorageID);
+		if (OldClass == StorageClassT::Chunked) return StorageClassT::Chunked;
+		if (OldClass == StorageClassT::Packed) return Packable() ? StorageClassT::Packed : StorageClassT::File;
+		if (OldClass == StorageClassT::Inline) return Inlinable() ? StorageClassT::Inline : StorageClassT::File;
+		if ((Changes.Is<std::vector<BytesChangeT>>() || (Changes.Is<StagedT>() && !Truncates(Changes))) && 
+			(Settings.OverlayStorage || (OldClass == StorageClassT::Overlay)))
+			return StorageClassT::Overlay;
+	}
+	if (Settings.InlineStorage && Inlinable()) return StorageClassT::Inline;
+	if (Settings.PackStorage && Packable()) return StorageClassT::Packed;
+	if (Settings.ChunkStorage) return StorageClassT::Chunked;
+	return StorageClassT::File;
+}
+
+bool CoreT::IsSmallClass(StorageClassT Class)
+	{ return (Class == StorageClassT::Packed) || (Class == StorageClassT::Inline); }
+
+uint64_t CoreT::GetChangedSize(OptionalT<StorageIDT> const &OldStorageID, StorageChangesT const &Changes)
+{
+	if (Changes.Is<ResizeT>()) return Changes.Get<ResizeT>().Length();
+	uint64_t Size = 0;
+	if (OldStorageID && !Truncates(Changes)) Size = Open(*OldStorageID).Size();
+	if (Changes.Is<std::vector<BytesChangeT>>())
+		for (auto const &Change : Changes.Get<std::vector<BytesChangeT>>())
+			Size = std::max<uint64_t>(Size, Change.Offset() + Change.Bytes().size());
+	if (Changes.Is<StagedT>() && !Changes.Get<StagedT>().Ranges().empty())
+	{
+		auto const &Last = Changes.Get<StagedT>().Ranges().back();
+		Size = std::max<uint64_t>(Size, Last.Offset() + Last.Length());
+	}
+	return Size;
+}
+
+bool CoreT::Truncates(StorageChangesT const &Changes)
+	{ return Changes.Is<TruncateT>() || (Changes.Is<StagedT>() && Changes.Get<StagedT>().Truncate()); }
+
+void CoreT::ForEachBytes(
+	StorageChangesT const &Changes, 
+	function<void(std::vector<BytesChangeT> const &Changes)> const &Apply)
+{
+	if (Changes.Is<std::vector<BytesChangeT>>()) 
+	{
+		Apply(Changes.Get<std::vector<BytesChangeT>>());
+		return;
+	}
+	if (!Changes.Is<StagedT>()) return;
 
-	size_t StorageOffset = 0;
-	while (true)
+	// Staged bytes are read back a piece at a time, so memory use doesn't depend on the size of the change
+	auto const &Staged = Changes.Get<StagedT>();
+	FileDescriptorT Source(GetStagePath(Staged.Stage()), O_RDONLY);
+	std::vector<BytesChangeT> Piece{BytesChangeT(0, std::vector<uint8_t>())};
+	for (auto const &Range : Staged.Ranges())
 	{
-		auto Storage = ListStorage(StorageOffset, ListSize);
-		for (auto const &AStorage : Storage)
+		auto const End = Range.Offset() + Range.Length();
+		for (auto Offset = Range.Offset(); Offset < End; Offset += StagedPieceSize)
 		{
-			Out.Write(StringT() << 
-				"{ "
-					"\"s" << AStorage.StorageID() << "\" " <<
-					"[label = \"s " << AStorage.StorageID() << " (" << (int)*AStorage.ReferenceCount() << ")\", shape = box, color = brown] "
-				"};\n");
+			auto const Length = static_cast<size_t>(std::min<uint64_t>(StagedPieceSize, End - Offset));
+			Piece[0].Offset() = Offset;
+			Piece[0].Bytes().resize(Length);
+			if (Source.Read(Offset, Piece[0].Bytes().data(), Length) < Length)
+				throw SYSTEM_ERROR << "Staged change " << Staged.Stage() << " was truncated";
+			Apply(Piece);
 		}
-		if (Storage.size() < ListSize) break;
-		StorageOffset += Storage.size();
 	}
+}
 
-	Out.Write(StringT() << "\n}\n");
+Filesystem::PathT CoreT::GetStagePath(uint64_t Stage)
+	{ return StagingRoot.Enter(StringT() << Stage); }
+
+void CoreT::NoteUnsynced(StorageIDT const &StorageID)
+{
+	Unsynced.Note(GetStoragePath(StorageID));
+	Unsynced.NoteDirectory(GetStorageShard(StorageID));
+}
+
+void CoreT::CopyStorage(Filesystem::PathT const &From, Filesystem::PathT const &To)
+{
+	LOG(Log, Spam, StringT() << "Copying to " << To.Render());
+	auto const Copy = CopyStorageFile(From, To);
+	CopyStats.Record(Copy);
+	LOG(Log, Debug, StringT() << 
+		"Copied " << From.Render() << " to " << To.Render() << 
+		" using " << FormatCopyStrategy(Copy.Strategy) << 
+		" (" << Copy.Size << " bytes, " << Copy.Duration.count() << "us)");
+}
+
+bool CoreT::LinkStaged(StagedT const &Staged, Filesystem::PathT const &Path)
+{
+	auto const Rendered = Path.Render();
+	// Left by an attempt that rolled back
+	if ((unlink(Rendered.c_str()) != 0) && (errno != ENOENT))
+		throw SYSTEM_ERROR << "Could not remove " << Rendered << ": " << strerror(errno);
+	Descriptors.Forget(Path);
+	auto const StagePath = GetStagePath(Staged.Stage()).Render();
+	if (link(StagePath.c_str(), Rendered.c_str()) == 0) return true;
+	LOG(Log, Debug, StringT() << "Could not link " << StagePath << " to " << Rendered << ": " << strerror(errno));
+	return false;
 }
 
-Filesystem::PathT CoreT::GetStoragePath(StorageIDT const &StorageID)
+void CoreT::WriteStorageFile(StorageReaderT &&Source, Filesystem::PathT const &Path)
 {
-	return StorageRoot.Enter(StringT() << StorageID);
+	FileDescriptorT Out(Path, O_WRONLY | O_CREAT | O_TRUNC);
+	uint64_t Offset = 0;
+	std::vector<uint8_t> Buffer;
+	while (Source.Read(Buffer))
+	{
+		// Zero runs are left as holes
+		if (std::any_of(Buffer.begin(), Buffer.end(), [](uint8_t Byte) { return Byte != 0; }))
+			Out.Write(Offset, &Buffer[0], Buffer.size());
+		Offset += Buffer.size();
+	}
+	Out.Resize(Offset);
+}
+
+void CoreT::NoteHeadName(GlobalChangeIDT const &HeadID)
+{
+	// Heads are noted while they're in the database, after being added and before being removed
+	if (auto Head = FindHead(HeadID)) ChangedNames.push_back(DentryKeyT{Head->Meta().DirID(), Head->Meta().Filename()});
+}
+
+OptionalT<MissingT> CoreT::FindMissing(GlobalChangeIDT const &ChangeID)
+{
+	if (auto Found = NodeCache.Missing.Find(ChangeID)) return *Found;
+	return NodeCache.Missing.Insert(ChangeID, Database->GetMissing(ChangeID));
+}
+
+OptionalT<HeadT> CoreT::FindHead(GlobalChangeIDT const &HeadID)
+{
+	if (auto Found = NodeCache.Heads.Find(HeadID)) return *Found;
+	return NodeCache.Heads.Insert(HeadID, Database->GetHead(HeadID));
+}
+
+OptionalT<StorageT> CoreT::FindStorage(StorageIDT const &StorageID)
+{
+	if (auto Found = NodeCache.Storage.Find(StorageID)) return *Found;
+	return NodeCache.Storage.Insert(StorageID, Database->GetStorage(StorageID));
+}
+
+OptionalT<StorageIDT> CoreT::DetachParent(StorageIDT const &StorageID)
+{
+	auto Parent = Database->GetStorageParent(StorageID);
+	if (!Parent) return {};
+	Database->ClearStorageParent(StorageID);
+	auto Storage = *FindStorage(*Parent);
+	AssertGT(Storage.ReferenceCount(), StorageReferenceCountT(0));
+	auto const RefCount = Storage.ReferenceCount() - StorageReferenceCountT(1);
+	if (RefCount == StorageReferenceCountT(0)) return Parent;
+	Database->SetStorageRefCount(*Parent, RefCount);
+	NodeCache.Storage.Insert(*Parent, StorageT(*Parent, RefCount));
+	return {};
+}
+
+void CoreT::ReleaseStorage(StorageIDT const &StorageID)
+{
+	// Releasing an overlay can leave its parent unreferenced
+	OptionalT<StorageIDT> Next = StorageID;
+	while (Next)
+	{
+		auto const ID = *Next;
+		LOG(Log, Spam, StringT() << "Deleting storage " << ID);
+		switch (GetStorageClass(ID))
+		{
+			case StorageClassT::Chunked: Chunks->Release(ID); break;
+			case StorageClassT::Packed: Packs->Release(ID); break;
+			case StorageClassT::Inline: break;
+			case StorageClassT::Overlay: 
+				Overlays->Release(ID); 
+				Descriptors.Forget(GetStoragePath(ID));
+				Garbage->Discard(GetStoragePath(ID)); 
+				break;
+			default: 
+				Descriptors.Forget(GetStoragePath(ID));
+				Garbage->Discard(GetStoragePath(ID)); 
+				break;
+		}
+		Next = DetachParent(ID);
+		Database->DeleteStorage(ID);
+		NodeCache.Storage.Insert(ID, {});
+	}
 }
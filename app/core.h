@@ -1,7 +1,10 @@
 #ifndef core_h
 #define core_h
 
+#include <atomic>
 #include <list>
+#include <mutex>
+#include <unordered_set>
 
 #include "../ren-cxx-basics/function.h"
 #include "../ren-cxx-filesystem/path.h"
@@ -9,8 +12,23 @@
 #include "types.h"
 #include "structtypes.h"
 #include "coredatabase.h"
+#include "connectionpool.h"
 #include "coretransactions.h"
+#include "storagecopy.h"
+#include "storagereader.h"
+#include "storageview.h"
+#include "writeplan.h"
+#include "stagedchange.h"
+#include "chunkstore.h"
+#include "overlaystore.h"
+#include "packstore.h"
+#include "garbagecollector.h"
+#include "nodecache.h"
+#include "unsyncedfiles.h"
+#include "dircache.h"
+#include "dentrycache.h"
 #include "log.h"
+#include "md5/hash.h"
 
 template <typename SignatureT> struct NotifyT {};
 
@@ -37,14 +55,14 @@ template <typename ...ArgumentsT> struct NotifyT<void(ArgumentsT...)>
 				Base->Listeners.erase(Found);
 			}
 
-		friend struct NotifyT<ArgumentsT...>;
+		friend struct NotifyT<void(ArgumentsT...)>;
 		private:
-			TokenT(uint64_t ID, NotifyT<ArgumentsT...> *Base) :
+			TokenT(uint64_t ID, NotifyT<void(ArgumentsT...)> *Base) :
 				ID(ID), Base(Base) 
 				{}
 
 			uint64_t ID;
-			NotifyT<ArgumentsT...> *Base;
+			NotifyT<void(ArgumentsT...)> *Base;
 	};
 
 	~NotifyT(void)
@@ -76,7 +94,63 @@ template <typename ...ArgumentsT> struct NotifyT<void(ArgumentsT...)>
 				{}
 		};
 		std::list<ListenerT> Listeners;
-		uint64_t IDCounter;
+		uint64_t IDCounter = 0;
+};
+
+struct CoreSettingsT
+{
+	// Store new storage as deduplicated content defined chunks rather than whole files
+	bool ChunkStorage = false;
+	ChunkSettingsT Chunks;
+
+	// Fork storage as an overlay of the changed extents rather than copying it
+	bool OverlayStorage = false;
+	// Overlays deeper than this are flattened by FlattenOverlays
+	uint64_t MaxOverlayDepth = 8;
+
+	// Keep tiny storage in the database rather than giving each its own file
+	bool InlineStorage = false;
+	size_t MaxInlineSize = 256;
+
+	// Append small storage to shared segment files rather than giving each its own file
+	bool PackStorage = false;
+	PackSettingsT Packs;
+
+	GarbageSettingsT Garbage;
+
+	// Metadata database tuning
+	SQLSettingsT Database;
+
+	// Read-only connections for the public queries, opened as needed.  With write ahead logging they read the last
+	// commit in parallel with each other and with the writer.
+	size_t ReadConnections = 4;
+
+	// Node, change and storage IDs are reserved in the database this many at a time and handed out from memory.
+	// IDs left over when the core closes are skipped.
+	size_t IDBlockSize = 1024;
+
+	// Storage file descriptors kept open between calls to Open
+	size_t OpenDescriptors = 64;
+
+	// Missing, head and storage rows of each kind the writer keeps in memory, at least 1
+	size_t NodeCacheSize = 4096;
+
+	// Memory for whole directory listings kept for ListDirHeads, 0 to always query the database
+	size_t DirCacheBytes = 16 * 1024 * 1024;
+
+	// Directory and filename lookups kept for LookupName and LookupPath, at least 1
+	size_t DentryCacheSize = 64 * 1024;
+
+	// Byte changes bigger than this are staged to a file first, so the journal only records a reference to them
+	size_t MaxJournaledBytes = 4096;
+
+	// Group commit and checkpointing for the transaction journal
+	TransactorSettingsT Journal;
+
+	// Record each transaction's intent in the database, in the same SQLite transaction as its metadata changes,
+	// rather than in the journal file.  After a crash only in place changes to plain file storage are redone from 
+	// the intents; every other storage file a change writes is synced before its intent commits.
+	bool DatabaseJournal = false;
 };
 
 struct CoreT
@@ -87,7 +161,10 @@ struct CoreT
 	NotifyT<void(GlobalChangeIDT const &)> HeadAddListeners;
 	NotifyT<void(GlobalChangeIDT const &)> HeadRemoveListeners;
 
-	CoreT(OptionalT<std::string> const &InstanceName, Filesystem::PathT const &Root);
+	CoreT(
+		OptionalT<std::string> const &InstanceName, 
+		Filesystem::PathT const &Root, 
+		CoreSettingsT const &Settings = CoreSettingsT());
 
 	/*void AddInstance(std::string const &Name);
 	InstanceIDT AddInstance(std::string const &Name);*/
@@ -95,6 +172,11 @@ struct CoreT
 	ChangeIndexT ReserveChange(void);
 	void AddChange(ChangeT const &Change);
 	void DefineChange(GlobalChangeIDT const &ChangeID, VariantT<DefineHeadT, DeleteHeadT> const &Definition);
+
+	// Start a storage change for ChangeID that's written a piece at a time, for changes too big to hold in memory.
+	// With Truncate the staged writes replace the old contents, otherwise they're written over them.
+	StagedChangeT StageChange(GlobalChangeIDT const &ChangeID, bool Truncate);
+	void DefineChange(StagedChangeT Staged, NodeMetaT const &MetaChanges);
 	/*std::array<GlobalChangeIDT, PageSize> GetMissings(size_t Page);
 	std::array<HeadT, PageSize> GetHeads(NodeIDT ParentID, OptionalT<InstanceIDT> Split);*/
 
@@ -104,27 +186,102 @@ struct CoreT
 		ChangeT const &Change,
 		OptionalT<ChangeIDT> const &HeadID,
 		OptionalT<StorageIDT> const &StorageID, 
-		OptionalT<StorageReferenceCountT> const &StorageRefCount,
+		OptionalT<StorageReferenceCountV1T> const &StorageRefCount,
 		bool const &DeleteMissing);
 	void Handle(
 		CTV1UpdateDeleteHead,
 		OptionalT<StorageIDT> const &StorageID, 
+		OptionalT<StorageReferenceCountV1T> const &StorageRefCount,
+		GlobalChangeIDT const &ChangeID,
+		OptionalT<ChangeIDT> const &DeleteParent,
+		OptionalT<HeadT> const &NewHead,
+		StorageChangesT const &DataChanges);
+	void Handle(
+		CTV2AddChange,
+		ChangeT const &Change,
+		OptionalT<ChangeIDT> const &HeadID,
+		OptionalT<StorageIDT> const &StorageID, 
+		OptionalT<StorageReferenceCountT> const &StorageRefCount,
+		bool const &DeleteMissing);
+	void Handle(
+		CTV2UpdateDeleteHead,
+		OptionalT<StorageIDT> const &StorageID, 
 		OptionalT<StorageReferenceCountT> const &StorageRefCount,
 		GlobalChangeIDT const &ChangeID,
 		OptionalT<ChangeIDT> const &DeleteParent,
 		OptionalT<HeadT> const &NewHead,
 		StorageChangesT const &DataChanges);
+	void Handle(
+		CTV1FlattenStorage,
+		StorageIDT const &StorageID);
+	void Handle(
+		CTV1CompactSegment,
+		SegmentIndexT const &Segment);
 
 	InstanceIndexT GetThisInstance(void) const;
-	std::vector<ChangeT> ListChanges(size_t Start, size_t Count);
-	std::vector<MissingT> ListMissing(size_t Start, size_t Count);
-	std::vector<HeadT> ListHeads(size_t Start, size_t Count);
-	std::vector<HeadT> ListDirHeads(OptionalT<NodeIDT> const &Dir, size_t Start, size_t Count);
-	std::vector<StorageT> ListStorage(size_t Start, size_t Count);
+
+	// The lists, visitors and GetHead below read through pooled connections, so other threads can call them while 
+	// one thread changes the core.  They see the last committed change.
+
+	// Lists are in key order and paged by key: pass the key of the last item of one page to get the next
+	std::vector<ChangeT> ListChanges(OptionalT<GlobalChangeIDT> const &After, size_t Count);
+	std::vector<MissingT> ListMissing(OptionalT<GlobalChangeIDT> const &After, size_t Count);
+	std::vector<HeadT> ListHeads(OptionalT<GlobalChangeIDT> const &After, size_t Count);
+	// Directory heads are ordered by filename
+	std::vector<HeadT> ListDirHeads(OptionalT<NodeIDT> const &Dir, OptionalT<DirHeadKeyT> const &After, size_t Count);
+	std::vector<StorageT> ListStorage(OptionalT<StorageIDT> const &After, size_t Count);
+
+	// Stream every row to Visitor in the same order as the lists, without building a list.  Visitor returns false 
+	// to stop early, and mustn't change the core.
+	void ForEachChange(function<bool(ChangeT &&Change)> const &Visitor);
+	void ForEachMissing(function<bool(MissingT &&Missing)> const &Visitor);
+	void ForEachHead(function<bool(HeadT &&Head)> const &Visitor);
+	// Only reads each head's ID and storage, skipping its metadata
+	void ForEachHeadStorage(function<bool(GlobalChangeIDT &&ChangeID, OptionalT<StorageIDT> &&StorageID)> const &Visitor);
+	void ForEachDirHead(OptionalT<NodeIDT> const &Dir, function<bool(HeadT &&Head)> const &Visitor);
+	// Only reads each head's filename and ID
+	void ForEachDirHeadKey(OptionalT<NodeIDT> const &Dir, function<bool(DirHeadKeyT &&Key)> const &Visitor);
+	void ForEachStorage(function<bool(StorageT &&Storage)> const &Visitor);
 	
 	OptionalT<HeadT> GetHead(GlobalChangeIDT const &HeadID);
 
-	Filesystem::FileT Open(StorageIDT const &Storage);
+	// The heads named Filename in Dir, in ListDirHeads order.  There's more than one if nodes share the name or a 
+	// node has several heads.
+	std::vector<HeadT> LookupName(OptionalT<NodeIDT> const &Dir, std::string const &Filename);
+	// Resolves a /-separated path from the root directory, looking up each name in turn.  Empty if a name is 
+	// missing or belongs to more than one node.  Otherwise holds the directory ID the path names, in the form Dir 
+	// arguments take, so paths without names ("", "/") resolve to an empty ID for the root.
+	OptionalT<OptionalT<NodeIDT>> LookupPath(std::string const &Path);
+
+	StorageReaderT Open(StorageIDT const &Storage);
+	DescriptorCacheT const &GetDescriptorCache(void) const;
+	NodeStateCacheT const &GetNodeCache(void) const;
+	DirCacheT const &GetDirCache(void) const;
+	DentryCacheT const &GetDentryCache(void) const;
+
+	// Map the contents of Storage without copying them where possible (file and packed storage)
+	StorageViewT Map(StorageIDT const &Storage, MapAccessT Access = MapAccessT::Sequential);
+	HashT HashStorage(StorageIDT const &Storage);
+
+	// Move up to Limit storage files from the old flat layout into shard directories.  Storage is also moved
+	// when it's used.  Returns the number moved; call when idle until it returns 0.
+	size_t MigrateStorage(size_t Limit);
+
+	// Find storage that no head or missing reaches and reference counts that drifted, and sweep files the database 
+	// doesn't know, all on the collector threads.  Runs when the core starts.  What's found is fixed before the 
+	// next change, or by WaitForGarbage.
+	void CollectGarbage(void);
+	void WaitForGarbage(void);
+
+	// Copy up to Limit overlays deeper than MaxOverlayDepth into plain files, so reads don't resolve through
+	// long chains.  Returns the number flattened; call when idle until it returns 0.
+	size_t FlattenOverlays(size_t Limit);
+
+	// Rewrite up to Limit pack segments whose live data fell below MinLivePercent.  Returns the number 
+	// compacted; call when idle until it returns 0.
+	size_t CompactSegments(size_t Limit);
+
+	CopyStatsT const &GetCopyStats(void) const;
 
 	bool Validate(void);
 
@@ -133,17 +290,138 @@ struct CoreT
 	private:
 		Filesystem::PathT const Root;
 		Filesystem::PathT const StorageRoot;
+		Filesystem::PathT const StagingRoot;
+		CoreSettingsT const Settings;
 		BasicLogT Log;
 		std::unique_ptr<CoreDatabaseT> Database;
+		std::unique_ptr<ConnectionPoolT<CoreReaderDatabaseT>> Readers;
+		// The thread in a handler transaction, if any
+		std::atomic<std::thread::id> Writer{std::thread::id()};
+		template <typename ReadT> auto Read(ReadT const &Function);
+		StorageLayoutT StorageLayout;
+		std::vector<bool> CreatedShards;
+		// Files still in the flat layout's root, listed once when the core starts, so finding a storage path doesn't 
+		// stat the old location each time
+		std::unordered_set<std::string> FlatNames;
+		DescriptorCacheT Descriptors;
+		// Storage files the open intent can't redo, with DatabaseJournal
+		UnsyncedFilesT Unsynced;
+		NodeStateCacheT NodeCache;
+		DirCacheT DirCache;
+		DentryCacheT Dentries;
+		// Names of heads changed in the open transaction, invalidated in DirCache and Dentries once it commits
+		std::vector<DentryKeyT> ChangedNames;
+		void NoteHeadName(GlobalChangeIDT const &HeadID);
+		// Found by the last mark on a collector thread, until the writer applies it.  Declared before Garbage so 
+		// it outlives the collector threads.
+		struct MarkT
+		{
+			std::vector<StorageIDT> Unreachable;
+			std::vector<StorageT> Miscounted;
+		};
+		std::mutex MarkMutex;
+		std::unique_ptr<MarkT> Marked;
+		void ApplyMark(void);
+		std::unique_ptr<GarbageCollectorT> Garbage;
+		std::unique_ptr<ChunkStoreT> Chunks;
+		std::unique_ptr<OverlayStoreT> Overlays;
+		std::unique_ptr<PackStoreT> Packs;
 		typedef TransactorT<
 				CoreT,
 				CTV1AddChange,
-				CTV1UpdateDeleteHead> CoreTransactorT;
+				CTV1UpdateDeleteHead,
+				CTV1FlattenStorage,
+				CTV1CompactSegment,
+				CTV2AddChange,
+				CTV2UpdateDeleteHead> CoreTransactorT;
 		std::unique_ptr<CoreTransactorT> Transact;
 
 		InstanceIndexT ThisInstance;
 
-		Filesystem::PathT GetStoragePath(StorageIDT const &StorageID);
+		CopyStatsT CopyStats;
+
+		struct IDBlockT
+		{
+			IDBaseT Next = 0;
+			IDBaseT End = 0;
+
+			// Advance reserves Size more IDs in the database and returns the first
+			template <typename AdvanceT> IDBaseT Take(size_t Size, AdvanceT const &Advance)
+			{
+				if (Next == End)
+				{
+					Next = Advance(Size);
+					End = Next + Size;
+				}
+				return Next++;
+			}
+		};
+		IDBlockT NodeBlock;
+		IDBlockT ChangeBlock;
+		IDBlockT StorageBlock;
+		StorageIDT ReserveStorage(void);
+
+		uint64_t StageCounter = 0;
+		bool Replaying = false;
+		uint64_t IntentBytes = 0;
+
+		NotifyT<void(GlobalChangeIDT const &)>::TokenT DirHeadAdded;
+		NotifyT<void(GlobalChangeIDT const &)>::TokenT DirHeadRemoved;
+
+		// A database transaction that also holds back garbage until it commits, so a rolled back handler
+		// doesn't unlink files the database still references.  Handlers each run in one; nested they're savepoints.
+		struct TransactionT
+		{
+			TransactionT(CoreT &Core);
+			~TransactionT(void);
+			void Commit(void);
+
+			private:
+				CoreT &Core;
+				GarbageCollectorT &Garbage;
+				bool const Outermost;
+				SQLDatabaseT::TransactionT Transaction;
+				bool Committed;
+		};
+
+		template <typename MessageT, typename ...ArgumentsT> 
+			void Act(MessageT, ArgumentsT const &...Arguments);
+		friend struct IntentReplayT;
+		void ReplayIntents(void);
+		// Created if the change made StorageID rather than changing existing storage
+		void ReplayStorageChanges(StorageIDT const &StorageID, StorageChangesT const &StorageChanges, bool Created);
+		void CheckpointIntents(void);
+
+		Filesystem::PathT GetStoragePath(StorageIDT const &StorageID, std::string const &Suffix = "");
+		Filesystem::PathT GetStorageShard(StorageIDT const &StorageID);
+		void MoveStorageFile(Filesystem::PathT const &From, Filesystem::PathT const &To);
+		StorageClassT GetStorageClass(StorageIDT const &StorageID);
+		static bool IsSmallClass(StorageClassT Class);
+		uint64_t GetChangedSize(OptionalT<StorageIDT> const &OldStorageID, StorageChangesT const &Changes);
+		void WriteStorageFile(StorageReaderT &&Source, Filesystem::PathT const &Path);
+		// Queue StorageID's file and its directory entry to be synced before the open intent commits
+		void NoteUnsynced(StorageIDT const &StorageID);
+		void CopyStorage(Filesystem::PathT const &From, Filesystem::PathT const &To);
+		// Gives new storage at Path the staged contents without copying them, by hard linking it to the staging 
+		// file, which was synced before the change.  The staging name goes with the stage.  Returns false where the 
+		// filesystem can't link.
+		bool LinkStaged(StagedT const &Staged, Filesystem::PathT const &Path);
+		static bool Truncates(StorageChangesT const &Changes);
+		// Calls Apply with the byte changes in Changes, in bounded pieces for staged changes
+		void ForEachBytes(
+			StorageChangesT const &Changes, 
+			function<void(std::vector<BytesChangeT> const &Changes)> const &Apply);
+		Filesystem::PathT GetStagePath(uint64_t Stage);
+		StorageClassT ChooseStorageClass(
+			OptionalT<StorageIDT> const &OldStorageID, 
+			OptionalT<StorageIDT> const &NewStorageID, 
+			StorageChangesT const &Changes);
+		// Reads of the rows changes are made from, through NodeCache
+		OptionalT<MissingT> FindMissing(GlobalChangeIDT const &ChangeID);
+		OptionalT<HeadT> FindHead(GlobalChangeIDT const &HeadID);
+		OptionalT<StorageT> FindStorage(StorageIDT const &StorageID);
+		OptionalT<StorageIDT> DetachParent(StorageIDT const &StorageID);
+		void ReleaseStorage(StorageIDT const &StorageID);
 };
 
 #endif
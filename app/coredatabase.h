@@ -6,14 +6,21 @@
 enum class CoreDatabaseVersionT : unsigned int
 {
 	V1 = 0,
+	V2, // Storage classes, chunk store
+	V3, // Overlay storage
+	V4, // Sharded storage directory
+	V5, // Pack segments
+	V6, // Inline storage
+	V7, // Transaction intents
+	V8, // Directory, parent and per-instance indexes
 	End,
 	Latest = End - 1
 };
 
 struct CoreDatabaseBaseT : SQLDatabaseT
 {
-	inline CoreDatabaseBaseT(Filesystem::PathT const &DatabasePath) : 
-		SQLDatabaseT(DatabasePath)
+	inline CoreDatabaseBaseT(Filesystem::PathT const &DatabasePath, SQLSettingsT const &Settings) : 
+		SQLDatabaseT(DatabasePath, Settings)
 	{
 		bool Exists = *Get<bool (std::string const &TableName)>(
 			"SELECT count(1) FROM \"sqlite_master\" WHERE \"type\" = \"table\" AND \"name\" = ? LIMIT 1", "Stats");
@@ -30,7 +37,7 @@ struct CoreDatabaseBaseT : SQLDatabaseT
 				"\"StorageCounter\" INTEGER NOT NULL "
 			")");
 			Execute("INSERT INTO \"Stats\" VALUES (?, ?, ?, ?, ?, ?)", 
-				(unsigned int)CoreDatabaseVersionT::Latest,
+				(unsigned int)CoreDatabaseVersionT::V1,
 				std::string(""),
 				0,
 				1,
@@ -92,28 +99,245 @@ struct CoreDatabaseBaseT : SQLDatabaseT
 				"\"ReferenceCount\" INTEGER NOT NULL "
 			")");
 		}
-		else 
+
+		// Upgrade from whatever version to latest, one step at a time
+		auto Version = *Get<unsigned int(void)>("SELECT \"Version\" FROM \"Stats\"");
+		if (Version > (unsigned int)CoreDatabaseVersionT::Latest)
+			throw SYSTEM_ERROR << "Unknown database version " << Version;
+		if (Version == (unsigned int)CoreDatabaseVersionT::Latest) return;
+		auto Transaction = Begin();
+		switch ((CoreDatabaseVersionT)Version)
 		{
-			auto Version = *Get<unsigned int(void)>("SELECT \"Version\" FROM \"Stats\"");
-			switch ((CoreDatabaseVersionT)Version)
-			{
-				case CoreDatabaseVersionT::Latest: break;
-				default: throw SYSTEM_ERROR << "Unknown database version " << Version;;
-			}
+			case CoreDatabaseVersionT::V1:
+				Execute("ALTER TABLE \"Storage\" ADD COLUMN \"Class\" INTEGER NOT NULL DEFAULT 0");
+
+				Execute("CREATE TABLE \"Chunks\" "
+				"("
+					"\"Hash\" CHAR(32) PRIMARY KEY , "
+					"\"Size\" INTEGER NOT NULL , "
+					"\"ReferenceCount\" INTEGER NOT NULL "
+				")");
+
+				Execute("CREATE TABLE \"StorageChunks\" "
+				"("
+					"\"StorageIndex\" INTEGER NOT NULL , "
+					"\"Offset\" INTEGER NOT NULL , "
+					"\"Size\" INTEGER NOT NULL , "
+					"\"Hash\" CHAR(32) NOT NULL , "
+					"PRIMARY KEY (\"StorageIndex\", \"Offset\")"
+				")");
+				// Chunk reference counts are recounted grouped by hash
+				Execute("CREATE INDEX \"StorageChunksHash\" ON \"StorageChunks\" (\"Hash\")");
+				// fallthrough
+			case CoreDatabaseVersionT::V2:
+				Execute("ALTER TABLE \"Storage\" ADD COLUMN \"Parent\" INTEGER");
+				Execute("ALTER TABLE \"Storage\" ADD COLUMN \"Depth\" INTEGER NOT NULL DEFAULT 0");
+				Execute("CREATE INDEX \"StorageParent\" ON \"Storage\" (\"Parent\")");
+				// The garbage collector counts each storage's heads and missings
+				Execute("CREATE INDEX \"HeadsStorage\" ON \"Heads\" (\"StorageIndex\")");
+				Execute("CREATE INDEX \"MissingStorage\" ON \"Missing\" (\"StorageIndex\")");
+
+				Execute("CREATE TABLE \"OverlayExtents\" "
+				"("
+					"\"StorageIndex\" INTEGER NOT NULL , "
+					"\"Offset\" INTEGER NOT NULL , "
+					"\"Length\" INTEGER NOT NULL , "
+					"\"DataOffset\" INTEGER NOT NULL , "
+					"PRIMARY KEY (\"StorageIndex\", \"Offset\")"
+				")");
+				// fallthrough
+			case CoreDatabaseVersionT::V3:
+				// Existing storage stays in the flat layout until CoreT migrates it
+				Execute("ALTER TABLE \"Stats\" ADD COLUMN \"StorageLayout\" INTEGER NOT NULL DEFAULT 0");
+				// fallthrough
+			case CoreDatabaseVersionT::V4:
+				Execute("ALTER TABLE \"Stats\" ADD COLUMN \"SegmentCounter\" INTEGER NOT NULL DEFAULT 0");
+				Execute("ALTER TABLE \"Storage\" ADD COLUMN \"Segment\" INTEGER");
+				Execute("ALTER TABLE \"Storage\" ADD COLUMN \"SegmentOffset\" INTEGER");
+				Execute("ALTER TABLE \"Storage\" ADD COLUMN \"Length\" INTEGER");
+				Execute("CREATE INDEX \"StorageSegment\" ON \"Storage\" (\"Segment\")");
+
+				Execute("CREATE TABLE \"PackSegments\" "
+				"("
+					"\"Segment\" INTEGER PRIMARY KEY , "
+					"\"Size\" INTEGER NOT NULL , "
+					"\"LiveBytes\" INTEGER NOT NULL "
+				")");
+				// fallthrough
+			case CoreDatabaseVersionT::V5:
+				Execute("ALTER TABLE \"Storage\" ADD COLUMN \"Data\" BLOB");
+				// fallthrough
+			case CoreDatabaseVersionT::V6:
+				Execute("CREATE TABLE \"Intents\" "
+				"("
+					"\"Intent\" INTEGER PRIMARY KEY AUTOINCREMENT , "
+					"\"Message\" BLOB NOT NULL "
+				")");
+				// fallthrough
+			case CoreDatabaseVersionT::V7:
+				// Directory listings read whole rows in listing order, so the index holds the whole row sorted the same way
+				Execute("CREATE INDEX \"HeadsDirectory\" ON \"Heads\" "
+					"(\"DirInstance\", \"DirIndex\", \"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\", "
+					"\"StorageIndex\", \"Writable\", \"Executable\", \"CreateTimestamp\", \"ModifyTimestamp\")");
+				Execute("CREATE INDEX \"ChangesParent\" ON \"Changes\" "
+					"(\"NodeInstance\", \"NodeIndex\", \"ParentChangeInstance\", \"ParentChangeIndex\")");
+				Execute("CREATE INDEX \"MissingInstance\" ON \"Missing\" (\"ChangeInstance\", \"ChangeIndex\")");
+				// fallthrough
+			case CoreDatabaseVersionT::Latest: break;
+			default: throw SYSTEM_ERROR << "Unknown database version " << Version;
 		}
+		Execute("UPDATE \"Stats\" SET \"Version\" = ?", (unsigned int)CoreDatabaseVersionT::Latest);
+		Transaction.Commit();
 	}
 };
 
-struct CoreDatabaseT : CoreDatabaseBaseT
+// The statements behind CoreT's public reads, prepared both on the writer and on each pooled reader connection
+struct CoreQueriesT
+{
+	template <typename SignatureT> using StatementT = typename SQLDatabaseT::StatementT<SignatureT>;
+
+	StatementT<ChangeT (size_t Count)> ListChanges;
+	StatementT<ChangeT (GlobalChangeIDT const &After, size_t Count)> ListChangesAfter;
+
+	StatementT<MissingT (size_t Count)> ListMissing;
+	StatementT<MissingT (GlobalChangeIDT const &After, size_t Count)> ListMissingAfter;
+
+	StatementT<HeadT (size_t Count)> ListHeads;
+	StatementT<HeadT (GlobalChangeIDT const &After, size_t Count)> ListHeadsAfter;
+	StatementT<HeadT (OptionalT<NodeIDT> const &Dir, size_t Count)> ListDirHeads;
+	StatementT<HeadT (OptionalT<NodeIDT> const &Dir, DirHeadKeyT const &After, size_t Count)> ListDirHeadsAfter;
+	StatementT<HeadT (GlobalChangeIDT const &ID)> GetHead;
+	StatementT<HeadT (OptionalT<NodeIDT> const &Dir, std::string const &Filename)> LookupName;
+
+	StatementT<StorageT (size_t Count)> ListStorage;
+	StatementT<StorageT (StorageIDT const &After, size_t Count)> ListStorageAfter;
+
+	StatementT<ChangeT (void)> ForEachChange;
+	StatementT<MissingT (void)> ForEachMissing;
+	StatementT<HeadT (void)> ForEachHead;
+	StatementT<std::tuple<GlobalChangeIDT, OptionalT<StorageIDT>> (void)> ForEachHeadStorage;
+	StatementT<HeadT (OptionalT<NodeIDT> const &Dir)> ForEachDirHead;
+	StatementT<DirHeadKeyT (OptionalT<NodeIDT> const &Dir)> ForEachDirHeadKey;
+	StatementT<StorageT (void)> ForEachStorage;
+
+	// Garbage collection reads, run on the collector threads
+	StatementT<StorageIndexT (void)> ListUnreachableStorage;
+	StatementT<StorageT (void)> ListMiscountedStorage;
+	StatementT<uint64_t (StorageIndexT const &ID)> HasStorage;
+	StatementT<uint64_t (std::string const &Hash)> HasChunk;
+	StatementT<uint64_t (SegmentIndexT const &Segment)> HasSegment;
+
+	inline CoreQueriesT(SQLDatabaseT *Base) : 
+		// Lists are paged by key rather than offset, so each page is a single index seek
+		ListChanges(Base,
+			"SELECT * FROM \"Changes\" ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+		ListChangesAfter(Base,
+			"SELECT * FROM \"Changes\" WHERE (\"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\") > (?, ?, ?, ?) ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+
+		ListMissing(Base,
+			"SELECT * FROM \"Missing\" ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+		ListMissingAfter(Base,
+			"SELECT * FROM \"Missing\" WHERE (\"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\") > (?, ?, ?, ?) ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+
+		ListHeads(Base,
+			"SELECT * FROM \"Heads\" ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+		ListHeadsAfter(Base,
+			"SELECT * FROM \"Heads\" WHERE (\"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\") > (?, ?, ?, ?) ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+		ListDirHeads(Base,
+			"SELECT * FROM \"Heads\" WHERE \"DirInstance\" IS ? AND \"DirIndex\" IS ? "
+				"ORDER BY \"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+		ListDirHeadsAfter(Base,
+			"SELECT * FROM \"Heads\" WHERE \"DirInstance\" IS ? AND \"DirIndex\" IS ? AND "
+				"(\"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\") > (?, ?, ?, ?, ?) "
+				"ORDER BY \"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" LIMIT ?"),
+		GetHead(Base,
+			"SELECT * FROM \"Heads\" WHERE \"NodeInstance\" = ? AND \"NodeIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ? LIMIT 1"),
+		LookupName(Base,
+			"SELECT * FROM \"Heads\" WHERE \"DirInstance\" IS ? AND \"DirIndex\" IS ? AND \"Filename\" = ? "
+				"ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\""),
+
+		ListStorage(Base,
+			"SELECT \"StorageIndex\", \"ReferenceCount\" FROM \"Storage\" ORDER BY \"StorageIndex\" LIMIT ?"),
+		ListStorageAfter(Base,
+			"SELECT \"StorageIndex\", \"ReferenceCount\" FROM \"Storage\" WHERE \"StorageIndex\" > ? ORDER BY \"StorageIndex\" LIMIT ?"),
+
+		ForEachChange(Base,
+			"SELECT * FROM \"Changes\" ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\""),
+		ForEachMissing(Base,
+			"SELECT * FROM \"Missing\" ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\""),
+		ForEachHead(Base,
+			"SELECT * FROM \"Heads\" ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\""),
+		ForEachHeadStorage(Base,
+			"SELECT \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\", \"StorageIndex\" FROM \"Heads\" ORDER BY \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\""),
+		ForEachDirHead(Base,
+			"SELECT * FROM \"Heads\" WHERE \"DirInstance\" IS ? AND \"DirIndex\" IS ? ORDER BY \"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\""),
+		ForEachDirHeadKey(Base,
+			"SELECT \"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\" FROM \"Heads\" "
+				"WHERE \"DirInstance\" IS ? AND \"DirIndex\" IS ? ORDER BY \"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\""),
+		ForEachStorage(Base,
+			"SELECT \"StorageIndex\", \"ReferenceCount\" FROM \"Storage\" ORDER BY \"StorageIndex\""),
+
+		ListUnreachableStorage(Base,
+			"WITH RECURSIVE \"Reachable\" (\"StorageIndex\") AS "
+			"("
+				"SELECT \"StorageIndex\" FROM \"Heads\" WHERE \"StorageIndex\" IS NOT NULL "
+				"UNION "
+				"SELECT \"StorageIndex\" FROM \"Missing\" WHERE \"StorageIndex\" IS NOT NULL "
+				"UNION "
+				"SELECT \"Storage\".\"Parent\" FROM \"Storage\" "
+					"JOIN \"Reachable\" ON \"Storage\".\"StorageIndex\" = \"Reachable\".\"StorageIndex\" "
+					"WHERE \"Storage\".\"Parent\" IS NOT NULL"
+			") "
+			"SELECT \"StorageIndex\" FROM \"Storage\" "
+				"WHERE \"StorageIndex\" NOT IN (SELECT \"StorageIndex\" FROM \"Reachable\") "
+				"ORDER BY \"StorageIndex\" DESC"),
+		// Counts are grouped once per table rather than counted per storage row
+		ListMiscountedStorage(Base,
+			"SELECT \"Storage\".\"StorageIndex\", "
+				"coalesce(\"HeadCounts\".\"Count\", 0) + "
+				"coalesce(\"MissingCounts\".\"Count\", 0) + "
+				"coalesce(\"ChildCounts\".\"Count\", 0) AS \"Expected\" "
+			"FROM \"Storage\" "
+			"LEFT JOIN "
+			"("
+				"SELECT \"StorageIndex\", count(1) AS \"Count\" FROM \"Heads\" "
+					"WHERE \"StorageIndex\" IS NOT NULL GROUP BY \"StorageIndex\""
+			") AS \"HeadCounts\" ON \"HeadCounts\".\"StorageIndex\" = \"Storage\".\"StorageIndex\" "
+			"LEFT JOIN "
+			"("
+				"SELECT \"StorageIndex\", count(1) AS \"Count\" FROM \"Missing\" "
+					"WHERE \"StorageIndex\" IS NOT NULL GROUP BY \"StorageIndex\""
+			") AS \"MissingCounts\" ON \"MissingCounts\".\"StorageIndex\" = \"Storage\".\"StorageIndex\" "
+			"LEFT JOIN "
+			"("
+				"SELECT \"Parent\", count(1) AS \"Count\" FROM \"Storage\" "
+					"WHERE \"Parent\" IS NOT NULL GROUP BY \"Parent\""
+			") AS \"ChildCounts\" ON \"ChildCounts\".\"Parent\" = \"Storage\".\"StorageIndex\" "
+			"WHERE \"Storage\".\"ReferenceCount\" != \"Expected\""),
+		HasStorage(Base,
+			"SELECT count(1) FROM \"Storage\" WHERE \"StorageIndex\" = ?"),
+		HasChunk(Base,
+			"SELECT count(1) FROM \"Chunks\" WHERE \"Hash\" = ?"),
+		HasSegment(Base,
+			"SELECT count(1) FROM \"PackSegments\" WHERE \"Segment\" = ?")
+	{
+	}
+};
+
+struct CoreDatabaseT : CoreDatabaseBaseT, CoreQueriesT
 {
 	template <typename SignatureT> using StatementT = typename SQLDatabaseT::StatementT<SignatureT>;
 
 	StatementT<NodeIndexT (void)> GetNodeCounter;
-	StatementT<void (void)> IncrementNodeCounter;
+	StatementT<void (uint64_t Count)> AdvanceNodeCounter;
 	StatementT<ChangeIndexT (void)> GetChangeCounter;
-	StatementT<void (void)> IncrementChangeCounter;
+	StatementT<void (uint64_t Count)> AdvanceChangeCounter;
 	StatementT<StorageIndexT (void)> GetStorageCounter;
-	StatementT<void (void)> IncrementStorageCounter;
+	StatementT<void (uint64_t Count)> AdvanceStorageCounter;
+	StatementT<unsigned int (void)> GetStorageLayout;
+	StatementT<void (unsigned int Layout)> SetStorageLayout;
+	StatementT<SegmentIndexT (void)> GetSegmentCounter;
+	StatementT<void (void)> IncrementSegmentCounter;
 		
 	StatementT<std::string (void)> GetEnvHash;
 	StatementT<void (std::string EnvHash, InstanceIndexT InstanceIndex)> SetPrimaryInstance;
@@ -123,41 +347,91 @@ struct CoreDatabaseT : CoreDatabaseBaseT
 	StatementT<void (std::string Name, InstanceUniqueT Unique)> InsertInstance;
 	StatementT<InstanceIndexT (void)> GetLastInstance;
 
-	StatementT<ChangeT (size_t Start, size_t Count)> ListChanges;
 	StatementT<ChangeT (GlobalChangeIDT const &ID)> GetChange;
 	StatementT<void (ChangeT const &Change)> InsertChange;
 
-	StatementT<MissingT (size_t Start, size_t Count)> ListMissing;
 	StatementT<MissingT (GlobalChangeIDT const &ID)> GetMissing;
 	StatementT<void (MissingT const &Missing)> InsertMissing;
 	StatementT<void (GlobalChangeIDT const &ID)> DeleteMissing;
 
-	StatementT<HeadT (size_t Start, size_t Count)> ListHeads;
-	StatementT<HeadT (OptionalT<NodeIDT> const &Dir, size_t Start, size_t Count)> ListDirHeads;
-	StatementT<HeadT (GlobalChangeIDT const &ID)> GetHead;
 	StatementT<void (HeadT const &Head)> InsertHead;
 	StatementT<void (GlobalChangeIDT const &ID)> DeleteHead;
 
-	StatementT<StorageT (size_t Start, size_t Count)> ListStorage;
 	StatementT<StorageT (StorageIndexT const &ID)> GetStorage;
-	StatementT<void (StorageIDT const &StorageID)> InsertStorage;
+	StatementT<void (StorageIDT const &StorageID, unsigned int Class)> InsertStorage;
 	StatementT<void (StorageIndexT const &ID)> DeleteStorage;
 	StatementT<void (StorageIndexT const &ID, StorageReferenceCountT RefCount)> SetStorageRefCount;
+	StatementT<unsigned int (StorageIndexT const &ID)> GetStorageClass;
+	StatementT<void (StorageIndexT const &ID, unsigned int Class)> SetStorageClass;
+	StatementT<StorageIndexT (StorageIndexT const &ID)> GetStorageParent;
+	StatementT<uint64_t (StorageIndexT const &ID)> GetStorageDepth;
+	StatementT<void (StorageIndexT const &ID, StorageIndexT const &Parent, uint64_t Depth)> SetStorageParent;
+	StatementT<void (StorageIndexT const &ID)> ClearStorageParent;
+	StatementT<void (StorageIndexT const &ID, uint64_t Amount)> ReduceDescendantDepth;
+	StatementT<StorageIndexT (unsigned int Class, uint64_t Depth, size_t Count)> ListDeepStorage;
+	StatementT<uint64_t (StorageIndexT const &ID)> CountStorageReferences;
 
-	inline CoreDatabaseT(Filesystem::PathT const &DatabasePath) : 
-		CoreDatabaseBaseT(DatabasePath),
+	StatementT<OverlayExtentT (StorageIndexT const &ID)> ListOverlayExtents;
+	StatementT<OverlayExtentT (StorageIndexT const &ID, uint64_t Start, uint64_t End)> ListOverlappingExtents;
+	StatementT<OverlayExtentT (StorageIndexT const &ID, uint64_t Start)> GetOverlayExtentBefore;
+	StatementT<void (StorageIndexT const &ID, OverlayExtentT const &Extent)> InsertOverlayExtent;
+	StatementT<void (StorageIndexT const &ID, uint64_t Offset)> DeleteOverlayExtent;
+	StatementT<void (StorageIndexT const &ID)> DeleteOverlayExtents;
+
+	StatementT<std::vector<uint8_t> (StorageIndexT const &ID)> GetStorageData;
+	StatementT<void (StorageIndexT const &ID, std::vector<uint8_t> const &Data)> SetStorageData;
+	StatementT<void (StorageIndexT const &ID)> ClearStorageData;
+
+	StatementT<PackLocationT (StorageIndexT const &ID)> GetStorageLocation;
+	StatementT<void (StorageIndexT const &ID, PackLocationT const &Location)> SetStorageLocation;
+	StatementT<void (StorageIndexT const &ID)> ClearStorageLocation;
+	StatementT<StorageIndexT (SegmentIndexT const &Segment)> ListSegmentStorage;
+	StatementT<PackSegmentT (SegmentIndexT const &Segment)> GetSegment;
+	StatementT<PackSegmentT (void)> GetLastSegment;
+	StatementT<void (SegmentIndexT const &Segment)> InsertSegment;
+	StatementT<void (SegmentIndexT const &Segment, int64_t SizeDelta, int64_t LiveDelta)> AdjustSegment;
+	StatementT<void (SegmentIndexT const &Segment)> DeleteSegment;
+	StatementT<SegmentIndexT (unsigned int MinLivePercent, size_t Count)> ListSparseSegments;
+	StatementT<void (void)> RecountSegments;
+	StatementT<uint64_t (void)> CountMiscountedSegments;
+
+	StatementT<uint64_t (std::string const &Hash)> GetChunkRefCount;
+	StatementT<void (std::string const &Hash, uint64_t Size)> InsertChunk;
+	StatementT<void (std::string const &Hash, int64_t Delta)> AdjustChunkRefCount;
+	StatementT<void (std::string const &Hash)> DeleteChunk;
+	StatementT<StorageChunkT (StorageIndexT const &ID)> ListStorageChunks;
+	StatementT<void (StorageIndexT const &ID, StorageChunkT const &Chunk)> InsertStorageChunk;
+	StatementT<void (StorageIndexT const &ID, uint64_t Start, uint64_t End)> DeleteStorageChunks;
+	StatementT<uint64_t (void)> CountBadChunkRefCounts;
+	StatementT<uint64_t (unsigned int OverlayClass)> CountOrphanOverlays;
+
+	StatementT<void (std::vector<uint8_t> const &Message)> InsertIntent;
+	StatementT<std::vector<uint8_t> (void)> ListIntents;
+	StatementT<void (void)> DeleteIntents;
+
+	inline CoreDatabaseT(Filesystem::PathT const &DatabasePath, SQLSettingsT const &Settings = {}) : 
+		CoreDatabaseBaseT(DatabasePath, Settings),
+		CoreQueriesT(this),
 		GetNodeCounter(this, 
 			"SELECT \"NodeCounter\" FROM \"Stats\" LIMIT 1"),
-		IncrementNodeCounter(this, 
-			"UPDATE \"Stats\" SET \"NodeCounter\" = \"NodeCounter\" + 1"),
+		AdvanceNodeCounter(this, 
+			"UPDATE \"Stats\" SET \"NodeCounter\" = \"NodeCounter\" + ?"),
 		GetChangeCounter(this, 
 			"SELECT \"ChangeCounter\" FROM \"Stats\" LIMIT 1"),
-		IncrementChangeCounter(this, 
-			"UPDATE \"Stats\" SET \"ChangeCounter\" = \"ChangeCounter\" + 1"),
+		AdvanceChangeCounter(this, 
+			"UPDATE \"Stats\" SET \"ChangeCounter\" = \"ChangeCounter\" + ?"),
 		GetStorageCounter(this, 
 			"SELECT \"StorageCounter\" FROM \"Stats\" LIMIT 1"),
-		IncrementStorageCounter(this, 
-			"UPDATE \"Stats\" SET \"StorageCounter\" = \"StorageCounter\" + 1"),
+		AdvanceStorageCounter(this, 
+			"UPDATE \"Stats\" SET \"StorageCounter\" = \"StorageCounter\" + ?"),
+		GetStorageLayout(this, 
+			"SELECT \"StorageLayout\" FROM \"Stats\" LIMIT 1"),
+		SetStorageLayout(this, 
+			"UPDATE \"Stats\" SET \"StorageLayout\" = ?"),
+		GetSegmentCounter(this, 
+			"SELECT \"SegmentCounter\" FROM \"Stats\" LIMIT 1"),
+		IncrementSegmentCounter(this, 
+			"UPDATE \"Stats\" SET \"SegmentCounter\" = \"SegmentCounter\" + 1"),
 
 		GetEnvHash(this,
 			"SELECT \"InstanceEnvHash\" FROM \"Stats\" LIMIT 1"),
@@ -173,15 +447,11 @@ struct CoreDatabaseT : CoreDatabaseBaseT
 		GetLastInstance(this,
 			"SELECT \"Instance\" FROM \"Instances\" ORDER BY \"Instance\" DESC LIMIT 1"),
 
-		ListChanges(this,
-			"SELECT * FROM \"Changes\" LIMIT ?,?"),
 		GetChange(this,
 			"SELECT * FROM \"Changes\" WHERE \"NodeInstance\" = ? AND \"NodeIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ? LIMIT 1"),
 		InsertChange(this,
 			"INSERT INTO \"Changes\" VALUES (?, ?, ?, ?, ?, ?)"),
 
-		ListMissing(this,
-			"SELECT * FROM \"Missing\" LIMIT ?,?"),
 		GetMissing(this,
 			"SELECT * FROM \"Missing\" WHERE \"NodeInstance\" = ? AND \"NodeIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ? LIMIT 1"),
 		InsertMissing(this,
@@ -189,27 +459,143 @@ struct CoreDatabaseT : CoreDatabaseBaseT
 		DeleteMissing(this,
 			"DELETE FROM \"Missing\" WHERE \"NodeInstance\" = ? AND \"NodeIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ?"),
 
-		ListHeads(this,
-			"SELECT * FROM \"Heads\" LIMIT ?,?"),
-		ListDirHeads(this,
-			"SELECT * FROM \"Heads\" WHERE \"DirInstance\" IS ? AND \"DirIndex\" IS ? LIMIT ?,?"),
-		GetHead(this,
-			"SELECT * FROM \"Heads\" WHERE \"NodeInstance\" = ? AND \"NodeIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ? LIMIT 1"),
 		InsertHead(this,
 			"INSERT OR IGNORE INTO \"Heads\" VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"),
 		DeleteHead(this,
 			"DELETE FROM \"Heads\" WHERE \"NodeInstance\" = ? AND \"NodeIndex\" = ? AND \"ChangeInstance\" = ? AND \"ChangeIndex\" = ?"),
 
-		ListStorage(this,
-			"SELECT * FROM \"Storage\" LIMIT ?,?"),
 		GetStorage(this,
-			"SELECT * FROM \"Storage\" WHERE \"StorageIndex\" = ? LIMIT 1"),
+			"SELECT \"StorageIndex\", \"ReferenceCount\" FROM \"Storage\" WHERE \"StorageIndex\" = ? LIMIT 1"),
 		InsertStorage(this,
-			"INSERT INTO \"Storage\" (\"StorageIndex\", \"ReferenceCount\") VALUES (?, 1)"),
+			"INSERT INTO \"Storage\" (\"StorageIndex\", \"ReferenceCount\", \"Class\") VALUES (?, 1, ?)"),
 		DeleteStorage(this,
 			"DELETE FROM \"Storage\" WHERE \"StorageIndex\" = ?"),
 		SetStorageRefCount(this,
-			"UPDATE \"Storage\" SET \"ReferenceCount\" = ?2 WHERE \"StorageIndex\" = ?1")
+			"UPDATE \"Storage\" SET \"ReferenceCount\" = ?2 WHERE \"StorageIndex\" = ?1"),
+		GetStorageClass(this,
+			"SELECT \"Class\" FROM \"Storage\" WHERE \"StorageIndex\" = ? LIMIT 1"),
+		SetStorageClass(this,
+			"UPDATE \"Storage\" SET \"Class\" = ?2 WHERE \"StorageIndex\" = ?1"),
+		GetStorageParent(this,
+			"SELECT \"Parent\" FROM \"Storage\" WHERE \"StorageIndex\" = ? AND \"Parent\" IS NOT NULL LIMIT 1"),
+		GetStorageDepth(this,
+			"SELECT \"Depth\" FROM \"Storage\" WHERE \"StorageIndex\" = ? LIMIT 1"),
+		SetStorageParent(this,
+			"UPDATE \"Storage\" SET \"Parent\" = ?2, \"Depth\" = ?3 WHERE \"StorageIndex\" = ?1"),
+		ClearStorageParent(this,
+			"UPDATE \"Storage\" SET \"Parent\" = NULL, \"Depth\" = 0 WHERE \"StorageIndex\" = ?"),
+		ReduceDescendantDepth(this,
+			"WITH RECURSIVE \"Descendants\" (\"StorageIndex\") AS "
+			"("
+				"SELECT \"StorageIndex\" FROM \"Storage\" WHERE \"Parent\" = ?1 "
+				"UNION ALL "
+				"SELECT \"Storage\".\"StorageIndex\" FROM \"Storage\" "
+					"JOIN \"Descendants\" ON \"Storage\".\"Parent\" = \"Descendants\".\"StorageIndex\""
+			") "
+			"UPDATE \"Storage\" SET \"Depth\" = \"Depth\" - ?2 "
+				"WHERE \"StorageIndex\" IN (SELECT \"StorageIndex\" FROM \"Descendants\")"),
+		ListDeepStorage(this,
+			"SELECT \"StorageIndex\" FROM \"Storage\" WHERE \"Class\" = ? AND \"Depth\" > ? ORDER BY \"Depth\" LIMIT ?"),
+		CountStorageReferences(this,
+			"SELECT "
+				"(SELECT count(1) FROM \"Heads\" WHERE \"StorageIndex\" = ?1) + "
+				"(SELECT count(1) FROM \"Missing\" WHERE \"StorageIndex\" = ?1) + "
+				"(SELECT count(1) FROM \"Storage\" WHERE \"Parent\" = ?1)"),
+
+		ListOverlayExtents(this,
+			"SELECT \"Offset\", \"Length\", \"DataOffset\" FROM \"OverlayExtents\" WHERE \"StorageIndex\" = ? ORDER BY \"Offset\""),
+		ListOverlappingExtents(this,
+			"SELECT \"Offset\", \"Length\", \"DataOffset\" FROM \"OverlayExtents\" "
+				"WHERE \"StorageIndex\" = ?1 AND \"Offset\" < ?3 AND \"Offset\" + \"Length\" > ?2 ORDER BY \"Offset\""),
+		GetOverlayExtentBefore(this,
+			"SELECT \"Offset\", \"Length\", \"DataOffset\" FROM \"OverlayExtents\" "
+				"WHERE \"StorageIndex\" = ? AND \"Offset\" < ? ORDER BY \"Offset\" DESC LIMIT 1"),
+		InsertOverlayExtent(this,
+			"INSERT INTO \"OverlayExtents\" (\"StorageIndex\", \"Offset\", \"Length\", \"DataOffset\") VALUES (?, ?, ?, ?)"),
+		DeleteOverlayExtent(this,
+			"DELETE FROM \"OverlayExtents\" WHERE \"StorageIndex\" = ? AND \"Offset\" = ?"),
+		DeleteOverlayExtents(this,
+			"DELETE FROM \"OverlayExtents\" WHERE \"StorageIndex\" = ?"),
+
+		GetStorageData(this,
+			"SELECT \"Data\" FROM \"Storage\" WHERE \"StorageIndex\" = ? AND \"Data\" IS NOT NULL LIMIT 1"),
+		SetStorageData(this,
+			"UPDATE \"Storage\" SET \"Data\" = ?2 WHERE \"StorageIndex\" = ?1"),
+		ClearStorageData(this,
+			"UPDATE \"Storage\" SET \"Data\" = NULL WHERE \"StorageIndex\" = ?"),
+
+		GetStorageLocation(this,
+			"SELECT \"Segment\", \"SegmentOffset\", \"Length\" FROM \"Storage\" "
+				"WHERE \"StorageIndex\" = ? AND \"Segment\" IS NOT NULL LIMIT 1"),
+		SetStorageLocation(this,
+			"UPDATE \"Storage\" SET \"Segment\" = ?2, \"SegmentOffset\" = ?3, \"Length\" = ?4 WHERE \"StorageIndex\" = ?1"),
+		ClearStorageLocation(this,
+			"UPDATE \"Storage\" SET \"Segment\" = NULL, \"SegmentOffset\" = NULL, \"Length\" = NULL WHERE \"StorageIndex\" = ?"),
+		ListSegmentStorage(this,
+			"SELECT \"StorageIndex\" FROM \"Storage\" WHERE \"Segment\" = ?"),
+		GetSegment(this,
+			"SELECT \"Segment\", \"Size\", \"LiveBytes\" FROM \"PackSegments\" WHERE \"Segment\" = ? LIMIT 1"),
+		GetLastSegment(this,
+			"SELECT \"Segment\", \"Size\", \"LiveBytes\" FROM \"PackSegments\" ORDER BY \"Segment\" DESC LIMIT 1"),
+		InsertSegment(this,
+			"INSERT INTO \"PackSegments\" (\"Segment\", \"Size\", \"LiveBytes\") VALUES (?, 0, 0)"),
+		AdjustSegment(this,
+			"UPDATE \"PackSegments\" SET \"Size\" = \"Size\" + ?2, \"LiveBytes\" = \"LiveBytes\" + ?3 WHERE \"Segment\" = ?1"),
+		DeleteSegment(this,
+			"DELETE FROM \"PackSegments\" WHERE \"Segment\" = ?"),
+		ListSparseSegments(this,
+			"SELECT \"Segment\" FROM \"PackSegments\" "
+				"WHERE \"Segment\" < (SELECT max(\"Segment\") FROM \"PackSegments\") AND \"LiveBytes\" * 100 < \"Size\" * ? "
+				"ORDER BY CAST(\"LiveBytes\" AS REAL) / \"Size\" LIMIT ?"),
+		RecountSegments(this,
+			"UPDATE \"PackSegments\" SET \"LiveBytes\" = "
+				"(SELECT coalesce(sum(\"Length\"), 0) FROM \"Storage\" WHERE \"Storage\".\"Segment\" = \"PackSegments\".\"Segment\")"),
+		CountMiscountedSegments(this,
+			"SELECT count(1) FROM \"PackSegments\" WHERE \"LiveBytes\" != "
+				"(SELECT coalesce(sum(\"Length\"), 0) FROM \"Storage\" WHERE \"Storage\".\"Segment\" = \"PackSegments\".\"Segment\")"),
+
+		GetChunkRefCount(this,
+			"SELECT \"ReferenceCount\" FROM \"Chunks\" WHERE \"Hash\" = ? LIMIT 1"),
+		InsertChunk(this,
+			"INSERT OR IGNORE INTO \"Chunks\" (\"Hash\", \"Size\", \"ReferenceCount\") VALUES (?, ?, 0)"),
+		AdjustChunkRefCount(this,
+			"UPDATE \"Chunks\" SET \"ReferenceCount\" = \"ReferenceCount\" + ?2 WHERE \"Hash\" = ?1"),
+		DeleteChunk(this,
+			"DELETE FROM \"Chunks\" WHERE \"Hash\" = ?"),
+		ListStorageChunks(this,
+			"SELECT \"Offset\", \"Size\", \"Hash\" FROM \"StorageChunks\" WHERE \"StorageIndex\" = ? ORDER BY \"Offset\""),
+		InsertStorageChunk(this,
+			"INSERT OR REPLACE INTO \"StorageChunks\" (\"StorageIndex\", \"Offset\", \"Size\", \"Hash\") VALUES (?, ?, ?, ?)"),
+		DeleteStorageChunks(this,
+			"DELETE FROM \"StorageChunks\" WHERE \"StorageIndex\" = ? AND \"Offset\" >= ? AND \"Offset\" < ?"),
+		CountBadChunkRefCounts(this,
+			"SELECT count(1) FROM \"Chunks\" "
+				"LEFT JOIN "
+				"("
+					"SELECT \"Hash\", count(1) AS \"Count\" FROM \"StorageChunks\" GROUP BY \"Hash\""
+				") AS \"References\" ON \"References\".\"Hash\" = \"Chunks\".\"Hash\" "
+				"WHERE \"Chunks\".\"ReferenceCount\" != coalesce(\"References\".\"Count\", 0)"),
+		CountOrphanOverlays(this,
+			"SELECT count(1) FROM \"Storage\" WHERE \"Class\" = ? AND "
+				"(\"Parent\" IS NULL OR \"Parent\" NOT IN (SELECT \"StorageIndex\" FROM \"Storage\"))"),
+
+		InsertIntent(this,
+			"INSERT INTO \"Intents\" (\"Message\") VALUES (?)"),
+		ListIntents(this,
+			"SELECT \"Message\" FROM \"Intents\" ORDER BY \"Intent\""),
+		DeleteIntents(this,
+			"DELETE FROM \"Intents\"")
+	{
+	}
+};
+
+// A read-only connection for the reader pool; with write ahead logging each read sees the last committed state
+// without blocking or being blocked by the writer
+struct CoreReaderDatabaseT : SQLDatabaseT, CoreQueriesT
+{
+	inline CoreReaderDatabaseT(Filesystem::PathT const &DatabasePath, SQLSettingsT const &Settings) : 
+		SQLDatabaseT(DatabasePath, Settings),
+		CoreQueriesT(this)
 	{
 	}
 };
@@ -7,15 +7,42 @@
 DefineProtocol(CoreTransactorProtocol)
 DefineProtocolVersion(CoreTransactorVersion1, CoreTransactorProtocol)
 
+// Version 1 add and update messages are only read, from transactions left by older builds
 DefineProtocolMessage(CTV1AddChange, CoreTransactorVersion1,
 	void(
 		ChangeT Change,
 		OptionalT<ChangeIDT> HeadID,
 		OptionalT<StorageIDT> StorageID,
-		OptionalT<StorageReferenceCountT> StorageRefCount,
+		OptionalT<StorageReferenceCountV1T> StorageRefCount,
 		bool DeleteMissing))
 
 DefineProtocolMessage(CTV1UpdateDeleteHead, CoreTransactorVersion1,
+	void(
+		OptionalT<StorageIDT> StorageID,
+		OptionalT<StorageReferenceCountV1T> StorageRefCount,
+		GlobalChangeIDT ChangeID,
+		OptionalT<ChangeIDT> DeleteParent,
+		OptionalT<HeadT> NewHead,
+		StorageChangesT StorageChanges))
+
+DefineProtocolMessage(CTV1FlattenStorage, CoreTransactorVersion1,
+	void(StorageIDT StorageID))
+
+DefineProtocolMessage(CTV1CompactSegment, CoreTransactorVersion1,
+	void(SegmentIndexT Segment))
+
+DefineProtocolVersion(CoreTransactorVersion2, CoreTransactorProtocol)
+
+// Wide reference counts
+DefineProtocolMessage(CTV2AddChange, CoreTransactorVersion2,
+	void(
+		ChangeT Change,
+		OptionalT<ChangeIDT> HeadID,
+		OptionalT<StorageIDT> StorageID,
+		OptionalT<StorageReferenceCountT> StorageRefCount,
+		bool DeleteMissing))
+
+DefineProtocolMessage(CTV2UpdateDeleteHead, CoreTransactorVersion2,
 	void(
 		OptionalT<StorageIDT> StorageID,
 		OptionalT<StorageReferenceCountT> StorageRefCount,
@@ -24,5 +51,11 @@ DefineProtocolMessage(CTV1UpdateDeleteHead, CoreTransactorVersion1,
 		OptionalT<HeadT> NewHead,
 		StorageChangesT StorageChanges))
 
+inline OptionalT<StorageReferenceCountT> WidenRefCount(OptionalT<StorageReferenceCountV1T> const &Count)
+{
+	if (!Count) return {};
+	return StorageReferenceCountT(**Count);
+}
+
 #endif
 
@@ -0,0 +1,95 @@
+#ifndef dentrycache_h
+#define dentrycache_h
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "structtypes.h"
+#include "lrucache.h"
+#include "dircache.h"
+
+struct DentryKeyT
+{
+	OptionalT<NodeIDT> Dir;
+	std::string Filename;
+
+	inline bool operator ==(DentryKeyT const &Other) const
+		{ return (Dir == Other.Dir) && (Filename == Other.Filename); }
+};
+
+struct DentryKeyHashT
+{
+	inline size_t operator ()(DentryKeyT const &Key) const
+	{
+		size_t Out = DirIDHashT()(Key.Dir);
+		Out ^= std::hash<std::string>()(Key.Filename) + 0x9e3779b97f4a7c15ull + (Out << 6) + (Out >> 2);
+		return Out;
+	}
+};
+
+// The heads with each recently looked up filename in a directory, with names that aren't there cached as no heads.
+// Uses the same generation check as DirCacheT.  Thread safe.
+struct DentryCacheT
+{
+	typedef std::shared_ptr<std::vector<HeadT> const> HeadsT;
+
+	inline DentryCacheT(size_t Capacity) : Generation(0), Entries(Capacity) {}
+
+	// Returns null if Key isn't cached
+	inline HeadsT Find(DentryKeyT const &Key)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (auto Found = Entries.Find(Key)) return *Found;
+		return {};
+	}
+
+	// Read before looking up heads, and pass to Insert
+	inline uint64_t GetGeneration(void)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Generation;
+	}
+
+	// Caches Heads unless a name was invalidated since Generation was read
+	inline HeadsT Insert(DentryKeyT const &Key, uint64_t Generation, std::vector<HeadT> &&Heads)
+	{
+		HeadsT Out = std::make_shared<std::vector<HeadT> const>(std::move(Heads));
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (Generation == this->Generation) Entries.Insert(Key, HeadsT(Out));
+		return Out;
+	}
+
+	// Call after the change to Key's heads commits
+	inline void Invalidate(DentryKeyT const &Key)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		++Generation;
+		Entries.Erase(Key);
+	}
+
+	inline size_t Size(void) const
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Entries.Size();
+	}
+
+	inline uint64_t GetHits(void) const
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Entries.GetHits();
+	}
+
+	inline uint64_t GetMisses(void) const
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Entries.GetMisses();
+	}
+
+	private:
+		mutable std::mutex Mutex;
+		uint64_t Generation;
+		LRUCacheT<DentryKeyT, HeadsT, DentryKeyHashT> Entries;
+};
+
+#endif
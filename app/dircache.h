@@ -0,0 +1,163 @@
+#ifndef dircache_h
+#define dircache_h
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "structtypes.h"
+
+struct DirIDHashT
+{
+	inline size_t operator ()(OptionalT<NodeIDT> const &Dir) const
+	{
+		if (!Dir) return 0;
+		size_t Out = std::hash<InstanceIndexT>()(Dir->Instance());
+		Out ^= std::hash<IDBaseT>()(*Dir->Node()) + 0x9e3779b97f4a7c15ull + (Out << 6) + (Out >> 2);
+		return Out;
+	}
+};
+
+// Whole directory listings, in ListDirHeads order, dropped least recently used first once they take more than
+// Budget bytes.  Listings are replaced rather than changed, so a listing that's been found can be paged after it's
+// dropped.  Thread safe.
+struct DirCacheT
+{
+	typedef std::shared_ptr<std::vector<HeadT> const> ListingT;
+
+	inline DirCacheT(size_t Budget) : Budget(Budget), Bytes(0), Generation(0), Hits(0), Misses(0) {}
+
+	// Returns null if Dir isn't cached, otherwise marks it most recently used
+	inline ListingT Find(OptionalT<NodeIDT> const &Dir)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		auto Found = Index.find(Dir);
+		if (Found == Index.end())
+		{
+			++Misses;
+			return {};
+		}
+		++Hits;
+		Entries.splice(Entries.begin(), Entries, Found->second);
+		return Found->second->Listing;
+	}
+
+	// Read before loading a listing, and pass to Insert
+	inline uint64_t GetGeneration(void)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Generation;
+	}
+
+	// Caches Listing unless it's over budget or a directory was invalidated since Generation was read, in which
+	// case Listing may predate the change
+	inline ListingT Insert(OptionalT<NodeIDT> const &Dir, uint64_t Generation, std::vector<HeadT> &&Listing)
+	{
+		size_t Size = sizeof(EntryT);
+		for (auto const &Head : Listing) Size += Measure(Head);
+		ListingT Out = std::make_shared<std::vector<HeadT> const>(std::move(Listing));
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if ((Generation != this->Generation) || (Size > Budget)) return Out;
+		Erase(Dir);
+		Entries.push_front(EntryT{Dir, Out, Size});
+		Index.emplace(Dir, Entries.begin());
+		Bytes += Size;
+		while (Bytes > Budget) Erase(Entries.back().Dir);
+		return Out;
+	}
+
+	// Call after the change to Dir commits
+	inline void Invalidate(OptionalT<NodeIDT> const &Dir)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		++Generation;
+		Erase(Dir);
+	}
+
+	// Bytes a head adds to a listing, including its filename
+	inline static size_t Measure(HeadT const &Head)
+		{ return sizeof(HeadT) + Head.Meta().Filename().size(); }
+
+	// The part of Listing after After, as ListDirHeads would return it
+	inline static std::vector<HeadT> Page(ListingT const &Listing, OptionalT<DirHeadKeyT> const &After, size_t Count)
+	{
+		auto Start = Listing->begin();
+		if (After)
+		{
+			auto const Key = [](std::string const &Filename, GlobalChangeIDT const &ChangeID)
+			{
+				return std::tuple<std::string const &, InstanceIndexT, IDBaseT, InstanceIndexT, IDBaseT>(
+					Filename,
+					ChangeID.NodeID().Instance(),
+					*ChangeID.NodeID().Node(),
+					ChangeID.ChangeID().Instance(),
+					*ChangeID.ChangeID().Change());
+			};
+			Start = std::upper_bound(Listing->begin(), Listing->end(), *After,
+				[&Key](DirHeadKeyT const &After, HeadT const &Head)
+					{ return Key(After.Filename(), After.ChangeID()) < Key(Head.Meta().Filename(), Head.ChangeID()); });
+		}
+		auto const End = Start + std::min<size_t>(Count, Listing->end() - Start);
+		return std::vector<HeadT>(Start, End);
+	}
+
+	inline size_t GetBytes(void) const
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Bytes;
+	}
+
+	inline size_t GetBudget(void) const { return Budget; }
+
+	inline uint64_t GetHits(void) const
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Hits;
+	}
+
+	inline uint64_t GetMisses(void) const
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return Misses;
+	}
+
+	// Fraction of finds that hit, 0 before the first
+	inline double GetHitRate(void) const
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (Hits + Misses == 0) return 0;
+		return (double)Hits / (Hits + Misses);
+	}
+
+	private:
+		struct EntryT
+		{
+			OptionalT<NodeIDT> Dir;
+			ListingT Listing;
+			size_t Bytes;
+		};
+
+		inline void Erase(OptionalT<NodeIDT> const &Dir)
+		{
+			auto Found = Index.find(Dir);
+			if (Found == Index.end()) return;
+			Bytes -= Found->second->Bytes;
+			Entries.erase(Found->second);
+			Index.erase(Found);
+		}
+
+		size_t const Budget;
+		mutable std::mutex Mutex;
+		size_t Bytes;
+		uint64_t Generation;
+		uint64_t Hits;
+		uint64_t Misses;
+		std::list<EntryT> Entries;
+		std::unordered_map<OptionalT<NodeIDT>, std::list<EntryT>::iterator, DirIDHashT> Index;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef filedescriptor_h
+#define filedescriptor_h
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#if __linux__
+#include <linux/falloc.h>
+#endif
+
+#include "../ren-cxx-basics/error.h"
+#include "../ren-cxx-filesystem/path.h"
+
+// Owning raw descriptor, for storage operations that FileT doesn't expose (ioctls, positioned io, etc)
+struct FileDescriptorT
+{
+	inline FileDescriptorT(void) : Descriptor(-1) {}
+
+	inline FileDescriptorT(std::string const &Path, int Flags, mode_t Mode = 0666) :
+		Descriptor(open(Path.c_str(), Flags | O_CLOEXEC, Mode)),
+		Path(Path)
+	{
+		if (Descriptor < 0)
+			throw SYSTEM_ERROR << "Could not open " << Path << ": " << strerror(errno);
+	}
+
+	inline FileDescriptorT(Filesystem::PathT const &Path, int Flags, mode_t Mode = 0666) :
+		FileDescriptorT(Path.Render(), Flags, Mode)
+		{}
+
+	inline FileDescriptorT(FileDescriptorT &&Other) : Descriptor(Other.Descriptor), Path(std::move(Other.Path))
+		{ Other.Descriptor = -1; }
+
+	inline FileDescriptorT &operator =(FileDescriptorT &&Other)
+	{
+		Close();
+		Descriptor = Other.Descriptor;
+		Path = std::move(Other.Path);
+		Other.Descriptor = -1;
+		return *this;
+	}
+
+	FileDescriptorT(FileDescriptorT const &) = delete;
+	FileDescriptorT &operator =(FileDescriptorT const &) = delete;
+
+	inline ~FileDescriptorT(void) { Close(); }
+
+	inline void Close(void)
+	{
+		if (Descriptor < 0) return;
+		close(Descriptor);
+		Descriptor = -1;
+	}
+
+	inline explicit operator bool(void) const { return Descriptor >= 0; }
+	inline int operator *(void) const { return Descriptor; }
+	inline std::string const &GetPath(void) const { return Path; }
+
+	// Reads until Length bytes or the end of the file; returns the number of bytes read
+	inline size_t Read(uint64_t Offset, uint8_t *Out, size_t Length) const
+	{
+		size_t Total = 0;
+		while (Total < Length)
+		{
+			auto const Got = pread(Descriptor, Out + Total, Length - Total, Offset + Total);
+			if (Got < 0)
+			{
+				if (errno == EINTR) continue;
+				throw SYSTEM_ERROR << "Error reading " << Path << ": " << strerror(errno);
+			}
+			if (Got == 0) break;
+			Total += Got;
+		}
+		return Total;
+	}
+
+	inline void Write(uint64_t Offset, uint8_t const *Data, size_t Length) const
+	{
+		size_t Total = 0;
+		while (Total < Length)
+		{
+			auto const Wrote = pwrite(Descriptor, Data + Total, Length - Total, Offset + Total);
+			if (Wrote < 0)
+			{
+				if (errno == EINTR) continue;
+				throw SYSTEM_ERROR << "Error writing " << Path << ": " << strerror(errno);
+			}
+			Total += Wrote;
+		}
+	}
+
+	// Writes all of Vectors starting at Offset; Vectors is modified to track partial writes
+	inline void Write(uint64_t Offset, iovec *Vectors, int Count) const
+	{
+		while (Count > 0)
+		{
+			auto Wrote = pwritev(Descriptor, Vectors, Count, Offset);
+			if (Wrote < 0)
+			{
+				if (errno == EINTR) continue;
+				throw SYSTEM_ERROR << "Error writing " << Path << ": " << strerror(errno);
+			}
+			Offset += Wrote;
+			while ((Count > 0) && (static_cast<size_t>(Wrote) >= Vectors->iov_len))
+			{
+				Wrote -= Vectors->iov_len;
+				++Vectors;
+				--Count;
+			}
+			if (Count > 0)
+			{
+				Vectors->iov_base = static_cast<uint8_t *>(Vectors->iov_base) + Wrote;
+				Vectors->iov_len -= Wrote;
+			}
+		}
+	}
+
+	// Makes written data durable before anything that refers to it is
+	inline void Sync(void) const
+	{
+		while (fdatasync(Descriptor) != 0)
+		{
+			if (errno == EINTR) continue;
+			throw SYSTEM_ERROR << "Error syncing " << Path << ": " << strerror(errno);
+		}
+	}
+
+	inline uint64_t Size(void) const
+	{
+		struct stat Stat;
+		if (fstat(Descriptor, &Stat) != 0)
+			throw SYSTEM_ERROR << "Could not stat " << Path << ": " << strerror(errno);
+		return Stat.st_size;
+	}
+
+	// Truncates or zero extends; extension leaves a hole on filesystems that support them
+	inline void Resize(uint64_t Length) const
+	{
+		while (ftruncate(Descriptor, Length) != 0)
+		{
+			if (errno == EINTR) continue;
+			throw SYSTEM_ERROR << "Error resizing " << Path << " to " << Length << ": " << strerror(errno);
+		}
+	}
+
+	// Zeroes the range without changing the size, deallocating it where the filesystem allows
+	inline void PunchHole(uint64_t Offset, uint64_t Length) const
+	{
+		auto const End = std::min(Offset + Length, Size());
+		if (Offset >= End) return;
+#if __linux__
+		while (true)
+		{
+			if (fallocate(Descriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, Offset, End - Offset) == 0)
+				return;
+			if (errno == EINTR) continue;
+			if ((errno == EOPNOTSUPP) || (errno == ENOSYS)) break;
+			throw SYSTEM_ERROR << "Error punching hole in " << Path << ": " << strerror(errno);
+		}
+#endif
+		std::vector<uint8_t> const Zeros(std::min<uint64_t>(End - Offset, 1024 * 1024), 0);
+		for (auto Position = Offset; Position < End; Position += Zeros.size())
+			Write(Position, Zeros.data(), static_cast<size_t>(std::min<uint64_t>(Zeros.size(), End - Position)));
+	}
+
+	private:
+		int Descriptor;
+		std::string Path;
+};
+
+#endif
+
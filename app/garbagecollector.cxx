@@ -0,0 +1,232 @@
+#include "garbagecollector.h"
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+
+GarbageCollectorT::GarbageCollectorT(GarbageSettingsT const &Settings) :
+	Log("garbage"),
+	UnlinkInterval(Settings.UnlinksPerSecond ? 
+		std::chrono::microseconds(1000000 / Settings.UnlinksPerSecond) : 
+		std::chrono::microseconds(0)),
+	Stop(false),
+	Active(0),
+	NextUnlink(std::chrono::steady_clock::now()),
+	UnlinkCount(0)
+{
+	AssertGT(Settings.Threads, 0u);
+	for (size_t Index = 0; Index < Settings.Threads; ++Index)
+		Threads.emplace_back([this](void) { Work(); });
+}
+
+GarbageCollectorT::~GarbageCollectorT(void)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Stop = true;
+		if (!Tasks.empty())
+			LOG(Log, Debug, StringT() << "Leaving " << Tasks.size() << " garbage tasks for the next sweep");
+	}
+	Signal.notify_all();
+	for (auto &Thread : Threads) Thread.join();
+}
+
+void GarbageCollectorT::Discard(Filesystem::PathT const &Path)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Kept.erase(Path.Render());
+		if (!Holds.empty())
+		{
+			Held.push_back(Path);
+			return;
+		}
+		Tasks.push_back(TaskT{Path, nullptr, nullptr});
+	}
+	Signal.notify_one();
+}
+
+void GarbageCollectorT::Keep(Filesystem::PathT const &Path)
+{
+	auto Rendered = Path.Render();
+	std::unique_lock<std::mutex> Lock(Mutex);
+	for (size_t Index = Held.size(); Index-- > 0;)
+	{
+		if (Held[Index].Render() != Rendered) continue;
+		Held.erase(Held.begin() + Index);
+		// Holds made after the kept discard start one earlier now
+		for (auto &Start : Holds) if (Start > Index) --Start;
+	}
+	if (Tasks.empty() && !Active) return;
+	Kept.insert(Rendered);
+	Idle.wait(Lock, [&](void) { return Unlinking.count(Rendered) == 0; });
+}
+
+void GarbageCollectorT::Sweep(Filesystem::PathT const &Directory, FilterT &&Filter)
+{
+	LOG(Log, Debug, StringT() << "Sweeping " << Directory.Render());
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Tasks.push_back(TaskT{Directory, std::make_shared<FilterT>(std::move(Filter)), nullptr});
+	}
+	Signal.notify_one();
+}
+
+void GarbageCollectorT::Run(Filesystem::PathT const &Directory, function<void(void)> &&Task)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Tasks.push_back(TaskT{Directory, nullptr, std::make_shared<function<void(void)>>(std::move(Task))});
+	}
+	Signal.notify_one();
+}
+
+void GarbageCollectorT::Wait(void)
+{
+	std::unique_lock<std::mutex> Lock(Mutex);
+	Idle.wait(Lock, [this](void) { return Tasks.empty() && !Active; });
+}
+
+void GarbageCollectorT::Hold(void)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	Holds.push_back(Held.size());
+}
+
+void GarbageCollectorT::Release(void)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		AssertGT(Holds.size(), 0u);
+		Holds.pop_back();
+		if (!Holds.empty()) return;
+		for (auto &Path : Held) Tasks.push_back(TaskT{std::move(Path), nullptr, nullptr});
+		Held.clear();
+	}
+	Signal.notify_all();
+}
+
+void GarbageCollectorT::Drop(void)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	AssertGT(Holds.size(), 0u);
+	auto const Start = Holds.back();
+	Holds.pop_back();
+	if (Start == Held.size()) return;
+	LOG(Log, Debug, StringT() << "Dropping " << (Held.size() - Start) << " held discards");
+	Held.resize(Start);
+}
+
+uint64_t GarbageCollectorT::GetUnlinkCount(void)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return UnlinkCount;
+}
+
+void GarbageCollectorT::Work(void)
+{
+	while (true)
+	{
+		std::unique_ptr<TaskT> Task;
+		{
+			std::unique_lock<std::mutex> Lock(Mutex);
+			Signal.wait(Lock, [this](void) { return Stop || !Tasks.empty(); });
+			if (Stop) return;
+			Task = std::make_unique<TaskT>(std::move(Tasks.front()));
+			Tasks.pop_front();
+			++Active;
+		}
+		try
+		{
+			if (Task->Run) (*Task->Run)();
+			else if (Task->Filter) List(*Task);
+			else Unlink(Task->Path.Render());
+		}
+		catch (SystemErrorT const &Error)
+		{
+			LOG(Log, Warning, StringT() << "Error collecting " << Task->Path.Render() << ": " << Error);
+		}
+		catch (std::exception const &Error)
+		{
+			LOG(Log, Warning, StringT() << "Error collecting " << Task->Path.Render() << ": " << Error.what());
+		}
+		catch (...)
+		{
+			// Anything escaping would take the process down with the worker
+			LOG(Log, Warning, StringT() << "Unknown error collecting " << Task->Path.Render());
+		}
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			--Active;
+			if (Tasks.empty() && !Active) Kept.clear();
+		}
+		Idle.notify_all();
+	}
+}
+
+void GarbageCollectorT::List(TaskT const &Task)
+{
+	std::vector<std::string> Garbage;
+	size_t Directories = 0;
+	Task.Path.List([&](Filesystem::PathT &&Path, bool IsFile, bool IsDir)
+	{
+		if (IsDir)
+		{
+			// Subdirectories are swept by whichever worker is free
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Tasks.push_back(TaskT{std::move(Path), Task.Filter, nullptr});
+			++Directories;
+			return true;
+		}
+		auto Rendered = Path.Render();
+		if (IsFile && (*Task.Filter)(Rendered.substr(Rendered.rfind('/') + 1))) 
+			Garbage.push_back(std::move(Rendered));
+		return true;
+	});
+	if (Directories) Signal.notify_all();
+	for (auto const &Path : Garbage) 
+	{
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			if (Stop) return;
+		}
+		Unlink(Path);
+	}
+}
+
+void GarbageCollectorT::Unlink(std::string const &Path)
+{
+	std::chrono::microseconds Delay(0);
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (Kept.count(Path)) return;
+		Unlinking.insert(Path);
+		auto const Now = std::chrono::steady_clock::now();
+		if (NextUnlink > Now) Delay = std::chrono::duration_cast<std::chrono::microseconds>(NextUnlink - Now);
+		else NextUnlink = Now;
+		NextUnlink += UnlinkInterval;
+	}
+	if (Delay.count()) std::this_thread::sleep_for(Delay);
+	{
+		// Checked again, since the path may have been kept while waiting
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (Kept.count(Path))
+		{
+			Unlinking.erase(Unlinking.find(Path));
+			Idle.notify_all();
+			return;
+		}
+	}
+	bool const Unlinked = unlink(Path.c_str()) == 0;
+	if (!Unlinked && (errno != ENOENT)) 
+		LOG(Log, Warning, StringT() << "Could not unlink " << Path << ": " << strerror(errno));
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (Unlinked) ++UnlinkCount;
+		Unlinking.erase(Unlinking.find(Path));
+	}
+	Idle.notify_all();
+	if (Unlinked) LOG(Log, Spam, StringT() << "Unlinked " << Path);
+}
+
@@ -0,0 +1,93 @@
+#ifndef garbagecollector_h
+#define garbagecollector_h
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../ren-cxx-basics/function.h"
+#include "../ren-cxx-filesystem/path.h"
+
+#include "log.h"
+
+struct GarbageSettingsT
+{
+	size_t Threads = 2;
+	size_t UnlinksPerSecond = 1000; // 0 for no limit
+};
+
+// Unlinks files away from the transaction path, on a few worker threads at a limited rate.  Anything still
+// queued at shutdown is left for the next sweep to find.
+struct GarbageCollectorT
+{
+	typedef function<bool(std::string const &Name)> FilterT;
+
+	GarbageCollectorT(GarbageSettingsT const &Settings);
+	~GarbageCollectorT(void);
+
+	// Queue a file to be unlinked
+	void Discard(Filesystem::PathT const &Path);
+
+	// Make sure Path isn't unlinked by a queued discard or a running sweep, waiting if it's being unlinked now.
+	// Call before reusing a path that may have been discarded.
+	void Keep(Filesystem::PathT const &Path);
+
+	// List Directory and its subdirectories and unlink every file whose name Filter accepts.  Filter is called
+	// from the worker threads.
+	void Sweep(Filesystem::PathT const &Directory, FilterT &&Filter);
+
+	// Run Task on a worker thread, for collection work that shouldn't hold up the caller.  Errors are logged
+	// against Directory.
+	void Run(Filesystem::PathT const &Directory, function<void(void)> &&Task);
+
+	// Block until everything queued is done
+	void Wait(void);
+
+	// Hold discards back until Release, so files aren't unlinked before the database changes that orphan them 
+	// commit.  Drop forgets the held discards instead, leaving any real garbage for the next sweep.  Holds
+	// nest like the transactions they follow: only the outermost Release queues the discards, and Drop only
+	// forgets discards made since the matching Hold.
+	void Hold(void);
+	void Release(void);
+	void Drop(void);
+
+	uint64_t GetUnlinkCount(void);
+
+	private:
+		struct TaskT
+		{
+			Filesystem::PathT Path;
+			std::shared_ptr<FilterT> Filter; // Set for directories to sweep
+			std::shared_ptr<function<void(void)>> Run; // Set for other work
+		};
+
+		void Work(void);
+		void List(TaskT const &Task);
+		void Unlink(std::string const &Path);
+
+		BasicLogT Log;
+		std::chrono::microseconds const UnlinkInterval;
+
+		std::mutex Mutex;
+		std::condition_variable Signal;
+		std::condition_variable Idle;
+		bool Stop;
+		size_t Active;
+		std::deque<TaskT> Tasks;
+		std::vector<size_t> Holds; // Size of Held at each Hold
+		std::vector<Filesystem::PathT> Held;
+		std::unordered_set<std::string> Kept;
+		std::unordered_multiset<std::string> Unlinking;
+		std::chrono::steady_clock::time_point NextUnlink;
+		uint64_t UnlinkCount;
+
+		std::vector<std::thread> Threads;
+};
+
+#endif
+
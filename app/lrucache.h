@@ -0,0 +1,78 @@
+#ifndef lrucache_h
+#define lrucache_h
+
+#include <list>
+#include <unordered_map>
+
+#include "../ren-cxx-basics/error.h"
+
+// Map that drops the least recently used entries once it holds more than Capacity.  Not thread safe.
+template <typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>> struct LRUCacheT
+{
+	inline LRUCacheT(size_t Capacity) : Capacity(Capacity), Hits(0), Misses(0)
+		{ AssertGT(Capacity, 0u); }
+
+	// Returns null if Key isn't cached, otherwise marks it most recently used
+	inline ValueT *Find(KeyT const &Key)
+	{
+		auto Found = Index.find(Key);
+		if (Found == Index.end())
+		{
+			++Misses;
+			return nullptr;
+		}
+		++Hits;
+		Entries.splice(Entries.begin(), Entries, Found->second);
+		return &Found->second->second;
+	}
+
+	inline ValueT &Insert(KeyT const &Key, ValueT &&Value)
+	{
+		auto Found = Index.find(Key);
+		if (Found != Index.end())
+		{
+			Found->second->second = std::move(Value);
+			Entries.splice(Entries.begin(), Entries, Found->second);
+			return Found->second->second;
+		}
+		Entries.emplace_front(Key, std::move(Value));
+		Index.emplace(Key, Entries.begin());
+		while (Entries.size() > Capacity)
+		{
+			Index.erase(Entries.back().first);
+			Entries.pop_back();
+		}
+		return Entries.front().second;
+	}
+
+	inline void Erase(KeyT const &Key)
+	{
+		auto Found = Index.find(Key);
+		if (Found == Index.end()) return;
+		Entries.erase(Found->second);
+		Index.erase(Found);
+	}
+
+	inline void Clear(void)
+	{
+		Entries.clear();
+		Index.clear();
+	}
+
+	inline size_t Size(void) const { return Entries.size(); }
+	inline size_t GetCapacity(void) const { return Capacity; }
+	inline uint64_t GetHits(void) const { return Hits; }
+	inline uint64_t GetMisses(void) const { return Misses; }
+
+	private:
+		typedef std::list<std::pair<KeyT, ValueT>> EntriesT;
+
+		size_t const Capacity;
+		uint64_t Hits;
+		uint64_t Misses;
+		EntriesT Entries;
+		std::unordered_map<KeyT, typename EntriesT::iterator, HashT> Index;
+};
+
+#endif
+
@@ -1,5 +1,6 @@
 #include "hash.h"
 
+#include <algorithm>
 #include <iomanip>
 
 #include "../../ren-cxx-filesystem/file.h"
@@ -56,6 +57,17 @@ HashT HashString(std::string const &String)
 	});
 }
 
+HashT HashBytes(uint8_t const *Data, size_t Length)
+{
+	return FeedHash([&](cvs_MD5Context &Context)
+	{
+		// Mapped storage can be bigger than the length MD5Update takes
+		constexpr size_t MaxUpdate = 1 << 30;
+		for (size_t Offset = 0; Offset < Length; Offset += MaxUpdate)
+			cvs_MD5Update(&Context, Data + Offset, static_cast<unsigned int>(std::min(MaxUpdate, Length - Offset)));
+	});
+}
+
 OptionalT<std::pair<HashT, size_t>> HashFile(Filesystem::PathT const &Path)
 {
 	auto File(fopen_read(Path));
@@ -76,3 +88,22 @@ OptionalT<std::pair<HashT, size_t>> HashFile(Filesystem::PathT const &Path)
 	fclose(File);
 	return std::make_pair(Hash, Size);
 }
+
+HashStreamT::HashStreamT(void) : Context(std::make_unique<cvs_MD5Context>())
+	{ cvs_MD5Init(Context.get()); }
+
+HashStreamT::~HashStreamT(void) {}
+
+void HashStreamT::Add(uint8_t const *Data, size_t Length)
+{
+	constexpr size_t MaxUpdate = 1 << 30;
+	for (size_t Offset = 0; Offset < Length; Offset += MaxUpdate)
+		cvs_MD5Update(Context.get(), Data + Offset, static_cast<unsigned int>(std::min(MaxUpdate, Length - Offset)));
+}
+
+HashT HashStreamT::Finish(void)
+{
+	HashT Hash{};
+	cvs_MD5Final(&Hash[0], Context.get());
+	return Hash;
+}
@@ -5,6 +5,7 @@
 #include "../../ren-cxx-filesystem/path.h"
 
 #include <array>
+#include <memory>
 
 typedef std::array<uint8_t, 16> HashT;
 
@@ -13,6 +14,21 @@ std::string FormatHash(HashT const &Hash);
 OptionalT<HashT> UnformatHash(char const *String);
 
 HashT HashString(std::string const &String);
+HashT HashBytes(uint8_t const *Data, size_t Length);
 OptionalT<std::pair<HashT, size_t>> HashFile(Filesystem::PathT const &Path);
 
+struct cvs_MD5Context;
+
+// Hashes data that arrives in pieces
+struct HashStreamT
+{
+	HashStreamT(void);
+	~HashStreamT(void);
+	void Add(uint8_t const *Data, size_t Length);
+	HashT Finish(void);
+
+	private:
+		std::unique_ptr<cvs_MD5Context> Context;
+};
+
 #endif
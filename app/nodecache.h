@@ -0,0 +1,50 @@
+#ifndef nodecache_h
+#define nodecache_h
+
+#include "structtypes.h"
+#include "lrucache.h"
+
+struct GlobalChangeIDHashT
+{
+	inline size_t operator ()(GlobalChangeIDT const &ID) const
+	{
+		size_t Out = std::hash<InstanceIndexT>()(ID.NodeID().Instance());
+		auto Mix = [&Out](size_t Value) { Out ^= Value + 0x9e3779b97f4a7c15ull + (Out << 6) + (Out >> 2); };
+		Mix(std::hash<IDBaseT>()(*ID.NodeID().Node()));
+		Mix(std::hash<InstanceIndexT>()(ID.ChangeID().Instance()));
+		Mix(std::hash<IDBaseT>()(*ID.ChangeID().Change()));
+		return Out;
+	}
+};
+
+struct StorageIDHashT
+{
+	inline size_t operator ()(StorageIDT const &ID) const
+		{ return std::hash<IDBaseT>()(*ID); }
+};
+
+// Missing, head and storage rows the writer read or wrote recently, including rows known not to exist, so
+// repeated changes to a busy node skip the database.  The handlers write through it as they change the rows,
+// and it's cleared when a transaction rolls back.  Not thread safe.
+struct NodeStateCacheT
+{
+	inline NodeStateCacheT(size_t Capacity) : Missing(Capacity), Heads(Capacity), Storage(Capacity) {}
+
+	inline void Clear(void)
+	{
+		Missing.Clear();
+		Heads.Clear();
+		Storage.Clear();
+	}
+
+	inline uint64_t GetHits(void) const
+		{ return Missing.GetHits() + Heads.GetHits() + Storage.GetHits(); }
+	inline uint64_t GetMisses(void) const
+		{ return Missing.GetMisses() + Heads.GetMisses() + Storage.GetMisses(); }
+
+	LRUCacheT<GlobalChangeIDT, OptionalT<MissingT>, GlobalChangeIDHashT> Missing;
+	LRUCacheT<GlobalChangeIDT, OptionalT<HeadT>, GlobalChangeIDHashT> Heads;
+	LRUCacheT<StorageIDT, OptionalT<StorageT>, StorageIDHashT> Storage;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "overlaystore.h"
+
+#include <algorithm>
+
+OverlayStoreT::OverlayStoreT(CoreDatabaseT &Database) :
+	Log("overlays"),
+	Database(Database)
+{
+}
+
+void OverlayStoreT::Write(StorageIDT const &ID, Filesystem::PathT const &DataPath, std::vector<BytesChangeT> const &Changes)
+{
+	FileDescriptorT Data(DataPath, O_WRONLY | O_CREAT);
+	auto DataEnd = Data.Size();
+	// Bytes overwritten within the batch are never appended
+	WritePlanT const Plan(Changes);
+	for (auto const &Run : Plan.GetRuns())
+	{
+		uint64_t const Start = Run.Offset;
+		uint64_t const Length = Run.Length;
+		uint64_t const End = Start + Length;
+		LOG(Log, Spam, StringT() << "Overlaying " << ID << " bytes " << Start << " to " << End);
+		Plan.Write(Data, Run, DataEnd);
+
+		// Cut the older extents under the change
+		std::vector<OverlayExtentT> Overlapping;
+		Database.ListOverlappingExtents.Execute(
+			ID,
+			Start,
+			End,
+			[&Overlapping](OverlayExtentT &&Extent) { Overlapping.push_back(std::move(Extent)); });
+		for (auto const &Extent : Overlapping)
+		{
+			Database.DeleteOverlayExtent(ID, Extent.Offset());
+			if (Extent.Offset() < Start)
+				Database.InsertOverlayExtent(ID, OverlayExtentT(
+					Extent.Offset(), 
+					Start - Extent.Offset(), 
+					Extent.DataOffset()));
+			auto const ExtentEnd = Extent.Offset() + Extent.Length();
+			if (ExtentEnd > End)
+				Database.InsertOverlayExtent(ID, OverlayExtentT(
+					End, 
+					ExtentEnd - End, 
+					Extent.DataOffset() + (End - Extent.Offset())));
+		}
+
+		// Sequential writes extend the previous extent rather than adding one per change
+		auto Previous = Database.GetOverlayExtentBefore(ID, Start);
+		if (Previous && 
+			(Previous->Offset() + Previous->Length() == Start) && 
+			(Previous->DataOffset() + Previous->Length() == DataEnd))
+		{
+			Database.DeleteOverlayExtent(ID, Previous->Offset());
+			Database.InsertOverlayExtent(ID, OverlayExtentT(
+				Previous->Offset(), 
+				Previous->Length() + Length, 
+				Previous->DataOffset()));
+		}
+		else Database.InsertOverlayExtent(ID, OverlayExtentT(Start, Length, DataEnd));
+		DataEnd += Length;
+	}
+}
+
+void OverlayStoreT::Release(StorageIDT const &ID)
+{
+	LOG(Log, Spam, StringT() << "Releasing overlay " << ID);
+	Database.DeleteOverlayExtents(ID);
+}
+
+StorageReaderT OverlayStoreT::Open(StorageIDT const &ID, Filesystem::PathT const &DataPath, StorageReaderT const &Parent)
+{
+	StorageReaderT Out;
+	auto const ParentSize = Parent.Size();
+	uint64_t Position = 0;
+	// Gaps between extents come from the parent, or are zeros past its end
+	auto Fill = [&](uint64_t End)
+	{
+		if (Position < ParentSize) Out.Append(Parent, Position, std::min(End, ParentSize) - Position);
+		if (End > ParentSize) Out.AppendZeros(End - std::max(Position, ParentSize));
+		Position = End;
+	};
+	Database.ListOverlayExtents.Execute(ID, [&](OverlayExtentT &&Extent)
+	{
+		Fill(Extent.Offset());
+		Out.Append(DataPath, Extent.DataOffset(), Extent.Length());
+		Position += Extent.Length();
+	});
+	if (Position < ParentSize) Fill(ParentSize);
+	return Out;
+}
+
@@ -0,0 +1,35 @@
+#ifndef overlaystore_h
+#define overlaystore_h
+
+#include "../ren-cxx-filesystem/path.h"
+
+#include "types.h"
+#include "structtypes.h"
+#include "coredatabase.h"
+#include "storagereader.h"
+#include "writeplan.h"
+#include "log.h"
+
+// Storage made of changed extents over a parent storage, so forking storage for a small edit costs the size
+// of the edit rather than the size of the file.  Changed bytes are appended to a data file and OverlayExtents
+// maps storage offsets to data file offsets; anything not in an extent is read from the parent.
+struct OverlayStoreT
+{
+	OverlayStoreT(CoreDatabaseT &Database);
+
+	// Append the changes to the data file and map them over older extents
+	void Write(StorageIDT const &ID, Filesystem::PathT const &DataPath, std::vector<BytesChangeT> const &Changes);
+
+	// Drop the extents of ID; the data file is left to the caller
+	void Release(StorageIDT const &ID);
+
+	// Resolve the extents of ID over the contents of its parent
+	StorageReaderT Open(StorageIDT const &ID, Filesystem::PathT const &DataPath, StorageReaderT const &Parent);
+
+	private:
+		BasicLogT Log;
+		CoreDatabaseT &Database;
+};
+
+#endif
+
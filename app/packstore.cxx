@@ -0,0 +1,120 @@
+#include "packstore.h"
+
+PackStoreT::PackStoreT(
+	Filesystem::PathT const &Root, 
+	CoreDatabaseT &Database, 
+	GarbageCollectorT &Garbage, 
+	DescriptorCacheT &Descriptors, 
+	UnsyncedFilesT &Unsynced, 
+	PackSettingsT const &Settings) :
+	Log("packs"),
+	Root(Root),
+	Database(Database),
+	Garbage(Garbage),
+	Descriptors(Descriptors),
+	Unsynced(Unsynced),
+	Settings(Settings)
+{
+	AssertLTE(Settings.MaxObjectSize, Settings.SegmentSize);
+	Root.CreateDirectory();
+}
+
+void PackStoreT::Write(StorageIDT const &ID, uint8_t const *Data, size_t Length)
+{
+	AssertLTE(Length, Settings.MaxObjectSize);
+	auto const Old = Database.GetStorageLocation(ID);
+	auto const Segment = Reserve(Length);
+	LOG(Log, Spam, StringT() << "Packing " << ID << " (" << Length << " bytes) in segment " << Segment.Segment() << " at " << Segment.Size());
+
+	// Anything past the recorded segment size is left over from an interrupted write, so it's safe to overwrite.
+	// The size is recorded before the location so a crash can't leave live data past it.
+	if (!Append || (AppendSegment != Segment.Segment()))
+	{
+		Append = FileDescriptorT(GetSegmentPath(Segment.Segment()), O_WRONLY | O_CREAT);
+		AppendSegment = Segment.Segment();
+		// The segment may be new
+		Unsynced.NoteDirectory(Root);
+	}
+	Append.Write(Segment.Size(), Data, Length);
+	Unsynced.Note(GetSegmentPath(Segment.Segment()));
+	Database.AdjustSegment(Segment.Segment(), Length, 0);
+	Database.SetStorageLocation(ID, PackLocationT(Segment.Segment(), Segment.Size(), Length));
+	Database.AdjustSegment(Segment.Segment(), 0, Length);
+	if (Old) Database.AdjustSegment(Old->Segment(), 0, -static_cast<int64_t>(Old->Length()));
+}
+
+void PackStoreT::Release(StorageIDT const &ID)
+{
+	auto const Location = Database.GetStorageLocation(ID);
+	if (!Location) return;
+	LOG(Log, Spam, StringT() << "Releasing packed " << ID << " from segment " << Location->Segment());
+	Database.ClearStorageLocation(ID);
+	Database.AdjustSegment(Location->Segment(), 0, -static_cast<int64_t>(Location->Length()));
+}
+
+StorageReaderT PackStoreT::Open(StorageIDT const &ID)
+{
+	StorageReaderT Out;
+	if (auto const Location = Database.GetStorageLocation(ID))
+		Out.Append(GetSegmentPath(Location->Segment()), Location->Offset(), Location->Length());
+	return Out;
+}
+
+OptionalT<PackLocationT> PackStoreT::Locate(StorageIDT const &ID)
+	{ return Database.GetStorageLocation(ID); }
+
+std::vector<SegmentIndexT> PackStoreT::ListSparse(size_t Count)
+{
+	std::vector<SegmentIndexT> Out;
+	Database.ListSparseSegments.Execute(
+		Settings.MinLivePercent,
+		Count,
+		[&Out](SegmentIndexT &&Segment) { Out.push_back(Segment); });
+	return Out;
+}
+
+void PackStoreT::Compact(SegmentIndexT const &Segment)
+{
+	auto const Path = GetSegmentPath(Segment);
+	if (Database.GetSegment(Segment))
+	{
+		std::vector<StorageIDT> Live;
+		Database.ListSegmentStorage.Execute(
+			Segment,
+			[&Live](StorageIndexT &&ID) { Live.push_back(ID); });
+		LOG(Log, Debug, StringT() << "Compacting segment " << Segment << " (" << Live.size() << " live)");
+
+		// Storage already moved by an interrupted compaction isn't listed again
+		FileDescriptorT In(Path, O_RDONLY);
+		std::vector<uint8_t> Buffer;
+		for (auto const &ID : Live)
+		{
+			auto const Location = *Database.GetStorageLocation(ID);
+			Buffer.resize(Location.Length());
+			if (In.Read(Location.Offset(), Buffer.data(), Buffer.size()) < Buffer.size())
+				throw SYSTEM_ERROR << "Segment " << Path.Render() << " is shorter than expected";
+			Write(ID, Buffer.data(), Buffer.size());
+		}
+		Database.DeleteSegment(Segment);
+	}
+	if (AppendSegment == Segment) Append.Close();
+	Descriptors.Forget(Path);
+	if (Path.Exists()) Garbage.Discard(Path);
+}
+
+Filesystem::PathT PackStoreT::GetSegmentPath(SegmentIndexT const &Segment)
+{
+	return Root.Enter(StringT() << Segment);
+}
+
+PackSegmentT PackStoreT::Reserve(size_t Length)
+{
+	auto Last = Database.GetLastSegment();
+	if (Last && (Last->Size() + Length <= Settings.SegmentSize)) return *Last;
+	auto const Segment = *Database.GetSegmentCounter();
+	Database.IncrementSegmentCounter();
+	Database.InsertSegment(Segment);
+	LOG(Log, Debug, StringT() << "Starting segment " << Segment);
+	return PackSegmentT(Segment, 0, 0);
+}
+
@@ -0,0 +1,68 @@
+#ifndef packstore_h
+#define packstore_h
+
+#include "../ren-cxx-filesystem/path.h"
+
+#include "types.h"
+#include "structtypes.h"
+#include "coredatabase.h"
+#include "storagereader.h"
+#include "garbagecollector.h"
+#include "unsyncedfiles.h"
+#include "log.h"
+
+struct PackSettingsT
+{
+	// Storage up to this size is packed
+	size_t MaxObjectSize = 4 * 1024;
+	// A new segment is started once appending would pass this size
+	uint64_t SegmentSize = 64 * 1024 * 1024;
+	// Segments with less live data than this are rewritten by CompactSegments
+	unsigned int MinLivePercent = 50;
+};
+
+// Small storage appended to shared segment files, so it doesn't cost a file each.  Storage is never changed in
+// place; rewriting it appends the new contents and leaves the old ones as dead space, which compaction reclaims.
+struct PackStoreT
+{
+	PackStoreT(
+		Filesystem::PathT const &Root, 
+		CoreDatabaseT &Database, 
+		GarbageCollectorT &Garbage, 
+		DescriptorCacheT &Descriptors, 
+		UnsyncedFilesT &Unsynced, 
+		PackSettingsT const &Settings);
+
+	// Append Data as the new contents of ID
+	void Write(StorageIDT const &ID, uint8_t const *Data, size_t Length);
+
+	// Drop ID from its segment
+	void Release(StorageIDT const &ID);
+
+	StorageReaderT Open(StorageIDT const &ID);
+	OptionalT<PackLocationT> Locate(StorageIDT const &ID);
+
+	// Up to Count full segments with less than MinLivePercent live data, sparsest first
+	std::vector<SegmentIndexT> ListSparse(size_t Count);
+
+	// Move the live storage of Segment to the end of the current segment and discard it
+	void Compact(SegmentIndexT const &Segment);
+
+	Filesystem::PathT GetSegmentPath(SegmentIndexT const &Segment);
+
+	private:
+		PackSegmentT Reserve(size_t Length);
+
+		BasicLogT Log;
+		Filesystem::PathT const Root;
+		CoreDatabaseT &Database;
+		GarbageCollectorT &Garbage;
+		DescriptorCacheT &Descriptors;
+		UnsyncedFilesT &Unsynced;
+		PackSettingsT const Settings;
+		FileDescriptorT Append;
+		SegmentIndexT AppendSegment;
+};
+
+#endif
+
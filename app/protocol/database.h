@@ -2,6 +2,7 @@
 #define database_h
 
 #include <sqlite3.h>
+#include <memory>
 #include <type_traits>
 
 //#include "../../ren-cxx-basics/type.h"
@@ -9,30 +10,89 @@
 #include "../../ren-cxx-filesystem/path.h"
 #include "databaseoperations.h"
 #include "../log.h"
+#include "../lrucache.h"
 
 template <typename Classification> struct Type {};
 /*template <typename Classification> struct Binary {};
 template <typename Classification> using BinaryType = Type<Binary<Classification>>;*/
 
+struct SQLSettingsT
+{
+	// Write ahead logging lets a commit append to the log rather than rewriting and syncing pages in place
+	bool WriteAheadLog = true;
+
+	// How often SQLite syncs; with write ahead logging, Normal only syncs at checkpoints, so the last commits 
+	// can be lost (but not corrupted) by a power failure
+	enum struct SynchronousT { Off = 0, Normal = 1, Full = 2, Extra = 3 };
+	SynchronousT Synchronous = SynchronousT::Full;
+
+	// Bytes of the database read through a memory map rather than read calls, 0 to disable
+	uint64_t MemoryMapSize = 256 * 1024 * 1024;
+
+	// Page cache size per connection
+	uint64_t CacheKiB = 16 * 1024;
+
+	// Keep temporary tables and indexes for sorting in memory
+	bool MemoryTempStore = true;
+
+	// Only applies when the database is created
+	unsigned int PageSize = 4096;
+
+	// Statements prepared by Execute and Get that are kept for reuse, at least 1
+	size_t StatementCacheSize = 64;
+
+	// Open an existing database for queries only; schema and journal settings are left to the writing connection
+	bool ReadOnly = false;
+
+	// Milliseconds to retry a locked database before failing with SQLITE_BUSY, 0 to fail immediately
+	unsigned int BusyTimeout = 5000;
+};
+
 struct SQLDatabaseT
 {
-	inline SQLDatabaseT(OptionalT<Filesystem::PathT> const &Path = {}) : Context(nullptr), Log("sqlite")
+	inline SQLDatabaseT(OptionalT<Filesystem::PathT> const &Path = {}, SQLSettingsT const &Settings = {}) : 
+		Context(nullptr), Log("sqlite"), TransactionDepth(0), Statements(Settings.StatementCacheSize)
 	{
+		// A connection is only ever used by one thread at a time, so SQLite's own locking can be skipped.  This has 
+		// to happen before SQLite is initialized by the first open.
+		static bool const Configured = sqlite3_config(SQLITE_CONFIG_MULTITHREAD) == SQLITE_OK;
+		if (!Configured)
+			LOG(Log, Warning, "Could not disable sqlite locking.");
 		if ((!Path && (sqlite3_open(":memory:", &Context) != 0)) ||
-			(Path && (sqlite3_open(Path->Render().c_str(), &Context) != 0)))
+			(Path && (sqlite3_open_v2(
+				Path->Render().c_str(), 
+				&Context, 
+				Settings.ReadOnly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE), 
+				nullptr) != 0)))
 			throw SYSTEM_ERROR << "Could not create database: " << sqlite3_errmsg(Context);
-		if (sqlite3_config(SQLITE_CONFIG_SINGLETHREAD) != SQLITE_OK)
-			LOG(Log, Warning, "Could not disable sqlite locking.");
+		sqlite3_busy_timeout(Context, Settings.BusyTimeout);
 #ifndef NDEBUG
 		/*sqlite3_trace(Context, [](void *, char const *Statement)
 		{
 			LOG(Log, Spam, String() << "(sqlite statement)" << Statement);
 		}, nullptr);*/
 #endif
+		if (!Settings.ReadOnly)
+		{
+			// The page size has to be set before the first table, and before switching to write ahead logging
+			SetPragma("page_size", StringT() << Settings.PageSize);
+			if (Settings.WriteAheadLog)
+			{
+				auto const Mode = *Get<std::string(void)>("PRAGMA journal_mode = WAL");
+				if (Mode != "wal")
+					LOG(Log, Debug, StringT() << "Using journal mode " << Mode << " rather than write ahead logging");
+			}
+		}
+		SetPragma("synchronous", StringT() << (int)Settings.Synchronous);
+		SetPragma("mmap_size", StringT() << Settings.MemoryMapSize);
+		SetPragma("cache_size", StringT() << "-" << Settings.CacheKiB);
+		SetPragma("temp_store", Settings.MemoryTempStore ? "MEMORY" : "DEFAULT");
 	}
 
 	inline ~SQLDatabaseT(void)
 	{
+		// Unfinalized statements keep the connection open
+		Statements.Clear();
 		sqlite3_close(Context);
 	}
 
@@ -47,6 +107,11 @@ struct SQLDatabaseT
 				throw SYSTEM_ERROR << "Could not prepare query \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
 		}
 
+		// Wraps a statement already prepared from Template
+		StatementT(SQLDatabaseT *Base, const char *Template, sqlite3_stmt *Prepared) : 
+			Template(Template), BaseContext(Base->Context), Context(Prepared)
+			{ Assert(Context); }
+
 		StatementT(StatementT<std::tuple<ResultT...>(ArgumentsT...)> &&Other) : 
 			Template(Other.Template), BaseContext(Other.BaseContext), Context(Other.Context)
 		{
@@ -59,9 +124,29 @@ struct SQLDatabaseT
 				sqlite3_finalize(Context);
 		}
 
+		// Gives up the prepared statement without finalizing it
+		sqlite3_stmt *Release(void)
+		{
+			auto Out = Context;
+			Context = nullptr;
+			return Out;
+		}
+
 		void Execute(
 			ArgumentsT const & ...Arguments, 
 			function<void(ResultT && ...)> const &Function = function<void(ResultT & ...)>())
+		{
+			ForEach(Arguments..., [&Function](ResultT && ...Results)
+			{
+				Function(std::forward<ResultT>(Results)...);
+				return true;
+			});
+		}
+
+		// Like Execute, but stops reading rows as soon as Function returns false
+		void ForEach(
+			ArgumentsT const & ...Arguments, 
+			function<bool(ResultT && ...)> const &Function)
 		{
 			Assert(Context);
 			if (sizeof...(Arguments) > 0)
@@ -69,29 +154,35 @@ struct SQLDatabaseT
 				int BindIndex = 1;
 				Bind(BaseContext, Context, BindIndex, Arguments...);
 			}
-			while (true)
+			try
+			{
+				while (true)
+				{
+					int Result = sqlite3_step(Context);
+					if (Result == SQLITE_DONE) break;
+					if (Result != SQLITE_ROW)
+						throw SYSTEM_ERROR << "Could not execute query \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
+					int UnbindIndex = 0;
+					if (!Unbind<ResultT...>(Context, UnbindIndex, Function)) break;
+				}
+			}
+			catch (...)
 			{
-				int Result = sqlite3_step(Context);
-				if (Result == SQLITE_DONE) break;
-				if (Result != SQLITE_ROW)
-					throw SYSTEM_ERROR << "Could not execute query \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
-				int UnbindIndex = 0;
-				Unbind<ResultT...>(Context, UnbindIndex, Function);
+				// A statement left mid-read keeps its read transaction open
+				sqlite3_reset(Context);
+				throw;
 			}
 			sqlite3_reset(Context);
 		}
 
 		OptionalT<std::tuple<ResultT ...>> GetTuple(ArgumentsT const & ...Arguments)
 		{
-			bool Done = false;
-			std::tuple<ResultT ...> Out;
-			Execute(Arguments..., [&Out, &Done](ResultT && ...Results)
+			OptionalT<std::tuple<ResultT ...>> Out;
+			ForEach(Arguments..., [&Out](ResultT && ...Results)
 			{
-				if (Done) return;
-				Done = true;
 				Out = std::make_tuple(std::forward<ResultT>(Results)...);
+				return false;
 			});
-			if (!Done) return {};
 			return Out;
 		}
 
@@ -152,13 +243,13 @@ struct SQLDatabaseT
 				{ AssertE(Index - 1, sqlite3_bind_parameter_count(Context)); }
 
 			template <typename NextT, typename ...RemainingT, typename ...ReadT>
-				void Unbind(
+				bool Unbind(
 					sqlite3_stmt *Context, 
 					int &Index, 
-					function<void(ResultT && ...)> const &Function, 
+					function<bool(ResultT && ...)> const &Function, 
 					ReadT && ...ReadData)
 			{
-				Unbind<RemainingT...>(
+				return Unbind<RemainingT...>(
 					Context, 
 					Index, 
 					Function, 
@@ -169,14 +260,14 @@ struct SQLDatabaseT
 			}
 
 			template <typename ...ReadT>
-				void Unbind(
+				bool Unbind(
 					sqlite3_stmt *Context, 
 					int &Index, 
-					function<void(ResultT && ...)> const &Function, 
+					function<bool(ResultT && ...)> const &Function, 
 					ReadT && ...ReadData)
 			{
 				AssertE(Index, sqlite3_column_count(Context));
-				Function(std::forward<ResultT &&>(ReadData)...);
+				return Function(std::forward<ResultT &&>(ReadData)...);
 			}
 
 			const char *Template;
@@ -199,19 +290,112 @@ struct SQLDatabaseT
 	template <typename ...ArgumentsT> 
 		void Execute(char const *Template, ArgumentsT const & ...Arguments)
 	{
-		StatementT<void(ArgumentsT...)> Statement(this, Template);
+		auto Statement = Borrow<void(ArgumentsT...)>(Template);
 		Statement.Execute(std::forward<ArgumentsT const &>(Arguments)...);
+		Recycle(Template, Statement);
 	}
 
 	template <typename SignatureT, typename ...ArgumentsT>
 		auto Get(char const *Template, ArgumentsT const & ...Arguments) 
 		-> decltype(StatementT<SignatureT>(this, Template).Get(std::forward<ArgumentsT const &>(Arguments)...))
-		{ return StatementT<SignatureT>(this, Template).Get(std::forward<ArgumentsT const &>(Arguments)...); }
+	{ 
+		auto Statement = Borrow<SignatureT>(Template);
+		auto Out = Statement.Get(std::forward<ArgumentsT const &>(Arguments)...);
+		Recycle(Template, Statement);
+		return Out;
+	}
+
+	inline uint64_t GetStatementCacheHits(void) const { return Statements.GetHits(); }
+	inline uint64_t GetStatementCacheMisses(void) const { return Statements.GetMisses(); }
+
+	// Rolls back on destruction unless committed.  The outermost transaction takes the write lock up front
+	// so it can't fail to upgrade partway through; nested transactions are savepoints and must finish before
+	// the transactions enclosing them.
+	struct TransactionT
+	{
+		inline TransactionT(SQLDatabaseT &Base) : Base(&Base), Depth(Base.TransactionDepth)
+		{
+			if (Depth == 0) Base.Execute("BEGIN IMMEDIATE");
+			else Base.Execute(GetSavepointStatement("SAVEPOINT").c_str());
+			++Base.TransactionDepth;
+		}
+
+		inline TransactionT(TransactionT &&Other) : Base(Other.Base), Depth(Other.Depth)
+			{ Other.Base = nullptr; }
+
+		TransactionT(TransactionT const &) = delete;
+
+		inline ~TransactionT(void)
+		{
+			if (!Base) return;
+			Finish();
+			// An error may already have rolled back the whole transaction
+			if (sqlite3_get_autocommit(Base->Context)) return;
+			std::string const Rollback = Depth == 0 ? 
+				std::string("ROLLBACK") : 
+				GetSavepointStatement("ROLLBACK TO") + "; " + GetSavepointStatement("RELEASE");
+			if (sqlite3_exec(Base->Context, Rollback.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+				LOG(Base->Log, Warning, StringT() << "Could not roll back transaction: " << sqlite3_errmsg(Base->Context));
+		}
+
+		inline void Commit(void)
+		{
+			Assert(Base);
+			if (Depth == 0) Base->Execute("COMMIT");
+			else Base->Execute(GetSavepointStatement("RELEASE").c_str());
+			Finish();
+			Base = nullptr;
+		}
+
+		private:
+			inline std::string GetSavepointStatement(char const *Verb)
+				{ return StringT() << Verb << " \"Nested" << Depth << "\""; }
+
+			inline void Finish(void)
+			{
+				AssertE(Base->TransactionDepth, Depth + 1);
+				Base->TransactionDepth = Depth;
+			}
+
+			SQLDatabaseT *Base;
+			unsigned int const Depth;
+	};
+
+	inline TransactionT Begin(void) { return TransactionT(*this); }
+
+	inline bool InTransaction(void) const { return TransactionDepth > 0; }
 
 	template <typename SignatureT> friend struct StatementT;
 	private:
+		// Statements for Execute and Get are taken out of the cache while they run and put back after, so a 
+		// statement that throws is finalized rather than reused
+		template <typename SignatureT> StatementT<SignatureT> Borrow(char const *Template)
+		{
+			if (auto Found = Statements.Find(Template))
+			{
+				auto Prepared = Found->release();
+				Statements.Erase(Template);
+				return StatementT<SignatureT>(this, Template, Prepared);
+			}
+			return StatementT<SignatureT>(this, Template);
+		}
+
+		template <typename BorrowedT> void Recycle(char const *Template, BorrowedT &Statement)
+			{ Statements.Insert(Template, PreparedT(Statement.Release(), &sqlite3_finalize)); }
+
+		inline void SetPragma(char const *Name, std::string const &Value)
+		{
+			std::string const Statement = StringT() << "PRAGMA " << Name << " = " << Value;
+			// Some pragmas report their new value, which is ignored
+			if (sqlite3_exec(Context, Statement.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+				throw SYSTEM_ERROR << "Could not set " << Name << ": " << sqlite3_errmsg(Context);
+		}
+
 		sqlite3 *Context;
 		BasicLogT Log;
+		unsigned int TransactionDepth;
+		typedef std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)> PreparedT;
+		LRUCacheT<std::string, PreparedT> Statements;
 };
 
 #endif
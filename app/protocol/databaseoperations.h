@@ -1,6 +1,8 @@
 #ifndef databaseoperations_h
 #define databaseoperations_h
 
+#include <vector>
+
 #include "../../ren-cxx-basics/error.h"
 #include "../../ren-cxx-basics/stricttype.h"
 
@@ -40,6 +42,48 @@ template <> struct DBImplm<std::string>
 		{ ++Index; }
 };
 
+// ----------------
+// Blob
+template <> struct DBImplm<std::vector<uint8_t>>
+{
+	static void Bind(
+		sqlite3 *BaseContext, 
+		sqlite3_stmt *Context, 
+		const char *Template, 
+		int &Index, 
+		std::vector<uint8_t> const &Value)
+	{
+		// A null pointer would bind NULL rather than an empty blob
+		auto const Result = Value.empty() ?
+			sqlite3_bind_zeroblob(Context, Index, 0) :
+			sqlite3_bind_blob(Context, Index, Value.data(), static_cast<int>(Value.size()), nullptr);
+		if (Result != SQLITE_OK)
+			throw SYSTEM_ERROR << "Could not bind argument " << Index << " to \"" << Template << "\": " << sqlite3_errmsg(BaseContext);
+		++Index;
+	}
+	
+	static void BindNull(
+		sqlite3_stmt *Context, 
+		int &Index)
+	{
+		sqlite3_bind_null(Context, Index++);
+	}
+
+	static std::vector<uint8_t> Unbind(
+		sqlite3_stmt *Context, 
+		int &Index)
+	{ 
+		auto const Data = static_cast<uint8_t const *>(sqlite3_column_blob(Context, Index));
+		auto const Size = sqlite3_column_bytes(Context, Index);
+		++Index;
+		if (!Data) return {};
+		return std::vector<uint8_t>(Data, Data + Size);
+	}
+	
+	static void UnbindNull(int &Index)
+		{ ++Index; }
+};
+
 // ----------------
 // Integer
 template <typename IntegerT>
@@ -5,6 +5,13 @@
 #include "../../ren-cxx-filesystem/path.h"
 #include "../../ren-cxx-filesystem/file.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <mutex>
 #include <thread>
 
@@ -28,17 +35,61 @@ template <typename Type, typename OtherType, typename ...RemainingTypes>
 {
 };
 
+// Presents serialized messages held in memory to a protocol reader
+struct MessageStreamT
+{
+	std::vector<uint8_t> const &Data;
+	size_t Offset;
+
+	MessageStreamT(std::vector<uint8_t> const &Data) : Data(Data), Offset(0) {}
+
+	uint8_t const *FilledStart(size_t Length, size_t Plus = 0)
+	{
+		if (Offset + Plus + Length > Data.size()) return nullptr;
+		return Data.data() + Offset + Plus;
+	}
+
+	void Consume(size_t Length) { Offset += Length; }
+};
+
+struct TransactorSettingsT
+{
+	// Records appended within this long of the first unsynced record share its sync
+	std::chrono::microseconds CommitWindow{100};
+
+	// Sync the journal in the background (see TransactorT)
+	bool Sync = true;
+
+	// The journal is truncated once it's at least this big and every transaction in it has finished
+	uint64_t CheckpointSize = 1 << 20;
+};
+
+// Transactions are appended to a single journal as checksummed records: a start record before the handler runs,
+// then a finish record once it returns, or an abort record if it throws.  Transactions with a start record and 
+// neither of the others are replayed on startup.  Act doesn't wait for its records to reach disk; a sync thread
+// syncs every record appended within CommitWindow of the first unsynced one together, so back-to-back 
+// transactions share syncs as well as concurrent ones.  Call Flush to wait until the records are durable.  
+// Handlers' file changes are expected on the journal's filesystem, which is synced before a checkpoint drops the
+// records that would redo them.
 template <typename ProtoHandlerT, typename ...MessagesT> struct TransactorT
 {
-	TransactorT(Filesystem::PathT const &TransactionPath, ProtoHandlerT &Handler) : 
+	TransactorT(
+		Filesystem::PathT const &TransactionPath, 
+		ProtoHandlerT &Handler, 
+		TransactorSettingsT const &Settings = TransactorSettingsT()) : 
 		Log("transactor"),
 		TransactionPath(TransactionPath),
+		JournalPath(TransactionPath.Enter("journal")),
+		Settings(Settings),
 		Handler(Handler)
 	{
 		LOG(Log, Debug, (StringT() << "Replaying transactions."));
 		TransactionPath.CreateDirectory();
+
+		// Transactions from before the journal, one file per thread
 		TransactionPath.List([&](Filesystem::PathT &&Path, bool IsFile, bool IsDir)
 		{
+			if (Path.Render() == JournalPath.Render()) return true;
 			LOG(Log, Info, (StringT() << "Recovering " << Path));
 			auto In = Filesystem::FileT::OpenRead(Path);
 			ReadBufferT Buffer;
@@ -59,7 +110,50 @@ template <typename ProtoHandlerT, typename ...MessagesT> struct TransactorT
 			Path.Delete();
 			return true;
 		});
+
+		Journal = open(JournalPath.Render().c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+		if (Journal < 0)
+			throw SYSTEM_ERROR << "Could not open journal " << JournalPath << ": " << strerror(errno);
+		for (auto const &Pending : ReadJournal())
+		{
+			LOG(Log, Info, (StringT() << "Recovering transaction " << Pending.first));
+			try
+			{
+				Reader.Read(MessageStreamT(Pending.second), Handler);
+			}
+			catch (SystemErrorT const &Error)
+			{ 
+				LOG(
+					Log, 
+					Info, 
+					StringT() << "Error replaying transaction " << Pending.first << ": " << Error); 
+			}
+		}
+		Truncate();
 		LOG(Log, Debug, (StringT() << "Done replaying transactions."));
+		if (Settings.Sync) SyncThread = std::thread([this](void) { SyncJournal(); });
+	}
+
+	~TransactorT(void)
+	{
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Stop = true;
+		}
+		Unsynced.notify_all();
+		if (SyncThread.joinable()) SyncThread.join();
+		if (InFlight == 0)
+		{
+			try
+			{
+				Truncate();
+			}
+			catch (SystemErrorT const &Error)
+			{
+				LOG(Log, Warning, StringT() << "Error checkpointing journal " << JournalPath << " on shutdown: " << Error);
+			}
+		}
+		close(Journal);
 	}
 
 	template <typename MessageT, typename ...ArgumentTypes> 
@@ -68,16 +162,53 @@ template <typename ProtoHandlerT, typename ...MessagesT> struct TransactorT
 		static_assert(
 			TypeIn<MessageT, MessagesT...>::Value, 
 			"MessageT is unregistered.  Type must be registered with callback in constructor.");
-		Filesystem::PathT ThreadPath = TransactionPath.Enter(StringT() << std::this_thread::get_id());
-		LOG(Log, Info, (StringT() << "Starting transaction " << ThreadPath));
-		Filesystem::FileT::OpenWrite(ThreadPath).Write(
-			MessageT::Write(std::forward<ArgumentTypes const &>(Arguments)...));
-		LOG(Log, Info, (StringT() << "Wrote transaction " << ThreadPath));
-		Handler.Handle(
-			MessageT(), 
-			std::forward<ArgumentTypes const &>(Arguments)...);
-		LOG(Log, Info, (StringT() << "Ending transaction " << ThreadPath));
-		ThreadPath.Delete();
+		auto const Message = MessageT::Write(std::forward<ArgumentTypes const &>(Arguments)...);
+		uint64_t Sequence;
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			if (!SyncError.empty()) throw SYSTEM_ERROR << SyncError;
+			Sequence = NextSequence++;
+			Append(RecordKindT::Start, Sequence, Message);
+			++InFlight;
+			LOG(Log, Info, (StringT() << "Wrote transaction " << Sequence));
+		}
+		Unsynced.notify_one();
+		try
+		{
+			Handler.Handle(
+				MessageT(), 
+				std::forward<ArgumentTypes const &>(Arguments)...);
+		}
+		catch (...)
+		{
+			// The handler rolled back what it could; replaying it would only fail the same way
+			{
+				std::lock_guard<std::mutex> Lock(Mutex);
+				--InFlight;
+				LOG(Log, Info, (StringT() << "Aborting transaction " << Sequence));
+				Append(RecordKindT::Abort, Sequence, {});
+			}
+			Unsynced.notify_one();
+			throw;
+		}
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			--InFlight;
+			LOG(Log, Info, (StringT() << "Ending transaction " << Sequence));
+			Append(RecordKindT::Finish, Sequence, {});
+			if ((InFlight == 0) && (JournalSize >= Settings.CheckpointSize)) Truncate();
+		}
+		Unsynced.notify_one();
+	}
+
+	// Block until every record appended so far is synced.  Returns immediately without Sync.
+	void Flush(void)
+	{
+		if (!Settings.Sync) return;
+		std::unique_lock<std::mutex> Lock(Mutex);
+		auto const Through = AppendedRecords;
+		Synced.wait(Lock, [&](void) { return (SyncedRecords >= Through) || !SyncError.empty(); });
+		if (SyncedRecords < Through) throw SYSTEM_ERROR << SyncError;
 	}
 
 	template <typename MessageT, typename ...ArgumentTypes> 
@@ -86,11 +217,200 @@ template <typename ProtoHandlerT, typename ...MessagesT> struct TransactorT
 		Act<MessageT>(std::forward<ArgumentTypes const &>(Arguments)...); 
 	}
 
+	uint64_t GetTransactionCount(void) const 
+	{ 
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return NextSequence; 
+	}
+
+	uint64_t GetSyncCount(void) const 
+	{ 
+		std::lock_guard<std::mutex> Lock(Mutex);
+		return SyncCount; 
+	}
+
 	private:
+		enum class RecordKindT : uint8_t
+		{
+			Start = 0,
+			Finish = 1,
+			Abort = 2,
+		};
+
+		// Kind, sequence, payload length, checksum
+		static constexpr size_t RecordHeaderSize = 1 + 8 + 4 + 8;
+
+		// FNV-1a, to catch torn and partial records
+		static uint64_t Checksum(uint8_t const *Header, uint8_t const *Payload, size_t Length)
+		{
+			uint64_t Hash = 14695981039346656037ull;
+			auto Feed = [&Hash](uint8_t const *Data, size_t Length)
+			{
+				for (size_t Index = 0; Index < Length; ++Index) 
+				{
+					Hash ^= Data[Index];
+					Hash *= 1099511628211ull;
+				}
+			};
+			Feed(Header, RecordHeaderSize - 8);
+			Feed(Payload, Length);
+			return Hash;
+		}
+
+		void Append(RecordKindT Kind, uint64_t Sequence, std::vector<uint8_t> const &Payload)
+		{
+			std::vector<uint8_t> Record(RecordHeaderSize + Payload.size());
+			uint32_t const Length = static_cast<uint32_t>(Payload.size());
+			Record[0] = static_cast<uint8_t>(Kind);
+			memcpy(&Record[1], &Sequence, 8);
+			memcpy(&Record[9], &Length, 4);
+			if (!Payload.empty()) memcpy(&Record[RecordHeaderSize], Payload.data(), Payload.size());
+			uint64_t const Sum = Checksum(Record.data(), Payload.data(), Payload.size());
+			memcpy(&Record[13], &Sum, 8);
+			size_t Total = 0;
+			while (Total < Record.size())
+			{
+				auto const Wrote = write(Journal, Record.data() + Total, Record.size() - Total);
+				if (Wrote < 0)
+				{
+					if (errno == EINTR) continue;
+					auto const Error = errno;
+					// A partial record would hide every record appended after it
+					if ((Total > 0) && (ftruncate(Journal, JournalSize) != 0))
+					{
+						LOG(Log, Warning, StringT() << "Could not drop partial record from journal " << JournalPath);
+					}
+					throw SYSTEM_ERROR << "Error writing journal " << JournalPath << ": " << strerror(Error);
+				}
+				Total += Wrote;
+			}
+			JournalSize += Record.size();
+			++AppendedRecords;
+		}
+
+		// Runs on the sync thread.  Waits a commit window after the first unsynced record, then syncs everything 
+		// appended by then.  Anything unsynced at shutdown is synced before it returns.
+		void SyncJournal(void)
+		{
+			std::unique_lock<std::mutex> Lock(Mutex);
+			while (true)
+			{
+				Unsynced.wait(Lock, [this](void) { return Stop || (SyncedRecords < AppendedRecords); });
+				if (SyncedRecords >= AppendedRecords) return;
+				if (!Stop && (Settings.CommitWindow.count() > 0))
+				{
+					Lock.unlock();
+					std::this_thread::sleep_for(Settings.CommitWindow);
+					Lock.lock();
+				}
+				auto const Through = AppendedRecords;
+				Lock.unlock();
+				int Result;
+				while (((Result = fdatasync(Journal)) != 0) && (errno == EINTR)) {}
+				auto const Error = errno;
+				Lock.lock();
+				if (Result != 0)
+				{
+					// Whether earlier writes reached the disk is unknown after a failed sync, so stop accepting
+					// transactions rather than retry
+					SyncError = StringT() << "Error syncing journal " << JournalPath << ": " << strerror(Error);
+					LOG(Log, Warning, StringT() << SyncError);
+					Synced.notify_all();
+					return;
+				}
+				SyncedRecords = std::max(SyncedRecords, Through);
+				++SyncCount;
+				Synced.notify_all();
+			}
+		}
+
+		// Transactions that started but didn't finish, in order.  Reading stops at the first bad record, since
+		// nothing after a torn write was synced.
+		std::map<uint64_t, std::vector<uint8_t>> ReadJournal(void)
+		{
+			std::vector<uint8_t> Data;
+			{
+				uint8_t Buffer[65536];
+				uint64_t Offset = 0;
+				while (true)
+				{
+					auto const Got = pread(Journal, Buffer, sizeof(Buffer), Offset);
+					if (Got < 0)
+					{
+						if (errno == EINTR) continue;
+						throw SYSTEM_ERROR << "Error reading journal " << JournalPath << ": " << strerror(errno);
+					}
+					if (Got == 0) break;
+					Data.insert(Data.end(), Buffer, Buffer + Got);
+					Offset += Got;
+				}
+			}
+
+			std::map<uint64_t, std::vector<uint8_t>> Pending;
+			size_t Offset = 0;
+			while (Data.size() - Offset >= RecordHeaderSize)
+			{
+				uint8_t const *Header = &Data[Offset];
+				uint64_t Sequence;
+				uint32_t Length;
+				uint64_t Sum;
+				memcpy(&Sequence, Header + 1, 8);
+				memcpy(&Length, Header + 9, 4);
+				memcpy(&Sum, Header + 13, 8);
+				if (Data.size() - Offset - RecordHeaderSize < Length) break;
+				uint8_t const *Payload = Header + RecordHeaderSize;
+				if (Checksum(Header, Payload, Length) != Sum)
+				{
+					LOG(Log, Info, (StringT() << "Journal " << JournalPath << " has a bad record at " << Offset << "; ignoring the rest"));
+					break;
+				}
+				if (Header[0] == static_cast<uint8_t>(RecordKindT::Start)) 
+					Pending[Sequence] = std::vector<uint8_t>(Payload, Payload + Length);
+				else Pending.erase(Sequence);
+				Offset += RecordHeaderSize + Length;
+			}
+			return Pending;
+		}
+
+		// Checkpoint; only called when every journaled transaction has finished
+		void Truncate(void)
+		{
+			if (Settings.Sync)
+			{
+#if __linux__
+				if (syncfs(Journal) != 0)
+					throw SYSTEM_ERROR << "Error syncing before truncating journal " << JournalPath << ": " << strerror(errno);
+#else
+				sync();
+#endif
+			}
+			if (ftruncate(Journal, 0) != 0)
+				throw SYSTEM_ERROR << "Error truncating journal " << JournalPath << ": " << strerror(errno);
+			JournalSize = 0;
+			// Nothing left to sync
+			if (Settings.Sync) SyncedRecords = AppendedRecords;
+		}
+
 		BasicLogT Log;
 		Filesystem::PathT const TransactionPath;
+		Filesystem::PathT const JournalPath;
+		TransactorSettingsT const Settings;
 		ProtoHandlerT &Handler;
 		Protocol::ReaderT<MessagesT...> Reader;
+
+		int Journal = -1;
+		mutable std::mutex Mutex;
+		std::condition_variable Unsynced;
+		std::condition_variable Synced;
+		bool Stop = false;
+		std::string SyncError;
+		uint64_t NextSequence = 0;
+		uint64_t AppendedRecords = 0;
+		uint64_t SyncedRecords = 0;
+		uint64_t SyncCount = 0;
+		uint64_t InFlight = 0;
+		uint64_t JournalSize = 0;
+		std::thread SyncThread;
 };
 
 #endif
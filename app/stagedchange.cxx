@@ -0,0 +1,67 @@
+#include "stagedchange.h"
+
+#include <algorithm>
+
+StagedChangeT::StagedChangeT(GlobalChangeIDT const &ChangeID, uint64_t Stage, bool Truncate, std::string const &Path) :
+	ChangeID(ChangeID),
+	Stage(Stage),
+	Truncate(Truncate),
+	File(Path, O_RDWR | O_CREAT | O_TRUNC)
+	{}
+
+StagedChangeT::~StagedChangeT(void)
+{
+	if (!File) return;
+	auto const Path = File.GetPath();
+	File.Close();
+	unlink(Path.c_str());
+}
+
+void StagedChangeT::Write(uint64_t Offset, uint8_t const *Data, size_t Length)
+{
+	if (Length == 0) return;
+	File.Write(Offset, Data, Length);
+
+	// Merge the new range with any it overlaps or touches
+	uint64_t Start = Offset;
+	uint64_t End = Offset + Length;
+	auto First = std::lower_bound(
+		Ranges.begin(),
+		Ranges.end(),
+		Start,
+		[](StagedRangeT const &Range, uint64_t Start) { return Range.Offset() + Range.Length() < Start; });
+	auto Last = First;
+	while ((Last != Ranges.end()) && (Last->Offset() <= End))
+	{
+		Start = std::min(Start, Last->Offset());
+		End = std::max(End, Last->Offset() + Last->Length());
+		++Last;
+	}
+	First = Ranges.erase(First, Last);
+	Ranges.insert(First, StagedRangeT(Start, End - Start));
+}
+
+GlobalChangeIDT const &StagedChangeT::GetChangeID(void) const
+	{ return ChangeID; }
+
+StagedT StagedChangeT::Describe(void) const
+	{ return StagedT(Stage, Truncate, Ranges, FormatHash(HashStaged(File, Ranges))); }
+
+HashT HashStaged(FileDescriptorT const &File, std::vector<StagedRangeT> const &Ranges)
+{
+	constexpr size_t BufferSize = 1 << 20;
+	HashStreamT Hash;
+	std::vector<uint8_t> Buffer;
+	for (auto const &Range : Ranges)
+	{
+		auto const End = Range.Offset() + Range.Length();
+		for (auto Offset = Range.Offset(); Offset < End; Offset += BufferSize)
+		{
+			Buffer.resize(static_cast<size_t>(std::min<uint64_t>(BufferSize, End - Offset)));
+			if (File.Read(Offset, Buffer.data(), Buffer.size()) < Buffer.size())
+				throw SYSTEM_ERROR << "Staging file " << File.GetPath() << " is missing staged bytes";
+			Hash.Add(Buffer.data(), Buffer.size());
+		}
+	}
+	return Hash.Finish();
+}
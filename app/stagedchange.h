@@ -0,0 +1,44 @@
+#ifndef stagedchange_h
+#define stagedchange_h
+
+#include <vector>
+
+#include "filedescriptor.h"
+#include "types.h"
+#include "structtypes.h"
+#include "md5/hash.h"
+
+// Storage changes for one change, written to a staging file a piece at a time rather than held in memory.
+// Commit with CoreT::DefineChange; the staging file is deleted if the stage is dropped without committing.
+struct StagedChangeT
+{
+	StagedChangeT(StagedChangeT &&Other) = default;
+	StagedChangeT(StagedChangeT const &) = delete;
+	StagedChangeT &operator =(StagedChangeT const &) = delete;
+	~StagedChangeT(void);
+
+	// Later writes win where they overlap earlier ones
+	void Write(uint64_t Offset, uint8_t const *Data, size_t Length);
+
+	GlobalChangeIDT const &GetChangeID(void) const;
+
+	// Describes the staged writes for the journal.  Reads the staged bytes back to checksum them.
+	StagedT Describe(void) const;
+
+	friend struct CoreT;
+	private:
+		StagedChangeT(GlobalChangeIDT const &ChangeID, uint64_t Stage, bool Truncate, std::string const &Path);
+
+		GlobalChangeIDT ChangeID;
+		uint64_t Stage;
+		bool Truncate;
+		FileDescriptorT File;
+		// Sorted, not overlapping or touching
+		std::vector<StagedRangeT> Ranges;
+};
+
+// Hash of the bytes of Ranges in File, in order
+HashT HashStaged(FileDescriptorT const &File, std::vector<StagedRangeT> const &Ranges);
+
+#endif
+
@@ -0,0 +1,165 @@
+#include "storagecopy.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "filedescriptor.h"
+
+constexpr size_t BufferedCopySize = 1 << 20;
+
+char const *FormatCopyStrategy(CopyStrategyT Strategy)
+{
+	switch (Strategy)
+	{
+		case CopyStrategyT::Reflink: return "reflink";
+		case CopyStrategyT::CopyFileRange: return "copy_file_range";
+		case CopyStrategyT::Buffered: return "buffered";
+		default: return "unknown";
+	}
+}
+
+CopyStatsT::CopyStatsT(void)
+{
+	Counts.fill(0);
+	Durations.fill(std::chrono::microseconds(0));
+}
+
+void CopyStatsT::Record(CopyResultT const &Result)
+{
+	Counts[(size_t)Result.Strategy] += 1;
+	Durations[(size_t)Result.Strategy] += Result.Duration;
+}
+
+uint64_t CopyStatsT::Count(void) const
+{
+	uint64_t Out = 0;
+	for (auto const Count : Counts) Out += Count;
+	return Out;
+}
+
+uint64_t CopyStatsT::Count(CopyStrategyT Strategy) const
+	{ return Counts[(size_t)Strategy]; }
+
+std::chrono::microseconds CopyStatsT::Duration(CopyStrategyT Strategy) const
+	{ return Durations[(size_t)Strategy]; }
+
+// Errors that mean "this strategy isn't available here", as opposed to real io failures
+static bool IsUnsupported(int Error)
+{
+	return
+		(Error == EOPNOTSUPP) ||
+		(Error == ENOTTY) ||
+		(Error == ENOSYS) ||
+		(Error == EXDEV) ||
+		(Error == EINVAL);
+}
+
+static void BufferedCopy(FileDescriptorT const &From, FileDescriptorT const &To, uint64_t Offset, uint64_t End)
+{
+	std::vector<uint8_t> Buffer(BufferedCopySize);
+#if defined(__linux__)
+	posix_fadvise(*From, Offset, End - Offset, POSIX_FADV_SEQUENTIAL);
+#endif
+	while (Offset < End)
+	{
+		auto const Read = From.Read(Offset, &Buffer[0], std::min<uint64_t>(Buffer.size(), End - Offset));
+		if (Read == 0) break;
+		To.Write(Offset, &Buffer[0], Read);
+		Offset += Read;
+	}
+}
+
+struct DataRangeT
+{
+	uint64_t Start;
+	uint64_t End;
+};
+
+// The allocated ranges of File, or the whole file if the filesystem can't report holes
+static std::vector<DataRangeT> ListData(FileDescriptorT const &File, uint64_t Size)
+{
+	std::vector<DataRangeT> Out;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	uint64_t Offset = 0;
+	while (Offset < Size)
+	{
+		auto const Data = lseek(*File, Offset, SEEK_DATA);
+		if (Data < 0)
+		{
+			// Only a hole remains
+			if (errno == ENXIO) return Out;
+			if (IsUnsupported(errno)) return {DataRangeT{0, Size}};
+			throw SYSTEM_ERROR << "Error finding data in " << File.GetPath() << ": " << strerror(errno);
+		}
+		auto Hole = lseek(*File, Data, SEEK_HOLE);
+		if (Hole < 0)
+			throw SYSTEM_ERROR << "Error finding holes in " << File.GetPath() << ": " << strerror(errno);
+		if (static_cast<uint64_t>(Hole) > Size) Hole = Size;
+		Out.push_back(DataRangeT{static_cast<uint64_t>(Data), static_cast<uint64_t>(Hole)});
+		Offset = Hole;
+	}
+	return Out;
+#else
+	if (Size > 0) Out.push_back(DataRangeT{0, Size});
+	return Out;
+#endif
+}
+
+CopyResultT CopyStorageFile(Filesystem::PathT const &From, Filesystem::PathT const &To, CopyStrategyT First)
+{
+	auto const Start = std::chrono::steady_clock::now();
+	FileDescriptorT Source(From, O_RDONLY);
+	FileDescriptorT Dest(To, O_WRONLY | O_CREAT | O_TRUNC);
+
+	uint64_t const Size = Source.Size();
+
+	auto Finish = [&](CopyStrategyT Strategy)
+	{
+		return CopyResultT{
+			Strategy,
+			Size,
+			std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Start)};
+	};
+
+#if defined(__linux__) && defined(FICLONE)
+	if (First == CopyStrategyT::Reflink)
+	{
+		if (ioctl(*Dest, FICLONE, *Source) == 0) return Finish(CopyStrategyT::Reflink);
+		if (!IsUnsupported(errno) && (errno != EBADF) && (errno != EPERM))
+			throw SYSTEM_ERROR << "Error cloning " << From.Render() << " to " << To.Render() << ": " << strerror(errno);
+	}
+#endif
+
+	// Only the data ranges are copied; resizing at the end leaves the rest as holes
+	auto Strategy = std::max(First, CopyStrategyT::CopyFileRange);
+	for (auto const &Range : ListData(Source, Size))
+	{
+		uint64_t Offset = Range.Start;
+#if defined(__linux__) && defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 27)))
+		while ((Strategy == CopyStrategyT::CopyFileRange) && (Offset < Range.End))
+		{
+			loff_t SourceOffset = Offset;
+			loff_t DestOffset = Offset;
+			auto const Copied = copy_file_range(*Source, &SourceOffset, *Dest, &DestOffset, Range.End - Offset, 0);
+			if (Copied < 0)
+			{
+				if (errno == EINTR) continue;
+				if (IsUnsupported(errno)) { Strategy = CopyStrategyT::Buffered; break; }
+				throw SYSTEM_ERROR << "Error copying " << From.Render() << " to " << To.Render() << ": " << strerror(errno);
+			}
+			if (Copied == 0) break;
+			Offset += Copied;
+		}
+#else
+		Strategy = CopyStrategyT::Buffered;
+#endif
+		BufferedCopy(Source, Dest, Offset, Range.End);
+	}
+	Dest.Resize(Size);
+	return Finish(Strategy);
+}
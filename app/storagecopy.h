@@ -0,0 +1,49 @@
+#ifndef storagecopy_h
+#define storagecopy_h
+
+#include <array>
+#include <chrono>
+
+#include "../ren-cxx-filesystem/path.h"
+
+enum class CopyStrategyT : unsigned int
+{
+	Reflink = 0,
+	CopyFileRange,
+	Buffered,
+	End
+};
+
+char const *FormatCopyStrategy(CopyStrategyT Strategy);
+
+struct CopyResultT
+{
+	CopyStrategyT Strategy;
+	uint64_t Size;
+	std::chrono::microseconds Duration;
+};
+
+struct CopyStatsT
+{
+	CopyStatsT(void);
+	void Record(CopyResultT const &Result);
+	uint64_t Count(void) const;
+	uint64_t Count(CopyStrategyT Strategy) const;
+	std::chrono::microseconds Duration(CopyStrategyT Strategy) const;
+
+	private:
+		std::array<uint64_t, (size_t)CopyStrategyT::End> Counts;
+		std::array<std::chrono::microseconds, (size_t)CopyStrategyT::End> Durations;
+};
+
+// Creates To as a copy of From, replacing any existing file.
+// Tries to share extents (FICLONE), then in-kernel copying (copy_file_range), then falls back to a plain read/write loop.
+// Without extent sharing only the data ranges (SEEK_DATA/SEEK_HOLE) are copied, so holes in From stay holes in To.
+// First skips the strategies before it.
+CopyResultT CopyStorageFile(
+	Filesystem::PathT const &From, 
+	Filesystem::PathT const &To, 
+	CopyStrategyT First = CopyStrategyT::Reflink);
+
+#endif
+
@@ -0,0 +1,177 @@
+#include "storagereader.h"
+
+#include <algorithm>
+
+constexpr size_t SequentialReadSize = 64 * 1024;
+constexpr size_t MaxOpenSources = 16;
+
+DescriptorCacheT::DescriptorCacheT(size_t Capacity) : Descriptors(Capacity) {}
+
+std::shared_ptr<FileDescriptorT const> DescriptorCacheT::Open(std::string const &Path)
+{
+	if (auto Found = Descriptors.Find(Path)) return *Found;
+	return Descriptors.Insert(Path, std::make_shared<FileDescriptorT const>(Path, O_RDONLY));
+}
+
+void DescriptorCacheT::Forget(Filesystem::PathT const &Path)
+	{ Descriptors.Erase(Path.Render()); }
+
+uint64_t DescriptorCacheT::GetHits(void) const
+	{ return Descriptors.GetHits(); }
+
+uint64_t DescriptorCacheT::GetMisses(void) const
+	{ return Descriptors.GetMisses(); }
+
+StorageReaderT::StorageReaderT(void) : Cache(nullptr), Position(0) {}
+
+StorageReaderT StorageReaderT::OpenFile(Filesystem::PathT const &Path, DescriptorCacheT *Cache)
+{
+	StorageReaderT Out;
+	auto const Rendered = Path.Render();
+	std::shared_ptr<FileDescriptorT const> Descriptor;
+	if (Cache) 
+	{
+		Out.UseCache(*Cache);
+		Descriptor = Cache->Open(Rendered);
+	}
+	else Descriptor = std::make_shared<FileDescriptorT const>(Rendered, O_RDONLY);
+	auto const Size = Descriptor->Size();
+	Out.Append(Rendered, 0, Size);
+	Out.Sources.back().Descriptor = std::move(Descriptor);
+	Out.OpenSources.push_back(0);
+	return Out;
+}
+
+void StorageReaderT::UseCache(DescriptorCacheT &Cache)
+	{ this->Cache = &Cache; }
+
+void StorageReaderT::Append(Filesystem::PathT const &Source, uint64_t SourceOffset, uint64_t Length)
+	{ Append(Source.Render(), SourceOffset, Length); }
+
+void StorageReaderT::Append(StorageReaderT const &Other, uint64_t Offset, uint64_t Length)
+{
+	auto const End = Offset + Length;
+	AssertLTE(End, Other.Size());
+	for (auto const &Extent : Other.Extents)
+	{
+		auto const Start = std::max(Offset, Extent.Offset);
+		auto const Stop = std::min(End, Extent.Offset + Extent.Length);
+		if (Start >= Stop) continue;
+		if (Extent.Source == ZeroSource) AppendZeros(Stop - Start);
+		else if (Extent.Source == MemorySource) AppendBytes(
+			&Other.Memory[Extent.SourceOffset + (Start - Extent.Offset)], 
+			static_cast<size_t>(Stop - Start));
+		else Append(
+			Other.Sources[Extent.Source].Path, 
+			Extent.SourceOffset + (Start - Extent.Offset), 
+			Stop - Start);
+	}
+}
+
+void StorageReaderT::AppendZeros(uint64_t Length)
+	{ AppendExtent(ZeroSource, 0, Length); }
+
+void StorageReaderT::AppendBytes(uint8_t const *Data, size_t Length)
+{
+	auto const SourceOffset = Memory.size();
+	Memory.insert(Memory.end(), Data, Data + Length);
+	AppendExtent(MemorySource, SourceOffset, Length);
+}
+
+void StorageReaderT::Append(std::string const &Source, uint64_t SourceOffset, uint64_t Length)
+{
+	auto Found = SourceIndices.find(Source);
+	size_t SourceIndex;
+	if (Found == SourceIndices.end())
+	{
+		SourceIndex = Sources.size();
+		SourceIndices.emplace(Source, SourceIndex);
+		Sources.push_back(SourceT{Source, nullptr});
+	}
+	else SourceIndex = Found->second;
+	AppendExtent(SourceIndex, SourceOffset, Length);
+}
+
+void StorageReaderT::AppendExtent(size_t Source, uint64_t SourceOffset, uint64_t Length)
+{
+	if (Length == 0) return;
+	if (!Extents.empty() &&
+		(Extents.back().Source == Source) &&
+		((Source == ZeroSource) || (Extents.back().SourceOffset + Extents.back().Length == SourceOffset)))
+	{
+		Extents.back().Length += Length;
+		return;
+	}
+	Extents.push_back(ExtentT{Size(), Length, Source, SourceOffset});
+}
+
+uint64_t StorageReaderT::Size(void) const
+{
+	if (Extents.empty()) return 0;
+	return Extents.back().Offset + Extents.back().Length;
+}
+
+size_t StorageReaderT::Read(uint64_t Offset, uint8_t *Out, size_t Length)
+{
+	size_t Total = 0;
+	auto Extent = std::upper_bound(
+		Extents.begin(),
+		Extents.end(),
+		Offset,
+		[](uint64_t Offset, ExtentT const &Extent) { return Offset < Extent.Offset; });
+	if (Extent == Extents.begin()) return 0;
+	--Extent;
+	for (; (Extent != Extents.end()) && (Total < Length); ++Extent)
+	{
+		auto const Start = Offset + Total;
+		if (Start >= Extent->Offset + Extent->Length) continue;
+		auto const Within = Start - Extent->Offset;
+		auto const Want = static_cast<size_t>(std::min<uint64_t>(Length - Total, Extent->Length - Within));
+		if (Extent->Source == ZeroSource)
+		{
+			std::fill(Out + Total, Out + Total + Want, 0);
+			Total += Want;
+			continue;
+		}
+		if (Extent->Source == MemorySource)
+		{
+			auto const From = Memory.begin() + (Extent->SourceOffset + Within);
+			std::copy(From, From + Want, Out + Total);
+			Total += Want;
+			continue;
+		}
+		auto const Got = GetDescriptor(Extent->Source).Read(Extent->SourceOffset + Within, Out + Total, Want);
+		if (Got < Want)
+			throw SYSTEM_ERROR << "Storage file " << Sources[Extent->Source].Path << " is shorter than expected";
+		Total += Got;
+	}
+	return Total;
+}
+
+bool StorageReaderT::Read(std::vector<uint8_t> &Buffer)
+{
+	Buffer.resize(SequentialReadSize);
+	auto const Got = Read(Position, &Buffer[0], Buffer.size());
+	Buffer.resize(Got);
+	Position += Got;
+	return Got > 0;
+}
+
+void StorageReaderT::Seek(uint64_t Offset)
+	{ Position = Offset; }
+
+FileDescriptorT const &StorageReaderT::GetDescriptor(size_t Source)
+{
+	auto &Found = Sources[Source];
+	if (Found.Descriptor) return *Found.Descriptor;
+	if (OpenSources.size() >= MaxOpenSources)
+	{
+		Sources[OpenSources.front()].Descriptor.reset();
+		OpenSources.erase(OpenSources.begin());
+	}
+	if (Cache) Found.Descriptor = Cache->Open(Found.Path);
+	else Found.Descriptor = std::make_shared<FileDescriptorT const>(Found.Path, O_RDONLY);
+	OpenSources.push_back(Source);
+	return *Found.Descriptor;
+}
+
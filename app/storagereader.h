@@ -0,0 +1,96 @@
+#ifndef storagereader_h
+#define storagereader_h
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "../ren-cxx-filesystem/path.h"
+#include "filedescriptor.h"
+#include "lrucache.h"
+
+// Read only descriptors shared between readers, so opening the same storage repeatedly doesn't reopen its
+// files.  Evicted descriptors stay open until the last reader using them lets go.
+struct DescriptorCacheT
+{
+	DescriptorCacheT(size_t Capacity);
+
+	std::shared_ptr<FileDescriptorT const> Open(std::string const &Path);
+
+	// Call when the file at Path is replaced or deleted
+	void Forget(Filesystem::PathT const &Path);
+
+	uint64_t GetHits(void) const;
+	uint64_t GetMisses(void) const;
+
+	private:
+		LRUCacheT<std::string, std::shared_ptr<FileDescriptorT const>> Descriptors;
+};
+
+// Reads the contents of one storage, which may be assembled from pieces of several files and memory.
+// Descriptors are opened lazily and at most a few are kept open at once.
+struct StorageReaderT
+{
+	StorageReaderT(void);
+	StorageReaderT(StorageReaderT &&Other) = default;
+	StorageReaderT &operator =(StorageReaderT &&Other) = default;
+
+	static StorageReaderT OpenFile(Filesystem::PathT const &Path, DescriptorCacheT *Cache = nullptr);
+
+	// Get descriptors from Cache, which must outlive the reader
+	void UseCache(DescriptorCacheT &Cache);
+
+	// Extend the storage with Length bytes of Source starting at SourceOffset
+	void Append(Filesystem::PathT const &Source, uint64_t SourceOffset, uint64_t Length);
+
+	// Extend the storage with Length bytes of Other starting at Offset
+	void Append(StorageReaderT const &Other, uint64_t Offset, uint64_t Length);
+
+	// Extend the storage with Length zero bytes
+	void AppendZeros(uint64_t Length);
+
+	// Extend the storage with a copy of Length bytes at Data
+	void AppendBytes(uint8_t const *Data, size_t Length);
+
+	uint64_t Size(void) const;
+
+	// Returns the number of bytes read, which is only less than Length at the end of the storage
+	size_t Read(uint64_t Offset, uint8_t *Out, size_t Length);
+
+	// Sequential reads, like FileT.  Returns false once the end of the storage is reached.
+	bool Read(std::vector<uint8_t> &Buffer);
+	void Seek(uint64_t Offset);
+
+	private:
+		struct SourceT
+		{
+			std::string Path;
+			std::shared_ptr<FileDescriptorT const> Descriptor;
+		};
+
+		struct ExtentT
+		{
+			uint64_t Offset;
+			uint64_t Length;
+			size_t Source;
+			uint64_t SourceOffset;
+		};
+
+		static constexpr size_t ZeroSource = static_cast<size_t>(-1);
+		static constexpr size_t MemorySource = static_cast<size_t>(-2);
+
+		void Append(std::string const &Source, uint64_t SourceOffset, uint64_t Length);
+		void AppendExtent(size_t Source, uint64_t SourceOffset, uint64_t Length);
+		FileDescriptorT const &GetDescriptor(size_t Source);
+
+		std::vector<SourceT> Sources;
+		std::unordered_map<std::string, size_t> SourceIndices;
+		std::vector<ExtentT> Extents;
+		std::vector<uint8_t> Memory;
+		std::vector<size_t> OpenSources;
+		DescriptorCacheT *Cache;
+		uint64_t Position;
+};
+
+#endif
+
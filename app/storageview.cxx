@@ -0,0 +1,51 @@
+#include "storageview.h"
+
+#include <sys/mman.h>
+
+StorageViewT::StorageViewT(void) : Start(nullptr), Length(0) {}
+
+StorageViewT StorageViewT::MapFile(FileDescriptorT const &File, uint64_t Offset, uint64_t Length, MapAccessT Access)
+{
+	StorageViewT Out;
+	if (Length == 0) return Out;
+
+	// Mappings have to start on a page boundary
+	static uint64_t const PageSize = sysconf(_SC_PAGESIZE);
+	auto const Skip = Offset % PageSize;
+	auto const MapLength = static_cast<size_t>(Skip + Length);
+	auto Base = mmap(nullptr, MapLength, PROT_READ, MAP_SHARED, *File, Offset - Skip);
+	if (Base == MAP_FAILED)
+		throw SYSTEM_ERROR << "Could not map " << File.GetPath() << ": " << strerror(errno);
+	Out.Holder = std::shared_ptr<void const>(Base, [MapLength](void const *Base) 
+		{ munmap(const_cast<void *>(Base), MapLength); });
+
+	int Advice = MADV_NORMAL;
+	if (Access == MapAccessT::Sequential) Advice = MADV_SEQUENTIAL;
+	else if (Access == MapAccessT::Random) Advice = MADV_RANDOM;
+	// Only a hint, so failing is harmless
+	madvise(Base, MapLength, Advice);
+
+	Out.Start = static_cast<uint8_t const *>(Base) + Skip;
+	Out.Length = Length;
+	return Out;
+}
+
+StorageViewT StorageViewT::Copy(StorageReaderT &Reader)
+{
+	StorageViewT Out;
+	auto Buffer = std::make_shared<std::vector<uint8_t>>(Reader.Size());
+	if (Buffer->empty()) return Out;
+	if (Reader.Read(0, Buffer->data(), Buffer->size()) < Buffer->size())
+		throw SYSTEM_ERROR << "Storage was truncated while copying it";
+	Out.Start = Buffer->data();
+	Out.Length = Buffer->size();
+	Out.Holder = std::move(Buffer);
+	return Out;
+}
+
+uint8_t const *StorageViewT::Data(void) const
+	{ return Start; }
+
+uint64_t StorageViewT::Size(void) const
+	{ return Length; }
+
@@ -0,0 +1,38 @@
+#ifndef storageview_h
+#define storageview_h
+
+#include <memory>
+
+#include "filedescriptor.h"
+#include "storagereader.h"
+
+enum class MapAccessT
+{
+	Normal,
+	Sequential, // Read ahead aggressively and drop pages behind the reader
+	Random, // Don't read ahead
+};
+
+// Read only view of the whole contents of one storage.  Copies share the mapping, which is unmapped with the
+// last copy.  Like a reader, the view is only valid until the storage changes.
+struct StorageViewT
+{
+	StorageViewT(void);
+
+	// Map Length bytes of File starting at Offset
+	static StorageViewT MapFile(FileDescriptorT const &File, uint64_t Offset, uint64_t Length, MapAccessT Access);
+
+	// For storage assembled from several sources, which can't be mapped as one range
+	static StorageViewT Copy(StorageReaderT &Reader);
+
+	uint8_t const *Data(void) const;
+	uint64_t Size(void) const;
+
+	private:
+		std::shared_ptr<void const> Holder;
+		uint8_t const *Start;
+		uint64_t Length;
+};
+
+#endif
+
@@ -65,6 +65,15 @@ return
 			},
 		},
 
+		{
+			name = 'DirHeadKeyT',
+			elements = 
+			{
+				{ 'Filename', 'std::string', },
+				{ 'ChangeID', 'GlobalChangeIDT', },
+			},
+		},
+
 		{
 			name = 'MissingT',
 			elements = 
@@ -84,6 +93,46 @@ return
 			},
 		},
 		
+		{
+			name = 'StorageChunkT',
+			elements =
+			{
+				{ 'Offset', 'uint64_t', },
+				{ 'Size', 'uint64_t', },
+				{ 'Hash', 'std::string', },
+			},
+		},
+		
+		{
+			name = 'OverlayExtentT',
+			elements =
+			{
+				{ 'Offset', 'uint64_t', },
+				{ 'Length', 'uint64_t', },
+				{ 'DataOffset', 'uint64_t', },
+			},
+		},
+		
+		{
+			name = 'PackLocationT',
+			elements =
+			{
+				{ 'Segment', 'SegmentIndexT', },
+				{ 'Offset', 'uint64_t', },
+				{ 'Length', 'uint64_t', },
+			},
+		},
+		
+		{
+			name = 'PackSegmentT',
+			elements =
+			{
+				{ 'Segment', 'SegmentIndexT', },
+				{ 'Size', 'uint64_t', },
+				{ 'LiveBytes', 'uint64_t', },
+			},
+		},
+		
 		------------------------
 		-- Misc
 		{
@@ -99,6 +148,43 @@ return
 			name = 'TruncateT',
 			elements = {},
 		},
+
+		{
+			name = 'ResizeT',
+			elements = 
+			{
+				{ 'Length', 'uint64_t', },
+			},
+		},
+
+		{
+			name = 'PunchHoleT',
+			elements = 
+			{
+				{ 'Offset', 'uint64_t', },
+				{ 'Length', 'uint64_t', },
+			},
+		},
+
+		{
+			name = 'StagedRangeT',
+			elements = 
+			{
+				{ 'Offset', 'uint64_t', },
+				{ 'Length', 'uint64_t', },
+			},
+		},
+
+		{
+			name = 'StagedT',
+			elements = 
+			{
+				{ 'Stage', 'uint64_t', },
+				{ 'Truncate', 'bool', },
+				{ 'Ranges', 'std::vector<StagedRangeT>', },
+				{ 'Checksum', 'std::string', },
+			},
+		},
 	},
 }
 
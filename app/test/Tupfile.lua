@@ -8,7 +8,7 @@ do
 		Sources = Item(Source),
 		BuildExtras = GeneratedHeaders,
 		Objects = CoreObjects,
-		LinkFlags = '-lsqlite3 -lluxem-cxx',
+		LinkFlags = '-lsqlite3 -lluxem-cxx -pthread',
 	}
 
 	--[[Define.Test
@@ -18,6 +18,10 @@
 // 4. initial a new core
 // 5. verify state
 
+#include <atomic>
+#include <random>
+#include <thread>
+
 #include "../../ren-cxx-basics/stricttype.h"
 #include "../../ren-cxx-basics/variant.h"
 #include "../../ren-cxx-filesystem/path.h"
@@ -32,7 +36,8 @@ template <typename CallbackT>
 bool FrameInner(
 	CallbackT const &Callback, 
 	VariantT<NormalRunT, IOStepsT> const &Control, 
-	std::shared_ptr<ClunkerControlT> &Clunker)
+	std::shared_ptr<ClunkerControlT> &Clunker,
+	CoreSettingsT const &Settings)
 {
 	constexpr size_t ListSize = 10;
 
@@ -54,7 +59,7 @@ bool FrameInner(
 
 	std::cout << "  - primary" << std::endl;
 	{
-		CoreT Core({"test"}, Root);
+		CoreT Core({"test"}, Root, Settings);
 		FinallyT Finally([&](void)
 		{
 			Core.DumpGraphviz("post.dot");
@@ -64,31 +69,44 @@ bool FrameInner(
 		{
 			Assert(Clunker->SetOpCount(*Control.Get<IOStepsT>()).get());
 		}
-		try { Callback(Core); } catch (...) {}
+		try { Callback(Core); } 
+		catch (...) 
+		{ 
+			// Clunker runs cut the callback off partway on purpose
+			if (Control.Is<NormalRunT>()) throw; 
+		}
 		if (Control.Is<NormalRunT>())
 		{
 			Assert(Core.Validate());
 			while (true)
 			{
-				auto Missings = Core.ListMissing(OriginalMissings.size(), ListSize);
+				auto Missings = Core.ListMissing(
+					OriginalMissings.empty() ? OptionalT<GlobalChangeIDT>() : OriginalMissings.back().ChangeID(), 
+					ListSize);
 				OriginalMissings.insert(OriginalMissings.end(), Missings.begin(), Missings.end());
 				if (Missings.size() < ListSize) break;
 			} 
 			while (true)
 			{
-				auto Heads = Core.ListHeads(OriginalHeads.size(), ListSize);
+				auto Heads = Core.ListHeads(
+					OriginalHeads.empty() ? OptionalT<GlobalChangeIDT>() : OriginalHeads.back().ChangeID(), 
+					ListSize);
 				OriginalHeads.insert(OriginalHeads.end(), Heads.begin(), Heads.end());
 				if (Heads.size() < ListSize) break;
 			} 
 			while (true)
 			{
-				auto Changes = Core.ListChanges(OriginalChanges.size(), ListSize);
+				auto Changes = Core.ListChanges(
+					OriginalChanges.empty() ? OptionalT<GlobalChangeIDT>() : OriginalChanges.back().ChangeID(), 
+					ListSize);
 				OriginalChanges.insert(OriginalChanges.end(), Changes.begin(), Changes.end());
 				if (Changes.size() < ListSize) break;
 			} 
 			while (true)
 			{
-				auto Storage = Core.ListStorage(OriginalStorage.size(), ListSize);
+				auto Storage = Core.ListStorage(
+					OriginalStorage.empty() ? OptionalT<StorageIDT>() : OriginalStorage.back().StorageID(), 
+					ListSize);
 				OriginalStorage.insert(OriginalStorage.end(), Storage.begin(), Storage.end());
 				if (Storage.size() < ListSize) break;
 			} 
@@ -104,16 +122,17 @@ bool FrameInner(
 	
 	std::cout << "  - secondary" << std::endl;
 	{
-		CoreT Core({"test"}, Root);
+		CoreT Core({"test"}, Root, Settings);
 		AssertE(Core.GetThisInstance(), 1u);
 		Assert(Core.Validate());
 		if (Control.Is<NormalRunT>())
 		{
 			{
 				size_t Offset = 0;
+				OptionalT<GlobalChangeIDT> Last;
 				while (true)
 				{
-					auto NewMissing = Core.ListMissing(Offset, 10);
+					auto NewMissing = Core.ListMissing(Last, 10);
 					if (NewMissing.empty()) break;
 					for (auto const &Missing : NewMissing)
 					{
@@ -121,14 +140,16 @@ bool FrameInner(
 						AssertE(Missing, OriginalMissings[Offset++]);
 					}
 					if (NewMissing.size() < ListSize) break;
+					Last = NewMissing.back().ChangeID();
 				} 
 				AssertE(Offset, OriginalMissings.size());
 			}
 			{
 				size_t Offset = 0;
+				OptionalT<GlobalChangeIDT> Last;
 				while (true)
 				{
-					auto NewHeads = Core.ListHeads(Offset, 10);
+					auto NewHeads = Core.ListHeads(Last, 10);
 					if (NewHeads.empty()) break;
 					for (auto const &Head : NewHeads)
 					{
@@ -136,14 +157,16 @@ bool FrameInner(
 						AssertE(Head, OriginalHeads[Offset++]);
 					}
 					if (NewHeads.size() < ListSize) break;
+					Last = NewHeads.back().ChangeID();
 				} 
 				AssertE(Offset, OriginalHeads.size());
 			}
 			{
 				size_t Offset = 0;
+				OptionalT<GlobalChangeIDT> Last;
 				while (true)
 				{
-					auto NewChanges = Core.ListChanges(Offset, 10);
+					auto NewChanges = Core.ListChanges(Last, 10);
 					if (NewChanges.empty()) break;
 					for (auto const &Change : NewChanges)
 					{
@@ -151,14 +174,16 @@ bool FrameInner(
 						AssertE(Change, OriginalChanges[Offset++]);
 					}
 					if (NewChanges.size() < ListSize) break;
+					Last = NewChanges.back().ChangeID();
 				} 
 				AssertE(Offset, OriginalChanges.size());
 			}
 			{
 				size_t Offset = 0;
+				OptionalT<StorageIDT> Last;
 				while (true)
 				{
-					auto NewStorage = Core.ListStorage(Offset, 10);
+					auto NewStorage = Core.ListStorage(Last, 10);
 					if (NewStorage.empty()) break;
 					for (auto const &Storage : NewStorage)
 					{
@@ -166,6 +191,7 @@ bool FrameInner(
 						AssertE(Storage, OriginalStorage[Offset++]);
 					}
 					if (NewStorage.size() < ListSize) break;
+					Last = NewStorage.back().StorageID();
 				} 
 				AssertE(Offset, OriginalStorage.size());
 			}
@@ -181,18 +207,21 @@ bool FrameInner(
 
 int TestLabelCount = 1;
 template <typename CallbackT> 
-	void Frame(CallbackT const &Callback, std::shared_ptr<ClunkerControlT> &Clunker)
+	void Frame(
+		CallbackT const &Callback, 
+		std::shared_ptr<ClunkerControlT> &Clunker, 
+		CoreSettingsT const &Settings)
 {
 	std::cout << "--- TEST " << TestLabelCount++ << " ---" << std::endl;
 	std::cout << " == plain == " << std::endl;
-	FrameInner(Callback, NormalRunT(), Clunker);
+	FrameInner(Callback, NormalRunT(), Clunker, Settings);
 	if (Clunker)
 	{
 		auto Steps = IOStepsT(0u);
 		while (true) 
 		{
 			std::cout << " == steps " << Steps << " == " << std::endl;
-			if (!FrameInner(Callback, Steps++, Clunker)) break;
+			if (!FrameInner(Callback, Steps++, Clunker, Settings)) break;
 		}
 	}
 }
@@ -200,11 +229,52 @@ template <typename CallbackT>
 void CompareStorage(CoreT &Core, StorageIDT const &Storage, std::string const &Comparison)
 {
 	auto Handle = Core.Open(Storage);
-	ReadBufferT Buffer;
-	while (Handle.Read(Buffer)) {}
-	AssertE(std::string((char const *)Buffer.FilledStart(Comparison.size()), Comparison.size()), Comparison);
+	std::string Contents;
+	std::vector<uint8_t> Buffer;
+	while (Handle.Read(Buffer)) Contents.append(Buffer.begin(), Buffer.end());
+	AssertE(Contents, Comparison);
+	auto const View = Core.Map(Storage);
+	AssertE(std::string(View.Data(), View.Data() + View.Size()), Comparison);
+	Assert(Core.HashStorage(Storage) == HashString(Comparison));
 }
 	
+// Transaction handler that throws from every message
+struct FailingHandlerT
+{
+	size_t Handled = 0;
+
+	template <typename MessageT, typename ...ArgumentsT> void Handle(MessageT, ArgumentsT const &...)
+	{
+		++Handled;
+		throw SYSTEM_ERROR << "Failing on purpose";
+	}
+};
+typedef TransactorT<
+	FailingHandlerT, 
+	CTV1AddChange, 
+	CTV1UpdateDeleteHead, 
+	CTV1FlattenStorage, 
+	CTV1CompactSegment,
+	CTV2AddChange, 
+	CTV2UpdateDeleteHead> FailingTransactorT;
+
+// Transaction handler that counts the messages it's given
+struct CountingHandlerT
+{
+	size_t Handled = 0;
+
+	template <typename MessageT, typename ...ArgumentsT> void Handle(MessageT, ArgumentsT const &...)
+		{ ++Handled; }
+};
+typedef TransactorT<
+	CountingHandlerT, 
+	CTV1AddChange, 
+	CTV1UpdateDeleteHead, 
+	CTV1FlattenStorage, 
+	CTV1CompactSegment,
+	CTV2AddChange, 
+	CTV2UpdateDeleteHead> CountingTransactorT;
+
 auto Now = time(nullptr);
 
 auto const Comparison1 = std::string("hellog");
@@ -274,15 +344,44 @@ int main(void)
 			Clunker = std::move(ClunkerFuture.get());
 		}
 
-		auto Frame = [&Clunker](auto &&Callback)
+		auto Frame = [&Clunker](auto &&Callback, CoreSettingsT const &Settings = CoreSettingsT())
 		{
-			::Frame(std::move(Callback), Clunker);
+			::Frame(std::move(Callback), Clunker, Settings);
 		};
 
+		CoreSettingsT Chunked;
+		Chunked.ChunkStorage = true;
+		Chunked.Chunks.MinSize = 256;
+		Chunked.Chunks.AverageSize = 1024;
+		Chunked.Chunks.MaxSize = 4096;
+
+		CoreSettingsT Overlaid;
+		Overlaid.OverlayStorage = true;
+		Overlaid.MaxOverlayDepth = 2;
+
+		CoreSettingsT Packed;
+		Packed.PackStorage = true;
+		Packed.Packs.MaxObjectSize = 16;
+		Packed.Packs.SegmentSize = 32;
+
+		CoreSettingsT Inlined;
+		Inlined.InlineStorage = true;
+		Inlined.MaxInlineSize = 8;
+
+		CoreSettingsT Staged;
+		Staged.MaxJournaledBytes = 0;
+
+		CoreSettingsT Checkpointed;
+		Checkpointed.Journal.CheckpointSize = 0;
+		Checkpointed.Journal.CommitWindow = std::chrono::microseconds(100);
+
+		CoreSettingsT Intents;
+		Intents.DatabaseJournal = true;
+
 		// Creation
 		Frame([](CoreT &Core) 
 		{
-			AssertE(Core.ListChanges(0, 10).size(), 0u);
+			AssertE(Core.ListChanges({}, 10).size(), 0u);
 		});
 
 		// Create new file, reopen
@@ -297,7 +396,7 @@ int main(void)
 				Core.AddChange(ChangeT{ChangeID, {}});
 			}
 
-			auto Changes = Core.ListChanges(0, 10);
+			auto Changes = Core.ListChanges({}, 10);
 			AssertE(Changes.size(), 1u);
 			AssertE(Changes[0].ChangeID(), ChangeID);
 			Assert(!Core.GetHead(ChangeID));
@@ -316,7 +415,7 @@ int main(void)
 				Core.DefineChange(ChangeID, DefineHeadT(AddData1, Meta1));
 			}
 
-			auto Changes = Core.ListChanges(0, 10);
+			auto Changes = Core.ListChanges({}, 10);
 			AssertE(Changes.size(), 1u);
 			AssertE(Changes[0], ChangeT(ChangeID, {}));
 			auto Head = Core.GetHead(ChangeID);
@@ -329,13 +428,13 @@ int main(void)
 			AssertE(Head->Meta().Writable(), true);
 			AssertE(Head->Meta().Executable(), false);
 
-			auto Heads = Core.ListDirHeads({}, 0, 10);
+			auto Heads = Core.ListDirHeads({}, {}, 10);
 			AssertE(Heads.size(), 1u);
 			AssertE(Heads[0].ChangeID().NodeID(), Head->ChangeID().NodeID());
 		});
 
 		// Write to file, truncate file, write again, delete
-		Frame([](CoreT &Core) 
+		auto WriteTruncateDelete = [](CoreT &Core) 
 		{
 			GlobalChangeIDT ChangeID1, ChangeID2, ChangeID3, ChangeID4;
 			auto InstanceIndex = Core.GetThisInstance();
@@ -350,7 +449,7 @@ int main(void)
 				
 				StorageID1 = *Core.GetHead(ChangeID1)->StorageID();
 				CompareStorage(Core, StorageID1, "hellog");
-				AssertE(Core.ListStorage(0, 10).size(), 1u);
+				AssertE(Core.ListStorage({}, 10).size(), 1u);
 			}
 			{
 				ChangeID2 = GlobalChangeIDT(
@@ -367,7 +466,7 @@ int main(void)
 				StorageID2 = *Head->StorageID();
 				AssertE(StorageID2, StorageID1);
 				CompareStorage(Core, StorageID2, "");
-				auto AllStorage = Core.ListStorage(0, 10);
+				auto AllStorage = Core.ListStorage({}, 10);
 				AssertE(AllStorage.size(), 1u);
 			}
 			{
@@ -385,7 +484,7 @@ int main(void)
 				StorageID3 = *Head->StorageID();
 				AssertE(StorageID3, StorageID2);
 				CompareStorage(Core, StorageID3, "whipeanut diva");
-				auto AllStorage = Core.ListStorage(0, 10);
+				auto AllStorage = Core.ListStorage({}, 10);
 				AssertE(AllStorage.size(), 1u);
 			}
 			{
@@ -403,9 +502,10 @@ int main(void)
 					Assert(false);
 				}
 				catch (...) {}
-				AssertE(Core.ListStorage(0, 10).size(), 0u);
+				AssertE(Core.ListStorage({}, 10).size(), 0u);
 			}
-		});
+		};
+		Frame(WriteTruncateDelete);
 		
 		// Create directory, add file to directory
 		Frame([](CoreT &Core) 
@@ -420,12 +520,12 @@ int main(void)
 				Core.AddChange(ChangeT(ChangeID, {}));
 				Core.DefineChange(ChangeID, DefineHeadT({}, Meta1));
 
-				auto RootHeads = Core.ListDirHeads({}, 0, 10);
+				auto RootHeads = Core.ListDirHeads({}, {}, 10);
 				AssertE(RootHeads.size(), 1u);
 				AssertE(RootHeads[0].ChangeID().NodeID(), DirID);
-				auto SubHeads = Core.ListDirHeads(DirID, 0, 10);
+				auto SubHeads = Core.ListDirHeads(DirID, {}, 10);
 				AssertE(SubHeads.size(), 0u);
-				auto AllStorage = Core.ListStorage(0, 10);
+				auto AllStorage = Core.ListStorage({}, 10);
 				AssertE(AllStorage.size(), 0u);
 			}
 			{
@@ -439,19 +539,295 @@ int main(void)
 				FileMeta.DirID() = DirID;
 				Core.DefineChange(ChangeID, DefineHeadT(AddData1, FileMeta));
 				
-				auto RootHeads = Core.ListDirHeads({}, 0, 10);
+				auto RootHeads = Core.ListDirHeads({}, {}, 10);
 				AssertE(RootHeads.size(), 1u);
 				AssertE(RootHeads[0].ChangeID().NodeID(), DirID);
-				auto SubHeads = Core.ListDirHeads(DirID, 0, 10);
+				auto SubHeads = Core.ListDirHeads(DirID, {}, 10);
 				AssertE(SubHeads.size(), 1u);
 				AssertE(SubHeads[0].ChangeID(), ChangeID);
-				auto AllStorage = Core.ListStorage(0, 10);
+				auto AllStorage = Core.ListStorage({}, 10);
 				AssertE(AllStorage.size(), 1u);
 			}
 		});
 
-		// Split a file, check old storage persistence until both updates
+		// Page through a directory by key, with filenames shared between nodes
 		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto const DirID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			std::vector<std::string> Filenames;
+			for (size_t Index = 0; Index < 25; ++Index)
+			{
+				GlobalChangeIDT ChangeID(
+					NodeIDT(InstanceIndex, Core.ReserveNode()),
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(ChangeID, {}));
+				auto Meta = Meta1;
+				Meta.Filename() = StringT() << "file" << (Index % 20);
+				Meta.DirID() = DirID;
+				Core.DefineChange(ChangeID, DefineHeadT({}, Meta));
+				Filenames.push_back(Meta.Filename());
+			}
+			std::sort(Filenames.begin(), Filenames.end());
+
+			std::vector<std::string> Listed;
+			OptionalT<DirHeadKeyT> Last;
+			while (true)
+			{
+				auto Heads = Core.ListDirHeads(DirID, Last, 10);
+				for (auto const &Head : Heads) Listed.push_back(Head.Meta().Filename());
+				if (Heads.size() < 10) break;
+				Last = DirHeadKeyT(Heads.back().Meta().Filename(), Heads.back().ChangeID());
+			}
+			AssertE(Listed.size(), Filenames.size());
+			Assert(Listed == Filenames);
+			AssertE(Core.ListDirHeads({}, {}, 10).size(), 0u);
+
+			// Streamed in the same order, and stopped early
+			Listed.clear();
+			Core.ForEachDirHeadKey(DirID, [&Listed](DirHeadKeyT &&Key) 
+			{ 
+				Listed.push_back(Key.Filename()); 
+				return true; 
+			});
+			Assert(Listed == Filenames);
+			size_t Visited = 0;
+			Core.ForEachHead([&Visited](HeadT &&Head) { return ++Visited < 3; });
+			AssertE(Visited, 3u);
+			Visited = 0;
+			Core.ForEachHeadStorage([&Visited](GlobalChangeIDT &&, OptionalT<StorageIDT> &&) { ++Visited; return true; });
+			AssertE(Visited, 25u);
+		});
+
+		// Reads run on pooled connections while the writer adds heads
+		CoreSettingsT Pooled;
+		Pooled.ReadConnections = 2;
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto const DirID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			std::atomic<bool> Done(false);
+			std::atomic<bool> Failed(false);
+			std::atomic<size_t> Reads(0);
+			std::vector<std::thread> Readers;
+			FinallyT JoinReaders([&](void)
+			{
+				Done = true;
+				for (auto &Reader : Readers) if (Reader.joinable()) Reader.join();
+			});
+			for (size_t Index = 0; Index < 3; ++Index)
+				Readers.emplace_back([&]()
+				{
+					try
+					{
+						size_t Last = 0;
+						while (!Done)
+						{
+							// Nested reads reuse the thread's connection, so they can't wait on a full pool
+							size_t Count = 0;
+							Core.ForEachDirHead(DirID, [&](HeadT &&Head) 
+							{ 
+								Assert(Core.GetHead(Head.ChangeID()));
+								++Count; 
+								return true; 
+							});
+							// Each read sees whole commits, and heads are only added
+							Assert(Count >= Last);
+							Last = Count;
+							++Reads;
+						}
+					}
+					catch (...) { Failed = true; }
+				});
+			for (size_t Index = 0; Index < 20; ++Index)
+			{
+				GlobalChangeIDT ChangeID(
+					NodeIDT(InstanceIndex, Core.ReserveNode()),
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(ChangeID, {}));
+				auto Meta = Meta1;
+				Meta.Filename() = StringT() << "file" << Index;
+				Meta.DirID() = DirID;
+				Core.DefineChange(ChangeID, DefineHeadT({}, Meta));
+			}
+			while ((Reads < 3) && !Failed) std::this_thread::yield();
+			Done = true;
+			for (auto &Reader : Readers) Reader.join();
+			Assert(!Failed);
+			AssertE(Core.ListDirHeads(DirID, {}, 100).size(), 20u);
+		}, Pooled);
+
+		// Repeated edits to a file find the node's missing, head and storage in the cache
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto const NodeID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto Change = GlobalChangeIDT(NodeID, ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change, {}));
+			Core.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+			auto const Hits = Core.GetNodeCache().GetHits();
+			auto const Misses = Core.GetNodeCache().GetMisses();
+			for (size_t Count = 0; Count < 5; ++Count)
+			{
+				auto const Next = GlobalChangeIDT(NodeID, ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Next, Change.ChangeID()));
+				Core.DefineChange(Next, DefineHeadT(AddData2, Meta1));
+				Change = Next;
+			}
+			AssertE(Core.GetNodeCache().GetMisses(), Misses);
+			AssertGT(Core.GetNodeCache().GetHits(), Hits);
+			AssertE(Core.ListHeads({}, 10).size(), 1u);
+			CompareStorage(Core, *Core.GetHead(Change)->StorageID(), "whipeanut diva");
+			Assert(Core.Validate());
+		});
+
+		// Directory listings are paged from memory until a head in the directory changes
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto const DirID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto const OtherDirID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto AddFile = [&](NodeIDT const &Dir, std::string const &Filename)
+			{
+				GlobalChangeIDT ChangeID(
+					NodeIDT(InstanceIndex, Core.ReserveNode()),
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(ChangeID, {}));
+				auto Meta = Meta1;
+				Meta.Filename() = Filename;
+				Meta.DirID() = Dir;
+				Core.DefineChange(ChangeID, DefineHeadT({}, Meta));
+				return ChangeID;
+			};
+			for (size_t Index = 0; Index < 5; ++Index) AddFile(DirID, StringT() << "file" << Index);
+			AddFile(OtherDirID, "other");
+
+			auto const &Cache = Core.GetDirCache();
+			AssertE(Core.ListDirHeads(DirID, {}, 10).size(), 5u);
+			AssertE(Core.ListDirHeads(OtherDirID, {}, 10).size(), 1u);
+			auto const Hits = Cache.GetHits();
+			auto const Misses = Cache.GetMisses();
+			auto Page = Core.ListDirHeads(DirID, {}, 2);
+			AssertE(Page.size(), 2u);
+			Page = Core.ListDirHeads(DirID, DirHeadKeyT(Page.back().Meta().Filename(), Page.back().ChangeID()), 10);
+			AssertE(Page.size(), 3u);
+			AssertE(Page.front().Meta().Filename(), std::string("file2"));
+			AssertE(Cache.GetHits(), Hits + 2);
+			AssertE(Cache.GetMisses(), Misses);
+			AssertGT(Cache.GetBytes(), 0u);
+			Assert(Cache.GetBytes() <= Cache.GetBudget());
+
+			// Only the changed directory is loaded again
+			auto const Added = AddFile(DirID, "file5");
+			AssertE(Core.ListDirHeads(DirID, {}, 10).size(), 6u);
+			AssertE(Core.ListDirHeads(OtherDirID, {}, 10).size(), 1u);
+			AssertE(Cache.GetMisses(), Misses + 1);
+
+			GlobalChangeIDT Deleted(Added.NodeID(), ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Deleted, Added.ChangeID()));
+			Core.DefineChange(Deleted, DeleteHeadT());
+			AssertE(Core.ListDirHeads(DirID, {}, 10).size(), 5u);
+			AssertE(Cache.GetMisses(), Misses + 2);
+			AssertGT(Cache.GetHitRate(), 0.0);
+		});
+
+		// Paths resolve a name at a time, with names that aren't there cached too
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto AddFile = [&](OptionalT<NodeIDT> const &Dir, std::string const &Filename)
+			{
+				GlobalChangeIDT ChangeID(
+					NodeIDT(InstanceIndex, Core.ReserveNode()),
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(ChangeID, {}));
+				auto Meta = Meta1;
+				Meta.Filename() = Filename;
+				Meta.DirID() = Dir;
+				Core.DefineChange(ChangeID, DefineHeadT({}, Meta));
+				return ChangeID;
+			};
+			auto const A = AddFile({}, "a");
+			auto const B = AddFile(A.NodeID(), "b");
+			auto const C = AddFile(B.NodeID(), "c.txt");
+			AddFile(B.NodeID(), "d.txt");
+			auto const Resolve = [&Core](std::string const &Path)
+			{
+				auto const Found = Core.LookupPath(Path);
+				Assert(Found);
+				return *Found;
+			};
+			Assert(Resolve("a/b/c.txt") == OptionalT<NodeIDT>(C.NodeID()));
+			Assert(Resolve("/a//b/") == OptionalT<NodeIDT>(B.NodeID()));
+			// The root resolves, to no node ID
+			Assert(!Resolve(""));
+			Assert(!Resolve("///"));
+			AssertE(Core.LookupName(B.NodeID(), "d.txt").size(), 1u);
+
+			auto const &Cache = Core.GetDentryCache();
+			auto const Hits = Cache.GetHits();
+			Assert(!Core.LookupPath("a/x"));
+			Assert(!Core.LookupPath("a/x"));
+			Assert(!Core.LookupPath("a/b/c.txt/e"));
+			AssertE(Cache.GetHits(), Hits + 6);
+
+			// Added and removed names are looked up again
+			auto const X = AddFile(A.NodeID(), "x");
+			Assert(Resolve("a/x") == OptionalT<NodeIDT>(X.NodeID()));
+			GlobalChangeIDT Deleted(C.NodeID(), ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Deleted, C.ChangeID()));
+			Core.DefineChange(Deleted, DeleteHeadT());
+			Assert(!Core.LookupPath("a/b/c.txt"));
+
+			// A name shared by two nodes doesn't resolve
+			AddFile(A.NodeID(), "x");
+			AssertE(Core.LookupName(A.NodeID(), "x").size(), 2u);
+			Assert(!Core.LookupPath("a/x"));
+		});
+
+		// Copies keep holes and contents with each strategy, across more than one copy step
+		Frame([](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_copy");
+			Root.CreateDirectory();
+			auto const From = Root.Enter("from");
+			uint64_t const Size = 5 << 20;
+			std::vector<uint8_t> Expected(Size, 0);
+			{
+				FileDescriptorT Source(From, O_WRONLY | O_CREAT | O_TRUNC);
+				std::vector<uint8_t> Head(4096, 'h');
+				std::vector<uint8_t> Middle((3 << 20) / 2, 0);
+				for (size_t Index = 0; Index < Middle.size(); ++Index) Middle[Index] = 'a' + (Index % 26);
+				Source.Write(0, Head.data(), Head.size());
+				Source.Write(3 << 20, Middle.data(), Middle.size());
+				Source.Resize(Size);
+				std::copy(Head.begin(), Head.end(), Expected.begin());
+				std::copy(Middle.begin(), Middle.end(), Expected.begin() + (3 << 20));
+			}
+			for (auto const First : {CopyStrategyT::Reflink, CopyStrategyT::CopyFileRange, CopyStrategyT::Buffered})
+			{
+				auto const To = Root.Enter(StringT() << "to" << (unsigned int)First);
+				auto const Result = CopyStorageFile(From, To, First);
+				Assert(Result.Strategy >= First);
+				AssertE(Result.Size, Size);
+				FileDescriptorT Dest(To, O_RDONLY);
+				AssertE(Dest.Size(), Size);
+				std::vector<uint8_t> Contents(Size);
+				AssertE(Dest.Read(0, Contents.data(), Contents.size()), Size);
+				Assert(Contents == Expected);
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+				// Where the filesystem reports the source's gap as a hole, a data copy leaves it as one too
+				if ((Result.Strategy != CopyStrategyT::Reflink) && 
+					(lseek(*FileDescriptorT(From, O_RDONLY), 4096, SEEK_DATA) == (3 << 20)))
+					AssertE(lseek(*Dest, 4096, SEEK_DATA), 3 << 20);
+#endif
+			}
+			Root.DeleteDirectory();
+		});
+
+		// Split a file, check old storage persistence until both updates
+		auto SplitFile = [](size_t ExpectedCopies, size_t ExpectedStorage) 
+			{ return [ExpectedCopies, ExpectedStorage](CoreT &Core) 
 		{
 			GlobalChangeIDT Change1, Change2, Change3;
 			auto InstanceIndex = Core.GetThisInstance();
@@ -465,7 +841,7 @@ int main(void)
 				Core.DefineChange(Change1, DefineHeadT(AddData1, Meta1));
 				
 				CompareStorage(Core, *Core.GetHead(Change1)->StorageID(), "hellog");
-				AssertE(Core.ListStorage(0, 10).size(), 1u);
+				AssertE(Core.ListStorage({}, 10).size(), 1u);
 			}
 			
 			{
@@ -484,16 +860,707 @@ int main(void)
 			{
 				Core.DefineChange(Change2, DefineHeadT(AddData2, Meta1));
 
-				AssertE(Core.ListStorage(0, 10).size(), 2u);
+				AssertE(Core.ListStorage({}, 10).size(), 2u);
+				AssertE(Core.GetCopyStats().Count(), ExpectedCopies);
 				CompareStorage(Core, *Core.GetHead(Change2)->StorageID(), "whipeanut diva");
 			}
 
 			{
 				Core.DefineChange(Change3, DefineHeadT(AddData3, Meta1));
 
-				AssertE(Core.ListStorage(0, 10).size(), 2u);
+				AssertE(Core.ListStorage({}, 10).size(), ExpectedStorage);
 				CompareStorage(Core, *Core.GetHead(Change3)->StorageID(), "woglog");
 			}
+		}; };
+		Frame(SplitFile(1, 2));
+
+		// Same with chunked storage
+		Frame(WriteTruncateDelete, Chunked);
+		Frame(SplitFile(0, 2), Chunked);
+
+		// Chunked storage, large edits share unchanged chunks
+		Frame([](CoreT &Core) 
+		{
+			std::mt19937 Random(1);
+			std::vector<uint8_t> Bytes(48 * 1024);
+			for (auto &Byte : Bytes) Byte = Random();
+			auto const Edit = std::vector<uint8_t>({'e', 'd', 'i', 't'});
+			auto Edited = Bytes;
+			std::copy(Edit.begin(), Edit.end(), Edited.begin() + 20000);
+			Edited.insert(Edited.end(), Edit.begin(), Edit.end());
+
+			GlobalChangeIDT Change1, Change2, Change3;
+			auto InstanceIndex = Core.GetThisInstance();
+			auto NodeID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			{
+				Change1 = GlobalChangeIDT(
+					NodeID,
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Change1, {}));
+				Core.DefineChange(Change1, DefineHeadT(
+					StorageChangesT(std::vector<BytesChangeT>{BytesChangeT{0, Bytes}}), 
+					Meta1));
+			}
+			{
+				Change2 = GlobalChangeIDT(
+					NodeID,
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Change2, Change1.ChangeID()));
+				Change3 = GlobalChangeIDT(
+					NodeID,
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Change3, Change1.ChangeID()));
+			}
+			{
+				Core.DefineChange(Change2, DefineHeadT(
+					StorageChangesT(std::vector<BytesChangeT>{
+						BytesChangeT{20000, Edit},
+						BytesChangeT{Bytes.size(), Edit}}), 
+					Meta1));
+
+				AssertE(Core.ListStorage({}, 10).size(), 2u);
+				AssertE(Core.GetCopyStats().Count(), 0u);
+				CompareStorage(Core, *Core.GetHead(Change2)->StorageID(), std::string(Edited.begin(), Edited.end()));
+				Assert(Core.Validate());
+			}
+			{
+				Core.DefineChange(Change3, DefineHeadT({}, Meta1));
+
+				AssertE(Core.ListStorage({}, 10).size(), 2u);
+				CompareStorage(Core, *Core.GetHead(Change3)->StorageID(), std::string(Bytes.begin(), Bytes.end()));
+			}
+		}, Chunked);
+
+		// Overlay storage
+		Frame(WriteTruncateDelete, Overlaid);
+		// Both forks are overlays on the original storage, which stays until they're gone
+		Frame(SplitFile(0, 3), Overlaid);
+
+		// Overlay chains, flattening
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto NodeID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto Expected = Comparison1;
+			auto Change = GlobalChangeIDT(
+				NodeID,
+				ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change, {}));
+			Core.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+
+			// Leave a sibling undefined at each step so every edit forks the storage
+			for (uint8_t Step = 0; Step < 5; ++Step)
+			{
+				auto Sibling = GlobalChangeIDT(
+					NodeID,
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Sibling, Change.ChangeID()));
+				auto Next = GlobalChangeIDT(
+					NodeID,
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Next, Change.ChangeID()));
+				Core.DefineChange(Next, DefineHeadT(
+					StorageChangesT(std::vector<BytesChangeT>{BytesChangeT{Step * 2u, {uint8_t('0' + Step)}}}), 
+					Meta1));
+				Expected.resize(std::max<size_t>(Expected.size(), Step * 2u + 1));
+				Expected[Step * 2u] = char('0' + Step);
+				Change = Next;
+				CompareStorage(Core, *Core.GetHead(Change)->StorageID(), Expected);
+			}
+			AssertE(Core.GetCopyStats().Count(), 0u);
+
+			Assert(Core.FlattenOverlays(10) > 0u);
+			AssertE(Core.FlattenOverlays(10), 0u);
+			CompareStorage(Core, *Core.GetHead(Change)->StorageID(), Expected);
+		}, Overlaid);
+
+		// Same with packed storage
+		Frame(WriteTruncateDelete, Packed);
+		Frame(SplitFile(0, 2), Packed);
+
+		// Packed storage, compaction and growing out of a segment
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			std::vector<GlobalChangeIDT> Changes;
+			for (size_t Count = 0; Count < 3; ++Count)
+			{
+				auto Change = GlobalChangeIDT(
+					NodeIDT(InstanceIndex, Core.ReserveNode()),
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Change, {}));
+				Core.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+				Changes.push_back(Change);
+			}
+			auto Rewrite = [&](size_t Index, StorageChangesT const &Data)
+			{
+				auto Next = GlobalChangeIDT(
+					Changes[Index].NodeID(),
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Next, Changes[Index].ChangeID()));
+				Core.DefineChange(Next, DefineHeadT(Data, Meta1));
+				Changes[Index] = Next;
+			};
+
+			// Rewrites leave the first segment mostly dead
+			for (size_t Index = 0; Index < 3; ++Index) Rewrite(Index, AddData2);
+			AssertE(Core.CompactSegments(10), 1u);
+			AssertE(Core.CompactSegments(10), 0u);
+			for (auto const &Change : Changes)
+				CompareStorage(Core, *Core.GetHead(Change)->StorageID(), "whipeanut diva");
+
+			Rewrite(0, StorageChangesT(std::vector<BytesChangeT>{BytesChangeT{14, std::vector<uint8_t>(10, 'x')}}));
+			CompareStorage(Core, *Core.GetHead(Changes[0])->StorageID(), "whipeanut divaxxxxxxxxxx");
+			CompareStorage(Core, *Core.GetHead(Changes[1])->StorageID(), "whipeanut diva");
+			AssertE(Core.GetCopyStats().Count(), 0u);
+		}, Packed);
+
+		// Same with inline storage
+		Frame(WriteTruncateDelete, Inlined);
+		Frame(SplitFile(0, 2), Inlined);
+
+		// Inline storage doesn't touch the filesystem
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto Change = GlobalChangeIDT(
+				NodeIDT(InstanceIndex, Core.ReserveNode()),
+				ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change, {}));
+			Core.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+			auto const StorageID = *Core.GetHead(Change)->StorageID();
+			CompareStorage(Core, StorageID, "hellog");
+			Assert(!Filesystem::PathT::Qualify("test_data").Enter("storage").Enter("00").Enter("00").Enter(StringT() << StorageID).Exists());
+			AssertE(Core.GetDescriptorCache().GetMisses(), 0u);
+		}, Inlined);
+
+		// Overlapping and touching changes in one batch, later changes win
+		auto OverlappingWrites = [](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto NodeID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto const Changes1 = std::vector<BytesChangeT>{
+				BytesChangeT{4, {'a', 'a', 'a', 'a'}},
+				BytesChangeT{0, {'b', 'b', 'b'}},
+				BytesChangeT{6, {'c', 'c', 'c', 'c'}},
+				BytesChangeT{3, {'d'}},
+				BytesChangeT{5, {'e'}}};
+			AssertE(WritePlanT(Changes1).GetRuns().size(), 1u);
+			auto Change1 = GlobalChangeIDT(
+				NodeID,
+				ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change1, {}));
+			Core.DefineChange(Change1, DefineHeadT(StorageChangesT(Changes1), Meta1));
+			CompareStorage(Core, *Core.GetHead(Change1)->StorageID(), "bbbdaecccc");
+
+			auto const Changes2 = std::vector<BytesChangeT>{
+				BytesChangeT{12, {'x'}},
+				BytesChangeT{0, {'y'}},
+				BytesChangeT{12, {'z'}}};
+			AssertE(WritePlanT(Changes2).GetRuns().size(), 2u);
+			auto Change2 = GlobalChangeIDT(
+				NodeID,
+				ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change2, Change1.ChangeID()));
+			Core.DefineChange(Change2, DefineHeadT(StorageChangesT(Changes2), Meta1));
+			CompareStorage(Core, *Core.GetHead(Change2)->StorageID(), std::string("ybbdaecccc\0\0z", 13));
+		};
+		Frame(OverlappingWrites);
+		Frame(OverlappingWrites, Packed);
+
+		// Resizing and punching holes, forked and in place
+		auto ResizeAndPunch = [](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto NodeID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto NextChange = [&](OptionalT<ChangeIDT> const &Parent)
+			{
+				auto Change = GlobalChangeIDT(
+					NodeID,
+					ChangeIDT(InstanceIndex, Core.ReserveChange()));
+				Core.AddChange(ChangeT(Change, Parent));
+				return Change;
+			};
+			auto Change1 = NextChange({});
+			Core.DefineChange(Change1, DefineHeadT(AddData1, Meta1));
+			auto Change2 = NextChange(Change1.ChangeID());
+			auto Change3 = NextChange(Change1.ChangeID());
+
+			Core.DefineChange(Change2, DefineHeadT(
+				StorageChangesT(std::vector<BytesChangeT>{BytesChangeT{0, {'j'}}}), Meta1));
+			CompareStorage(Core, *Core.GetHead(Change2)->StorageID(), "jellog");
+			Core.DefineChange(Change3, DefineHeadT(StorageChangesT(ResizeT{3}), Meta1));
+			CompareStorage(Core, *Core.GetHead(Change3)->StorageID(), "hel");
+
+			auto Change4 = NextChange(Change2.ChangeID());
+			Core.DefineChange(Change4, DefineHeadT(StorageChangesT(ResizeT{8}), Meta1));
+			CompareStorage(Core, *Core.GetHead(Change4)->StorageID(), std::string("jellog\0\0", 8));
+			auto Change5 = NextChange(Change4.ChangeID());
+			Core.DefineChange(Change5, DefineHeadT(StorageChangesT(PunchHoleT{1, 2}), Meta1));
+			CompareStorage(Core, *Core.GetHead(Change5)->StorageID(), std::string("j\0\0log\0\0", 8));
+
+			auto Change6 = NextChange(Change3.ChangeID());
+			Core.DefineChange(Change6, DefineHeadT(StorageChangesT(PunchHoleT{2, 10}), Meta1));
+			CompareStorage(Core, *Core.GetHead(Change6)->StorageID(), std::string("he\0", 3));
+			Assert(Core.Validate());
+		};
+		Frame(ResizeAndPunch);
+		Frame(ResizeAndPunch, Chunked);
+		Frame(ResizeAndPunch, Overlaid);
+		Frame(ResizeAndPunch, Packed);
+		Frame(ResizeAndPunch, Inlined);
+
+		// Staged changes, written in pieces
+		auto StagedWrites = [](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto NodeID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto Staging = Filesystem::PathT::Qualify("test_data").Enter("staging");
+			auto StagingEmpty = [&Staging](void)
+			{
+				bool Empty = true;
+				Staging.List([&Empty](Filesystem::PathT &&, bool, bool) { Empty = false; return false; });
+				return Empty;
+			};
+			auto Write = [](StagedChangeT &Staged, uint64_t Offset, std::string const &Data)
+				{ Staged.Write(Offset, reinterpret_cast<uint8_t const *>(Data.data()), Data.size()); };
+
+			auto Change1 = GlobalChangeIDT(
+				NodeID,
+				ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change1, {}));
+			{
+				auto Staged = Core.StageChange(Change1, true);
+				Write(Staged, 3, "log");
+				Write(Staged, 0, "hex");
+				Write(Staged, 2, "l");
+				AssertE(Staged.Describe().Ranges().size(), 1u);
+				Core.DefineChange(std::move(Staged), Meta1);
+			}
+			CompareStorage(Core, *Core.GetHead(Change1)->StorageID(), "hellog");
+			Assert(StagingEmpty());
+			// New storage takes the staged file rather than a copy of it
+			AssertE(Core.GetCopyStats().Count(), 0u);
+
+			// Nothing is staged for a change that's already defined
+			Core.DefineChange(Change1, DefineHeadT(
+				StorageChangesT(std::vector<BytesChangeT>{BytesChangeT{0, std::vector<uint8_t>(8192, 'x')}}), 
+				Meta1));
+			Assert(StagingEmpty());
+
+			auto Change2 = GlobalChangeIDT(
+				NodeID,
+				ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change2, Change1.ChangeID()));
+			{
+				// Dropped without committing
+				auto Abandoned = Core.StageChange(Change2, true);
+				Write(Abandoned, 0, "nope");
+			}
+			Assert(StagingEmpty());
+			{
+				auto Staged = Core.StageChange(Change2, false);
+				Write(Staged, 10, "xy");
+				Write(Staged, 1, "a");
+				AssertE(Staged.Describe().Ranges().size(), 2u);
+				Core.DefineChange(std::move(Staged), Meta1);
+			}
+			CompareStorage(Core, *Core.GetHead(Change2)->StorageID(), std::string("hallog\0\0\0\0xy", 12));
+			Assert(StagingEmpty());
+			Assert(Core.Validate());
+		};
+		Frame(StagedWrites);
+		Frame(StagedWrites, Chunked);
+		Frame(StagedWrites, Overlaid);
+		Frame(StagedWrites, Packed);
+
+		// Byte changes journaled as references to staged data
+		Frame(WriteTruncateDelete, Staged);
+		Frame(SplitFile(1, 2), Staged);
+		Frame(OverlappingWrites, Staged);
+
+		// The journal is checkpointed once its transactions finish, and a torn record at its end is ignored
+		Frame([Checkpointed](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_journal");
+			auto const Journal = Root.Enter("coretransactions").Enter("journal");
+			GlobalChangeIDT Change;
+			{
+				CoreT First({"test"}, Root, Checkpointed);
+				auto InstanceIndex = First.GetThisInstance();
+				Change = GlobalChangeIDT(
+					NodeIDT(InstanceIndex, First.ReserveNode()),
+					ChangeIDT(InstanceIndex, First.ReserveChange()));
+				First.AddChange(ChangeT(Change, {}));
+				First.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+				AssertE(FileDescriptorT(Journal, O_RDONLY).Size(), 0u);
+			}
+			{
+				FileDescriptorT Torn(Journal, O_WRONLY);
+				std::vector<uint8_t> const Garbage(30, 0xff);
+				Torn.Write(Torn.Size(), Garbage.data(), Garbage.size());
+			}
+			{
+				CoreT Second({"test"}, Root, Checkpointed);
+				Assert(Second.Validate());
+				CompareStorage(Second, *Second.GetHead(Change)->StorageID(), "hellog");
+				AssertE(FileDescriptorT(Journal, O_RDONLY).Size(), 0u);
+			}
+			Root.DeleteDirectory();
+		});
+
+		// A transaction whose handler throws is aborted rather than left in flight, so it isn't replayed and the 
+		// journal can still be checkpointed
+		Frame([](CoreT &Core) 
+		{
+			FailingHandlerT Failing;
+			auto const Root = Filesystem::PathT::Qualify("test_data_abort");
+			auto const Journal = Root.Enter("journal");
+			{
+				FailingTransactorT Transact(Root, Failing);
+				bool Threw = false;
+				try { Transact(CTV1FlattenStorage(), StorageIDT(1)); }
+				catch (SystemErrorT const &) { Threw = true; }
+				Assert(Threw);
+				AssertGT(FileDescriptorT(Journal, O_RDONLY).Size(), 0u);
+			}
+			AssertE(FileDescriptorT(Journal, O_RDONLY).Size(), 0u);
+			{
+				FailingTransactorT Transact(Root, Failing);
+			}
+			AssertE(Failing.Handled, 1u);
+			Root.DeleteDirectory();
+		});
+
+		// Transaction files left by builds before the journal hold version 1 messages, with narrow reference counts
+		Frame([](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_legacy");
+			GlobalChangeIDT Parent;
+			GlobalChangeIDT Child;
+			StorageIDT StorageID;
+			{
+				CoreT First({"test"}, Root);
+				auto InstanceIndex = First.GetThisInstance();
+				Parent = GlobalChangeIDT(
+					NodeIDT(InstanceIndex, First.ReserveNode()),
+					ChangeIDT(InstanceIndex, First.ReserveChange()));
+				First.AddChange(ChangeT(Parent, {}));
+				First.DefineChange(Parent, DefineHeadT(AddData1, Meta1));
+				StorageID = *First.GetHead(Parent)->StorageID();
+				Child = GlobalChangeIDT(Parent.NodeID(), ChangeIDT(InstanceIndex, First.ReserveChange()));
+			}
+			{
+				auto const Message = CTV1AddChange::Write(
+					ChangeT(Child, Parent.ChangeID()), 
+					Parent.ChangeID(), 
+					StorageID, 
+					StorageReferenceCountV1T(2), 
+					false);
+				FileDescriptorT Legacy(Root.Enter("coretransactions").Enter("1234"), O_WRONLY | O_CREAT);
+				Legacy.Write(0, Message.data(), Message.size());
+			}
+			{
+				CoreT Second({"test"}, Root);
+				Assert(Second.Validate());
+				auto const Missing = Second.ListMissing({}, 10);
+				AssertE(Missing.size(), 1u);
+				Assert(Missing[0].ChangeID() == Child);
+				AssertE(*Second.ListStorage({}, 10)[0].ReferenceCount(), 2u);
+			}
+			Root.DeleteDirectory();
+		});
+
+		// Back-to-back transactions from one thread share journal syncs
+		Frame([](CoreT &Core) 
+		{
+			CountingHandlerT Counting;
+			auto const Root = Filesystem::PathT::Qualify("test_data_group");
+			TransactorSettingsT Grouped;
+			Grouped.CommitWindow = std::chrono::milliseconds(10);
+			{
+				CountingTransactorT Transact(Root, Counting, Grouped);
+				size_t const Count = 100;
+				for (size_t Index = 0; Index < Count; ++Index) Transact(CTV1FlattenStorage(), StorageIDT(Index));
+				Transact.Flush();
+				AssertE(Counting.Handled, Count);
+				AssertGT(Transact.GetSyncCount(), 0u);
+				AssertLT(Transact.GetSyncCount(), Count / 2);
+			}
+			Root.DeleteDirectory();
+		});
+
+		// Intents recorded with the metadata, replayed into plain file storage after a crash
+		Frame(WriteTruncateDelete, Intents);
+		Frame(SplitFile(1, 2), Intents);
+		Frame(ResizeAndPunch, Intents);
+		Frame(StagedWrites, Intents);
+		Frame([Intents](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_intents");
+			GlobalChangeIDT Change;
+			StorageIDT StorageID;
+			{
+				CoreT First({"test"}, Root, Intents);
+				auto InstanceIndex = First.GetThisInstance();
+				Change = GlobalChangeIDT(
+					NodeIDT(InstanceIndex, First.ReserveNode()),
+					ChangeIDT(InstanceIndex, First.ReserveChange()));
+				First.AddChange(ChangeT(Change, {}));
+				First.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+				StorageID = *First.GetHead(Change)->StorageID();
+			}
+			// Lose the write, as if it hadn't been synced before a crash
+			auto const Storage = Root.Enter("storage").Enter("01").Enter("00").Enter(StringT() << StorageID);
+			Assert(Storage.Exists());
+			FileDescriptorT(Storage, O_WRONLY).Resize(0);
+			{
+				CoreT Second({"test"}, Root, Intents);
+				Assert(Second.Validate());
+				CompareStorage(Second, StorageID, "hellog");
+			}
+			Root.DeleteDirectory();
+		});
+
+		// IDs come from blocks reserved in the database, and a reopened core starts after the last block
+		Frame([](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_ids");
+			CoreSettingsT Blocks;
+			Blocks.IDBlockSize = 4;
+			std::vector<NodeIndexT> Nodes;
+			{
+				CoreT First({"test"}, Root, Blocks);
+				for (size_t Index = 0; Index < 5; ++Index) Nodes.push_back(First.ReserveNode());
+				First.ReserveChange();
+			}
+			for (size_t Index = 1; Index < Nodes.size(); ++Index) AssertE(*Nodes[Index], *Nodes[Index - 1] + 1);
+			{
+				CoreT Second({"test"}, Root, Blocks);
+				AssertE(*Second.ReserveNode(), *Nodes[0] + 8);
+				AssertE(*Second.ReserveChange(), *Nodes[0] + 4);
+			}
+			Root.DeleteDirectory();
+		});
+
+		// Nested transactions roll back to their savepoint without losing the enclosing transaction's work
+		Frame([](CoreT &Core) 
+		{
+			SQLDatabaseT Database;
+			Database.Execute("CREATE TABLE \"Rows\" (\"Value\" INTEGER NOT NULL)");
+			auto Count = [&Database](void) { return *Database.Get<unsigned int(void)>("SELECT count(1) FROM \"Rows\""); };
+			{
+				auto Outer = Database.Begin();
+				Database.Execute("INSERT INTO \"Rows\" VALUES (?)", 1u);
+				{
+					auto Inner = Database.Begin();
+					Database.Execute("INSERT INTO \"Rows\" VALUES (?)", 2u);
+				}
+				{
+					auto Inner = Database.Begin();
+					Database.Execute("INSERT INTO \"Rows\" VALUES (?)", 3u);
+					Inner.Commit();
+				}
+				Outer.Commit();
+			}
+			AssertE(Count(), 2u);
+			{
+				auto Outer = Database.Begin();
+				Database.Execute("DELETE FROM \"Rows\"");
+			}
+			AssertE(Count(), 2u);
+
+			// Repeated statements are only prepared once
+			auto const Misses = Database.GetStatementCacheMisses();
+			auto const Hits = Database.GetStatementCacheHits();
+			for (unsigned int Value = 1; Value <= 3; ++Value) 
+				Database.Execute("DELETE FROM \"Rows\" WHERE \"Value\" = ?", Value);
+			AssertE(Database.GetStatementCacheMisses(), Misses + 1);
+			AssertE(Database.GetStatementCacheHits(), Hits + 2);
+			AssertE(Count(), 0u);
+		});
+
+		// Database tuning is applied on open, the page size only on creation
+		Frame([](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_sqlite");
+			Root.CreateDirectory();
+			auto const Path = Root.Enter("tuned.sqlite3");
+			{
+				SQLSettingsT Settings;
+				Settings.PageSize = 8192;
+				Settings.Synchronous = SQLSettingsT::SynchronousT::Normal;
+				SQLDatabaseT Database(Path, Settings);
+				Database.Execute("CREATE TABLE \"Rows\" (\"Value\" INTEGER NOT NULL)");
+				AssertE(*Database.Get<std::string(void)>("PRAGMA journal_mode"), "wal");
+				AssertE(*Database.Get<int(void)>("PRAGMA synchronous"), 1);
+				AssertE(*Database.Get<int(void)>("PRAGMA page_size"), 8192);
+				AssertE(*Database.Get<int(void)>("PRAGMA temp_store"), 2);
+			}
+			{
+				SQLSettingsT Settings;
+				Settings.WriteAheadLog = false;
+				SQLDatabaseT Database(Path, Settings);
+				AssertE(*Database.Get<int(void)>("PRAGMA page_size"), 8192);
+				AssertE(*Database.Get<int(void)>("PRAGMA synchronous"), 2);
+			}
+			Root.DeleteDirectory();
+		});
+
+		// Directory listings, parent lookups, per-instance missing lookups and reference counts search indexes rather 
+		// than scanning
+		Frame([](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_indexes");
+			Root.CreateDirectory();
+			{
+				CoreDatabaseT Database(Root.Enter("coredb.sqlite3"));
+				auto Plan = [&Database](char const *Query)
+				{
+					std::string const Explain = StringT() << "EXPLAIN QUERY PLAN " << Query;
+					std::string Detail;
+					SQLDatabaseT::StatementT<std::tuple<int, int, int, std::string>(void)>(&Database, Explain.c_str()).Execute(
+						[&Detail](int &&, int &&, int &&, std::string &&Step) { Detail += Step + "\n"; });
+					return Detail;
+				};
+				auto Uses = [](std::string const &Plan, char const *Index) 
+					{ return Plan.find(StringT() << "INDEX " << Index) != std::string::npos; };
+				// Listings read whole rows in order straight out of the index
+				auto const Listing = Plan(
+					"SELECT * FROM \"Heads\" WHERE \"DirInstance\" IS 1 AND \"DirIndex\" IS 2 "
+						"ORDER BY \"Filename\", \"NodeInstance\", \"NodeIndex\", \"ChangeInstance\", \"ChangeIndex\"");
+				Assert(Uses(Listing, "HeadsDirectory"));
+				Assert(Listing.find("COVERING INDEX") != std::string::npos);
+				Assert(Listing.find("TEMP B-TREE") == std::string::npos);
+				Assert(Uses(Plan(
+					"SELECT * FROM \"Heads\" WHERE \"DirInstance\" IS 1 AND \"DirIndex\" IS 2 AND \"Filename\" = 'a'"), 
+					"HeadsDirectory"));
+				Assert(Uses(Plan(
+					"SELECT * FROM \"Changes\" WHERE \"NodeInstance\" = 1 AND \"NodeIndex\" = 2 AND "
+						"\"ParentChangeInstance\" = 3 AND \"ParentChangeIndex\" = 4"), 
+					"ChangesParent"));
+				Assert(Uses(Plan("SELECT * FROM \"Missing\" WHERE \"ChangeInstance\" = 1"), "MissingInstance"));
+				Assert(Uses(Plan("SELECT count(1) FROM \"StorageChunks\" GROUP BY \"Hash\""), "StorageChunksHash"));
+				Assert(Uses(Plan("SELECT count(1) FROM \"Heads\" WHERE \"StorageIndex\" = 1"), "HeadsStorage"));
+				Assert(Uses(Plan("SELECT count(1) FROM \"Missing\" WHERE \"StorageIndex\" = 1"), "MissingStorage"));
+			}
+			Root.DeleteDirectory();
+		});
+
+		// A collector task that throws is logged without stopping the collector
+		Frame([](CoreT &Core) 
+		{
+			GarbageCollectorT Garbage(GarbageSettingsT{});
+			bool Ran = false;
+			Garbage.Run(Filesystem::PathT::Qualify("."), [](void) { throw std::runtime_error("Failing on purpose"); });
+			Garbage.Run(Filesystem::PathT::Qualify("."), [&Ran](void) { Ran = true; });
+			Garbage.Wait();
+			Assert(Ran);
+		});
+
+		// Garbage collection, wide reference counts
+		Frame([](CoreT &Core) 
+		{
+			auto InstanceIndex = Core.GetThisInstance();
+			auto NodeID = NodeIDT(InstanceIndex, Core.ReserveNode());
+			auto Change = GlobalChangeIDT(
+				NodeID,
+				ChangeIDT(InstanceIndex, Core.ReserveChange()));
+			Core.AddChange(ChangeT(Change, {}));
+			Core.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+			auto const StorageID = *Core.GetHead(Change)->StorageID();
+
+			// More references than fit in a byte
+			for (size_t Count = 0; Count < 300; ++Count)
+				Core.AddChange(ChangeT(
+					GlobalChangeIDT(
+						NodeID, 
+						ChangeIDT(InstanceIndex, Core.ReserveChange())), 
+					Change.ChangeID()));
+			AssertE(*Core.ListStorage({}, 10)[0].ReferenceCount(), 301u);
+			Assert(Core.Validate());
+
+			// A count that drifted is found by the mark and corrected by the writer
+			CoreDatabaseT(Filesystem::PathT::Qualify("test_data").Enter("coredb.sqlite3"))
+				.SetStorageRefCount(StorageID, StorageReferenceCountT(5));
+			Assert(!Core.Validate());
+			Core.CollectGarbage();
+			Core.WaitForGarbage();
+			AssertE(*Core.ListStorage({}, 10)[0].ReferenceCount(), 301u);
+			Assert(Core.Validate());
+
+			// Files the database doesn't know about are swept, except storage that could still be created
+			auto const Root = Filesystem::PathT::Qualify("test_data");
+			auto const Stray = Root.Enter("storage").Enter("0");
+			auto const Future = Root.Enter("storage").Enter("1000");
+			auto const StrayChunk = Root.Enter("chunks").Enter("ab").Enter("ab000000000000000000000000000000");
+			Root.Enter("chunks").Enter("ab").CreateDirectory();
+			Filesystem::FileT::OpenWrite(Stray).Write(std::string("stray"));
+			Filesystem::FileT::OpenWrite(Future).Write(std::string("future"));
+			Filesystem::FileT::OpenWrite(StrayChunk).Write(std::string("stray"));
+			Core.CollectGarbage();
+			Core.WaitForGarbage();
+			Assert(!Stray.Exists());
+			Assert(Future.Exists());
+			Assert(!StrayChunk.Exists());
+			CompareStorage(Core, StorageID, "hellog");
+			Future.Delete();
+		});
+
+		// Storage in the old flat layout moves into shards when used and when idle
+		Frame([](CoreT &Core) 
+		{
+			auto const Root = Filesystem::PathT::Qualify("test_data_flat");
+			auto const StorageRoot = Root.Enter("storage");
+			auto ShardPath = [&StorageRoot](StorageIDT const &ID)
+			{
+				static char const Digits[] = "0123456789abcdef";
+				return StorageRoot
+					.Enter(std::string{Digits[(*ID >> 4) & 0xf], Digits[*ID & 0xf]})
+					.Enter(std::string{Digits[(*ID >> 12) & 0xf], Digits[(*ID >> 8) & 0xf]})
+					.Enter(StringT() << ID);
+			};
+			std::vector<StorageIDT> Storage;
+			{
+				CoreT Flat({"test"}, Root);
+				auto InstanceIndex = Flat.GetThisInstance();
+				for (size_t Count = 0; Count < 2; ++Count)
+				{
+					auto Change = GlobalChangeIDT(
+						NodeIDT(InstanceIndex, Flat.ReserveNode()),
+						ChangeIDT(InstanceIndex, Flat.ReserveChange()));
+					Flat.AddChange(ChangeT(Change, {}));
+					Flat.DefineChange(Change, DefineHeadT(AddData1, Meta1));
+					Storage.push_back(*Flat.GetHead(Change)->StorageID());
+				}
+			}
+			for (auto const &ID : Storage)
+			{
+				auto const From = ShardPath(ID).Render();
+				auto const To = StorageRoot.Enter(StringT() << ID).Render();
+				Assert(rename(From.c_str(), To.c_str()) == 0);
+			}
+			CoreDatabaseT(Root.Enter("coredb.sqlite3")).SetStorageLayout((unsigned int)StorageLayoutT::Flat);
+
+			{
+				CoreT Flat({"test"}, Root);
+				CompareStorage(Flat, Storage[0], "hellog");
+				Assert(ShardPath(Storage[0]).Exists());
+				Assert(!StorageRoot.Enter(StringT() << Storage[0]).Exists());
+				AssertE(Flat.MigrateStorage(0), 0u);
+				Assert(StorageRoot.Enter(StringT() << Storage[1]).Exists());
+				AssertE(Flat.MigrateStorage(10), 1u);
+				AssertE(Flat.MigrateStorage(10), 0u);
+				Assert(ShardPath(Storage[1]).Exists());
+				CompareStorage(Flat, Storage[1], "hellog");
+				Assert(Flat.Validate());
+
+				// Reopening storage reuses its descriptor
+				auto const Hits = Flat.GetDescriptorCache().GetHits();
+				CompareStorage(Flat, Storage[1], "hellog");
+				AssertGT(Flat.GetDescriptorCache().GetHits(), Hits);
+			}
+			Root.DeleteDirectory();
 		});
 	}
 	catch (SystemErrorT const &Error)
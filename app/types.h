@@ -12,10 +12,27 @@ typedef uint64_t IDBaseT;
 typedef StrictType(IDBaseT) NodeIndexT;
 typedef StrictType(IDBaseT) ChangeIndexT;
 typedef StrictType(IDBaseT) StorageIndexT;
-typedef StrictType(uint8_t) StorageReferenceCountT;
+typedef StrictType(IDBaseT) SegmentIndexT;
+typedef StrictType(uint64_t) StorageReferenceCountT;
+typedef StrictType(uint8_t) StorageReferenceCountV1T; // As CoreTransactorVersion1 messages encode it
 typedef uint64_t TimeT; // UTC seconds since Jan 1 1970
 
 typedef StorageIndexT StorageIDT;
 
+enum class StorageClassT : unsigned int
+{
+	File = 0, // A single file in storage/
+	Chunked = 1, // Content defined chunks in chunks/, listed in StorageChunks
+	Overlay = 2, // Changed extents in storage/ over the parent storage, listed in OverlayExtents
+	Packed = 3, // A range of a shared segment file in packs/, located by the Storage row
+	Inline = 4, // Kept in the Storage row itself
+};
+
+enum class StorageLayoutT : unsigned int
+{
+	Flat = 0, // storage/<id>
+	Sharded = 1, // storage/<low byte hex>/<second byte hex>/<id>
+};
+
 #endif
 
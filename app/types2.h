@@ -3,7 +3,11 @@
 
 #include "structtypes.h"
 
-typedef VariantT<std::vector<BytesChangeT>, TruncateT> StorageChangesT;
+// TruncateT empties the storage, ResizeT truncates or extends it with a hole, PunchHoleT zeros a range (without
+// changing the size) and releases its space where the filesystem allows.  StagedT writes the ranges of a staging
+// file (see StagedChangeT), after emptying the storage if Truncate is set; Checksum is the formatted hash of the
+// ranges' bytes in order.
+typedef VariantT<std::vector<BytesChangeT>, TruncateT, ResizeT, PunchHoleT, StagedT> StorageChangesT;
 
 struct DefineHeadT
 {
@@ -0,0 +1,67 @@
+#ifndef unsyncedfiles_h
+#define unsyncedfiles_h
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+
+#include "../ren-cxx-basics/error.h"
+#include "../ren-cxx-filesystem/path.h"
+
+// Files a transaction wrote that replaying its intent can't redo, and the directories it added them to.  They're
+// synced before the transaction commits.  Only collects while enabled.  Not thread safe.
+struct UnsyncedFilesT
+{
+	inline UnsyncedFilesT(bool Enabled) : Enabled(Enabled), SyncCount(0) {}
+
+	inline void Note(Filesystem::PathT const &Path)
+		{ if (Enabled) Files.insert(Path.Render()); }
+
+	// Call for the directory of each file created or renamed into place
+	inline void NoteDirectory(Filesystem::PathT const &Directory)
+		{ if (Enabled) Directories.insert(Directory.Render()); }
+
+	// Files first, so no directory entry is durable before the contents it names.  Files that are gone were
+	// released or renamed since they were noted.
+	inline void Sync(void)
+	{
+		for (auto const &Path : Files) SyncPath(Path, O_RDONLY);
+		for (auto const &Path : Directories) SyncPath(Path, O_RDONLY | O_DIRECTORY);
+		Clear();
+	}
+
+	inline void Clear(void)
+	{
+		Files.clear();
+		Directories.clear();
+	}
+
+	inline uint64_t GetSyncCount(void) const { return SyncCount; }
+
+	private:
+		inline void SyncPath(std::string const &Path, int Flags)
+		{
+			auto const Descriptor = open(Path.c_str(), Flags | O_CLOEXEC);
+			if (Descriptor < 0)
+			{
+				if (errno == ENOENT) return;
+				throw SYSTEM_ERROR << "Could not open " << Path << " to sync it: " << strerror(errno);
+			}
+			int Result;
+			while (((Result = fdatasync(Descriptor)) != 0) && (errno == EINTR)) {}
+			auto const Error = errno;
+			close(Descriptor);
+			if (Result != 0) throw SYSTEM_ERROR << "Error syncing " << Path << ": " << strerror(Error);
+			++SyncCount;
+		}
+
+		bool const Enabled;
+		uint64_t SyncCount;
+		std::unordered_set<std::string> Files;
+		std::unordered_set<std::string> Directories;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "writeplan.h"
+
+#include <algorithm>
+#include <climits>
+#include <map>
+
+WritePlanT::WritePlanT(std::vector<BytesChangeT> const &Changes)
+{
+	// Walk back from the last change, keeping only bytes no later change covers
+	std::map<uint64_t, uint64_t> Covered;
+	for (auto Change = Changes.rbegin(); Change != Changes.rend(); ++Change)
+	{
+		if (Change->Bytes().empty()) continue;
+		uint64_t const Start = Change->Offset();
+		uint64_t const End = Start + Change->Bytes().size();
+		auto const Data = &Change->Bytes()[0];
+
+		uint64_t Cursor = Start;
+		auto Next = Covered.upper_bound(Start);
+		if (Next != Covered.begin())
+		{
+			auto Previous = std::prev(Next);
+			Cursor = std::max(Cursor, Previous->second);
+		}
+		while (Cursor < End)
+		{
+			auto Following = Covered.upper_bound(Cursor);
+			auto const Stop = ((Following != Covered.end()) && (Following->first < End)) ? Following->first : End;
+			if (Stop > Cursor) Pieces.push_back(PieceT{Cursor, Data + (Cursor - Start), static_cast<size_t>(Stop - Cursor)});
+			if (Stop == End) break;
+			Cursor = Following->second;
+		}
+
+		// Merge the change into the covered ranges, joining any it touches
+		auto NewStart = Start;
+		auto NewEnd = End;
+		if ((Next != Covered.begin()) && (std::prev(Next)->second >= Start))
+		{
+			auto Previous = std::prev(Next);
+			NewStart = Previous->first;
+			NewEnd = std::max(NewEnd, Previous->second);
+			Covered.erase(Previous);
+		}
+		while ((Next != Covered.end()) && (Next->first <= End))
+		{
+			NewEnd = std::max(NewEnd, Next->second);
+			Next = Covered.erase(Next);
+		}
+		Covered[NewStart] = NewEnd;
+	}
+
+	std::sort(
+		Pieces.begin(),
+		Pieces.end(),
+		[](PieceT const &First, PieceT const &Second) { return First.Offset < Second.Offset; });
+	for (size_t Index = 0; Index < Pieces.size(); ++Index)
+	{
+		auto const &Piece = Pieces[Index];
+		if (!Runs.empty() && (Runs.back().Offset + Runs.back().Length == Piece.Offset))
+		{
+			Runs.back().Length += Piece.Length;
+			++Runs.back().PieceCount;
+		}
+		else Runs.push_back(RunT{Piece.Offset, Piece.Length, Index, 1});
+	}
+}
+
+std::vector<WritePlanT::RunT> const &WritePlanT::GetRuns(void) const
+	{ return Runs; }
+
+uint64_t WritePlanT::GetEnd(void) const
+{
+	if (Runs.empty()) return 0;
+	return Runs.back().Offset + Runs.back().Length;
+}
+
+void WritePlanT::Write(FileDescriptorT const &File, RunT const &Run, uint64_t Position) const
+{
+	std::vector<iovec> Vectors;
+	Vectors.reserve(std::min<size_t>(Run.PieceCount, IOV_MAX));
+	for (size_t Index = Run.FirstPiece; Index < Run.FirstPiece + Run.PieceCount; ++Index)
+	{
+		auto const &Piece = Pieces[Index];
+		Vectors.push_back(iovec{const_cast<uint8_t *>(Piece.Data), Piece.Length});
+		if ((Vectors.size() < IOV_MAX) && (Index + 1 < Run.FirstPiece + Run.PieceCount)) continue;
+		size_t Length = 0;
+		for (auto const &Vector : Vectors) Length += Vector.iov_len;
+		File.Write(Position, Vectors.data(), static_cast<int>(Vectors.size()));
+		Position += Length;
+		Vectors.clear();
+	}
+}
+
+void WritePlanT::Apply(FileDescriptorT const &File) const
+{
+	for (auto const &Run : Runs) Write(File, Run, Run.Offset);
+}
+
+void WritePlanT::Apply(uint8_t *Out) const
+{
+	for (auto const &Piece : Pieces) std::copy(Piece.Data, Piece.Data + Piece.Length, Out + Piece.Offset);
+}
+
+void WritePlanT::Apply(uint64_t Offset, uint8_t *Out, size_t Length) const
+{
+	auto const End = Offset + Length;
+	auto Piece = std::upper_bound(
+		Pieces.begin(),
+		Pieces.end(),
+		Offset,
+		[](uint64_t Offset, PieceT const &Piece) { return Offset < Piece.Offset; });
+	if (Piece != Pieces.begin()) --Piece;
+	for (; (Piece != Pieces.end()) && (Piece->Offset < End); ++Piece)
+	{
+		auto const Start = std::max(Offset, Piece->Offset);
+		auto const Stop = std::min(End, Piece->Offset + Piece->Length);
+		if (Start >= Stop) continue;
+		std::copy(
+			Piece->Data + (Start - Piece->Offset), 
+			Piece->Data + (Stop - Piece->Offset), 
+			Out + (Start - Offset));
+	}
+}
+
@@ -0,0 +1,55 @@
+#ifndef writeplan_h
+#define writeplan_h
+
+#include <vector>
+
+#include "filedescriptor.h"
+#include "types.h"
+#include "structtypes.h"
+
+// Resolves a batch of byte changes into the bytes that actually land: later changes win where they overlap,
+// and what's left is grouped into contiguous runs in offset order.  Pieces point into the changes, which must
+// outlive the plan.
+struct WritePlanT
+{
+	struct PieceT
+	{
+		uint64_t Offset;
+		uint8_t const *Data;
+		size_t Length;
+	};
+
+	struct RunT
+	{
+		uint64_t Offset;
+		uint64_t Length;
+		size_t FirstPiece;
+		size_t PieceCount;
+	};
+
+	WritePlanT(std::vector<BytesChangeT> const &Changes);
+
+	std::vector<RunT> const &GetRuns(void) const;
+
+	// One past the last byte written, or 0 if nothing is written
+	uint64_t GetEnd(void) const;
+
+	// Write Run to File starting at Position rather than the run's own offset
+	void Write(FileDescriptorT const &File, RunT const &Run, uint64_t Position) const;
+
+	// Write every run to File at its own offset, one pwritev per run
+	void Apply(FileDescriptorT const &File) const;
+
+	// Copy every run into Out at its own offset; Out must have room for GetEnd() bytes
+	void Apply(uint8_t *Out) const;
+
+	// Copy the planned bytes in [Offset, Offset + Length) into the Length bytes at Out
+	void Apply(uint64_t Offset, uint8_t *Out, size_t Length) const;
+
+	private:
+		std::vector<PieceT> Pieces;
+		std::vector<RunT> Runs;
+};
+
+#endif
+